@@ -1,3 +1,24 @@
 #pragma once
 
+#include "types.h"
+#include "thumbnail.h"
+
 void run_app(int argc, char** argv);
+
+void setup_loader_env();
+
+// Headless simulation, for the farm workers
+void init_vulkan_headless(AppState& state, uint32_t device_index);
+void cleanup_vulkan(AppState& state);
+void reset_compute_unifs(AppState& state);
+bool set_compute_unif(AppState& state, const string& name, vec4 val);
+MorphNodes run_headless_simulation(AppState& state);
+bool save_snapshot(AppState& state, const string& path);
+bool load_snapshot(AppState& state, const string& path);
+void unload_snapshot(AppState& state);
+bool export_mesh(AppState& state, const string& path,
+    MeshExportFormat format);
+bool start_thumbnails(AppState& state, MorphNodes& node_vecs,
+    uint32_t num_views, uint32_t size);
+void finish_thumbnails(AppState& state, const string& path_prefix,
+    PngWriterPool& pool);
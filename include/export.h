@@ -0,0 +1,60 @@
+#pragma once
+
+#include "utils.h"
+
+#include <thread>
+#include <atomic>
+
+enum MeshExportFormat {
+  // binary little endian PLY with the heat and source strength per
+  // vertex, and the edges and faces
+  EXPORT_PLY = 0,
+  // ASCII OBJ with the positions, edges (as lines) and faces
+  EXPORT_OBJ,
+
+  EXPORT_FORMATS_COUNT
+};
+
+const array<const char*, EXPORT_FORMATS_COUNT> EXPORT_FORMAT_NAMES = {
+  "ply", "obj"
+};
+
+// The nodes and topology to export. The inactive nodes are dropped and
+// the indices remapped on the way out.
+struct MeshExportData {
+  uint32_t iter_num = 0;
+  // xyz is the position, w the heat
+  vector<vec4> positions;
+  vector<float> sources;
+  vector<bool> active;
+  // pairs of node indices
+  vector<uint32_t> line_indices;
+  // triples of node indices
+  vector<uint32_t> triangle_indices;
+};
+
+// Writes the mesh to path, returns false on failure. The file is renamed
+// into place once complete.
+bool write_mesh_file(const string& path, MeshExportFormat format,
+    const MeshExportData& data);
+
+/*
+   Writes meshes on a worker thread, one at a time, so that large exports
+   don't stall the UI.
+*/
+struct MeshExporter {
+  // returns false if the previous export is still running
+  bool start(const string& path, MeshExportFormat format,
+      MeshExportData data);
+  bool busy() const { return running; }
+  // blocks until the running export is done
+  void wait();
+
+  ~MeshExporter();
+
+  thread worker;
+  atomic<bool> running{false};
+  // the result of the last finished export
+  atomic<bool> last_succeeded{false};
+  string last_path;
+};
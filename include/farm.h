@@ -0,0 +1,58 @@
+#pragma once
+
+#include "types.h"
+
+/*
+   A simulation run of the farm. The jobs file has one job per line:
+
+   name [seed=N] [iters=N] [samples=N] [inactive=N] [resume=path]
+     [checkpoint=1] [views=N] [view_size=N] [unif=x,y,z,w ...]
+
+   where unif is the name of a compute unif in morph.comp, and the
+   unifs that are not given keep their defaults. Blank lines and lines
+   starting with '#' are skipped. The name names the output files, so it
+   cannot contain '/' or '..'.
+   resume continues the run from a snapshot (see snapshot.h) with the
+   snapshot's nodes, seed and unifs, and checkpoint saves a snapshot of
+   the result to <name>.snap.
+   views renders the result from N angles around it (1 to 8), to
+   <name>.view<i>.png, each view_size pixels square (256 by default, at
+   most 4096).
+*/
+struct FarmJob {
+  string name;
+  uint32_t seed = 0;
+  uint32_t num_iters = 0;
+  int num_zygote_samples = 40;
+  int inactive_node_count = 1000;
+  vector<pair<string, vec4>> unif_vals;
+  string resume_path;
+  bool checkpoint = false;
+  // the number of thumbnail views, 0 for none
+  uint32_t num_views = 0;
+  uint32_t view_size = 256;
+  // the line the job was parsed from, sent to the workers as is
+  string spec;
+};
+
+// Returns false if the line is not a valid job, and reports why unless
+// it is blank or a comment
+bool parse_farm_job(const string& line, FarmJob& out_job);
+
+struct FarmOptions {
+  string jobs_path;
+  // gets the results: <name>.nodes and <name>.done per job, and
+  // metrics.csv with a row per job
+  string out_dir;
+  uint32_t num_workers = 1;
+};
+
+/*
+   Runs the jobs on num_workers worker processes, which are handed jobs
+   over a Unix domain socket as they finish. Worker i simulates on
+   physical device i (mod the device count).
+   Jobs with a .done marker in out_dir are skipped, so an interrupted
+   farm resumes where it stopped when rerun.
+   Returns the number of jobs that failed.
+*/
+int run_farm(const FarmOptions& options);
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "utils.h"
+
+/*
+   Snapshots hold the state of a simulation run after some number of
+   iters, so that the run can be resumed from there.
+
+   Layout:
+   SnapshotHeader
+   the sections, at the offsets given in the header:
+   SNAPSHOT_UNIF_NAMES: a SNAPSHOT_UNIF_NAME_LEN byte string per compute
+     unif, in the order of the values in the instance records
+   SNAPSHOT_INSTANCES: a record per instance, see SimInstance::pack
+   SNAPSHOT_COMPUTE_STORAGE: the ComputeStorage
+   SNAPSHOT_ATTRIBS: the node attributes in order, each node_count entries
+     in the GPU format (see node_attrib_format)
+*/
+
+const char SNAPSHOT_MAGIC[8] = {'M', 'M', 'S', 'N', 'A', 'P', '0', '1'};
+const uint32_t SNAPSHOT_VERSION = 1;
+const uint32_t SNAPSHOT_UNIF_NAME_LEN = 64;
+
+enum SnapshotSection {
+  SNAPSHOT_UNIF_NAMES = 0,
+  SNAPSHOT_INSTANCES,
+  SNAPSHOT_COMPUTE_STORAGE,
+  SNAPSHOT_ATTRIBS,
+
+  SNAPSHOT_SECTIONS_COUNT
+};
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version = SNAPSHOT_VERSION;
+  // the number of iterations run
+  uint32_t iter_num = 0;
+  uint32_t node_count = 0;
+  // 1 if the attributes are in the compact node format
+  uint32_t compact = 0;
+  uint32_t num_instances = 0;
+  uint32_t instance_queue_len = 0;
+  uint32_t num_user_unifs = 0;
+  uint32_t padding = 0;
+  uint64_t section_offsets[SNAPSHOT_SECTIONS_COUNT] = {0};
+  uint64_t section_sizes[SNAPSHOT_SECTIONS_COUNT] = {0};
+};
+
+struct SnapshotSectionData {
+  const void* data;
+  size_t size;
+};
+
+// Writes the header and the sections, filling in the section offsets.
+// The file is renamed into place once complete, so a crash while saving
+// leaves the previous snapshot intact.
+bool write_snapshot_file(const string& path, SnapshotHeader header,
+    const array<SnapshotSectionData, SNAPSHOT_SECTIONS_COUNT>& sections);
+
+/*
+   A snapshot file mapped into memory. The sections are read in place,
+   straight from the page cache.
+*/
+struct SnapshotFile {
+  bool open(const string& path);
+  void close();
+
+  bool is_open() const { return map_data != nullptr; }
+  const char* section(SnapshotSection section_index) const;
+  uint64_t section_size(SnapshotSection section_index) const;
+  string unif_name(uint32_t unif_index) const;
+
+  ~SnapshotFile();
+
+  string path;
+  int fd = -1;
+  const char* map_data = nullptr;
+  size_t map_size = 0;
+  SnapshotHeader header;
+};
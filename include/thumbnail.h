@@ -0,0 +1,49 @@
+#pragma once
+
+#include "utils.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+// Writes the RGBA8 pixels (rows top to bottom) as a PNG, returns false on
+// failure. The rows are filtered and deflated with the fixed Huffman
+// codes, which keeps the encoder small and does well on the mostly flat
+// renders. The file is renamed into place once complete.
+bool write_png_file(const string& path, uint32_t width, uint32_t height,
+    const vector<uint8_t>& rgba);
+
+/*
+   Encodes and writes PNGs on a pool of worker threads, so that the
+   images of a render are written in parallel and while the caller moves
+   on to the next job.
+*/
+struct PngWriterPool {
+  void start(uint32_t num_threads);
+  void submit(const string& path, uint32_t width, uint32_t height,
+      vector<uint8_t> rgba);
+  // blocks until the submitted images are written, returns the number
+  // that failed since the last wait
+  uint32_t wait();
+
+  ~PngWriterPool();
+
+  struct PngTask {
+    string path;
+    uint32_t width;
+    uint32_t height;
+    vector<uint8_t> rgba;
+  };
+
+  void run_worker();
+
+  vector<thread> workers;
+  mutex task_mutex;
+  condition_variable task_cond;
+  deque<PngTask> tasks;
+  // the tasks queued or being written
+  uint32_t num_pending = 0;
+  uint32_t num_failed = 0;
+  bool quitting = false;
+};
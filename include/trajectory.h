@@ -0,0 +1,169 @@
+#pragma once
+
+#include "utils.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+
+/*
+   Trajectory files hold snapshots of the node attributes over a run.
+
+   Layout:
+   TrajectoryHeader
+   a frame per snapshot: TrajectoryFrameHeader, then the attributes in the
+     header's attribs mask in order, each node_count entries in the GPU
+     format (see node_attrib_format), compressed if the header says so
+   the index: a TrajectoryIndexEntry per frame
+   TrajectoryFooter
+
+   The index is written when the file is closed, so a file without a
+   footer is incomplete. The nodes are split evenly between the header's
+   num_instances sweep instances, in order.
+*/
+
+const char TRAJECTORY_MAGIC[8] = {'M', 'M', 'T', 'R', 'A', 'J', '0', '1'};
+const char TRAJECTORY_INDEX_MAGIC[8] = {'M', 'M', 'T', 'I', 'D', 'X', '0', '1'};
+const uint32_t TRAJECTORY_VERSION = 1;
+
+enum TrajectoryCompression {
+  TRAJECTORY_UNCOMPRESSED = 0,
+  TRAJECTORY_ZSTD = 1
+};
+
+struct TrajectoryHeader {
+  char magic[8];
+  uint32_t version = TRAJECTORY_VERSION;
+  // the recorded attributes, bit i is set for attribute i
+  uint32_t attribs = 0;
+  // 1 if the attributes are in the compact node format
+  uint32_t compact = 0;
+  uint32_t compression = TRAJECTORY_UNCOMPRESSED;
+  uint32_t num_instances = 1;
+};
+
+struct TrajectoryFrameHeader {
+  // the number of iterations run when the frame was captured
+  uint32_t iter_num = 0;
+  uint32_t node_count = 0;
+  uint32_t raw_size = 0;
+  // the size of the payload in the file, equal to raw_size if uncompressed
+  uint32_t stored_size = 0;
+};
+
+struct TrajectoryIndexEntry {
+  uint32_t iter_num = 0;
+  uint32_t node_count = 0;
+  // the file offset of the frame's TrajectoryFrameHeader
+  uint64_t offset = 0;
+};
+
+struct TrajectoryFooter {
+  uint64_t index_offset = 0;
+  uint32_t frame_count = 0;
+  uint32_t padding = 0;
+  char magic[8];
+};
+
+// true if this build can write zstd compressed frames
+bool trajectory_zstd_supported();
+
+/*
+   Appends frames to a trajectory file on a writer thread, so that the
+   compression and IO overlap the simulation.
+   The frame data is read by the writer thread, and must stay valid until
+   wait_for_pending reports that the frame was written.
+*/
+struct TrajectoryWriter {
+  bool open(const string& path, uint32_t attribs, bool compact,
+      bool compress, uint32_t num_instances);
+  // queues a frame
+  void write_frame(uint32_t iter_num, uint32_t node_count,
+      const void* data, size_t size);
+  // blocks until at most max_pending frames are queued
+  void wait_for_pending(uint32_t max_pending);
+  // writes the queued frames and the index, and closes the file.
+  // Returns false if a frame or the index could not be written.
+  bool close();
+
+  bool is_open() const { return file != nullptr; }
+  uint32_t frame_count();
+  // the first write or compression error of the recording, empty if none
+  string first_error();
+
+  ~TrajectoryWriter();
+
+  struct PendingFrame {
+    TrajectoryFrameHeader header;
+    const void* data;
+  };
+
+  void run_writer();
+  void write_pending_frame(PendingFrame& frame);
+  void set_error(const string& message);
+
+  FILE* file = nullptr;
+  TrajectoryHeader header;
+  vector<TrajectoryIndexEntry> index;
+  vector<char> compressed;
+  // the frames after the first error are dropped, and the index is not
+  // written
+  string error;
+
+  thread writer_thread;
+  mutex queue_mutex;
+  condition_variable queue_cond;
+  // the front frame stays queued until it is written
+  deque<PendingFrame> queue;
+  bool closing = false;
+};
+
+/*
+   Reads the frames of a trajectory file, which is mapped into memory so
+   that seeking to any frame is constant time.
+   A prefetch thread pages in (and decompresses, for compressed files) the
+   frames around the last requested one, so that stepping through the
+   frames rarely waits on the disk.
+*/
+struct TrajectoryReader {
+  bool open(const string& path);
+  void close();
+
+  bool is_open() const { return map_data != nullptr; }
+  uint32_t frame_count() const { return num_frames; }
+  const TrajectoryIndexEntry& frame_entry(uint32_t frame_index) const;
+  // the last frame captured at or before iter_num, or frame 0
+  uint32_t find_frame(uint32_t iter_num) const;
+  // the size of the frame's attribute data
+  uint32_t frame_size(uint32_t frame_index) const;
+  // copies the frame's attribute data to dst, which must hold frame_size
+  // bytes, and prefetches the frames around it. Returns false if the
+  // frame's data is corrupt.
+  bool copy_frame(uint32_t frame_index, void* dst);
+
+  ~TrajectoryReader();
+
+  const TrajectoryFrameHeader& frame_header(uint32_t frame_index) const;
+  const char* frame_payload(uint32_t frame_index) const;
+  bool decode_frame(uint32_t frame_index, void* dst) const;
+  void run_prefetcher();
+
+  int fd = -1;
+  const char* map_data = nullptr;
+  size_t map_size = 0;
+  TrajectoryHeader header;
+  const TrajectoryIndexEntry* index = nullptr;
+  uint32_t num_frames = 0;
+
+  thread prefetch_thread;
+  mutex prefetch_mutex;
+  condition_variable prefetch_cond;
+  uint32_t prefetch_center = 0;
+  bool prefetch_requested = false;
+  bool stopping = false;
+  // the decompressed frames around prefetch_center, by frame index
+  map<uint32_t, shared_ptr<vector<char>>> decoded;
+};
@@ -1,11 +1,47 @@
 #pragma once
 
 #include "utils.h"
+#include "trajectory.h"
+#include "snapshot.h"
+#include "export.h"
 #include "vk_mem_alloc.h"
 
+#include <chrono>
+
 const int MAX_NUM_USER_UNIFS = 100;
+// constrained by maxImageDimension1D = 16384
+// but also by this bug: cannot imageStore for index >= 4096
+// Note: the shaders get this as MAX_NUM_NODES, see shader_defines
+const uint32_t MAX_NUM_VERTICES = 4096;
 // TODO - increase later
 const uint32_t MAX_STORAGE_QUEUE_LEN = 1*1000; 
+// the max number of simulation instances stepped together in a sweep
+// Note: the shaders get this as MAX_NUM_INSTANCES, see shader_defines
+const uint32_t MAX_NUM_INSTANCES = 16;
+// compute workgroup x size used until one is benchmarked for the device
+const uint32_t DEFAULT_WORKGROUP_SIZE = 256;
+// the present modes that can be picked in the UI. FIFO is always
+// supported, the others fall back to it
+const array<VkPresentModeKHR, 3> PRESENT_MODES = {
+  VK_PRESENT_MODE_FIFO_KHR,
+  VK_PRESENT_MODE_MAILBOX_KHR,
+  VK_PRESENT_MODE_IMMEDIATE_KHR
+};
+const array<const char*, 3> PRESENT_MODE_NAMES = {
+  "fifo (vsync)", "mailbox", "immediate"
+};
+
+// what the tube radius follows, see tubes.comp
+enum TubeRadiusMode {
+  TUBE_RADIUS_CONSTANT = 0,
+  TUBE_RADIUS_HEAT,
+  TUBE_RADIUS_HEAT_GEN,
+
+  TUBE_RADIUS_MODES_COUNT
+};
+const array<const char*, TUBE_RADIUS_MODES_COUNT> TUBE_RADIUS_MODE_NAMES = {
+  "constant", "heat", "heat generation"
+};
 
 class AppState;
 
@@ -19,6 +55,14 @@ enum Attributes {
   ATTRIBUTES_COUNT
 };
 
+// A set of attributes, bit i is set for attribute i
+typedef uint32_t AttribMask;
+const AttribMask ALL_ATTRIBS = (1u << ATTRIBUTES_COUNT) - 1;
+
+constexpr AttribMask attrib_bit(uint32_t attrib_index) {
+  return 1u << attrib_index;
+}
+
 enum PipelineTypes {
   POINTS_PIPELINE,
   LINES_PIPELINE,
@@ -40,11 +84,30 @@ struct Camera {
 
 struct Controls {
   bool show_dev_console = true;
+  // the frame rate limit, 0 for none
   int target_fps = 30;
+  // index into PRESENT_MODES
+  int present_mode = 0;
+  // cull the points and lines outside the view on the GPU
+  bool gpu_cull = true;
+  // see CullUniforms::lod_pixels. The thinning drops points, so it's
+  // off unless asked for
+  float lod_pixels = 0.0f;
+  // spend the time left in a frame on the async simulation, instead of
+  // blocking on the frame limit or vsync
+  bool sim_first = false;
 
   // rendering
   array<bool, PIPELINES_COUNT> pipeline_toggles =
     {true, true, false};
+  // draw the lines as tubes, see tubes.comp
+  bool draw_tubes = false;
+  float tube_radius = 0.05f;
+  int tube_radius_mode = TUBE_RADIUS_HEAT;
+  // show the node under the cursor in the inspector, see NodePicker
+  bool pick_nodes = true;
+  // keep inspecting the same node when the cursor moves on
+  bool pin_inspected_node = false;
 
   // simulation
   bool log_input_nodes = false;
@@ -57,6 +120,37 @@ struct Controls {
   bool log_durations = false;
   int num_zygote_samples = 40;
   int inactive_node_count = 1000;
+  bool compact_nodes = false;
+  // run the simulation on the compute queue, if the device has one
+  bool async_sim = true;
+  // sort the nodes spatially every this many iters, 0 to disable
+  int reorder_interval = 0;
+  // parameter sweep: the number of instances simulated together, each
+  // with its own seed. Component sweep_comp of compute unif
+  // sweep_unif_index is spread over [sweep_min, sweep_max] across them.
+  int num_instances = 1;
+  // the seed of the first instance, instance k uses seed + k
+  int seed = 0;
+  int sweep_unif_index = 0;
+  int sweep_comp = 0;
+  float sweep_min = 0.0f;
+  float sweep_max = 1.0f;
+  // trajectory recording, see trajectory.h
+  bool record_next_run = false;
+  int record_interval = 10;
+  array<bool, ATTRIBUTES_COUNT> record_attribs =
+    {true, false, true, false, false};
+  bool record_compress = true;
+  char record_path[256] = "trajectory.mtraj";
+  // trajectory playback
+  char playback_path[256] = "trajectory.mtraj";
+  int playback_frame = 0;
+  bool playing_trajectory = false;
+  // snapshot save/load, see snapshot.h
+  char snapshot_path[256] = "run.msnap";
+  // mesh export, see export.h
+  char export_path[256] = "mesh.ply";
+  int export_format = EXPORT_PLY;
   // for the simulation/animation pane
   int num_iters = 0;
   bool animating_sim = true;
@@ -84,38 +178,132 @@ struct UserUnif {
       float drag_speed);
 };
 
+// The ptrs of a circular buffer queue
+// Note: the layout must match the QueuePtrs struct in morph.comp
+struct QueuePtrs {
+  array<uint32_t, 2> start_ptrs = {0, 0};
+  array<uint32_t, 2> end_ptrs = {0, 0};
+};
+
+// Note: the layout must match the ComputeStorage block in morph.comp
 struct ComputeStorage {
   array<uint32_t, 2> step_counters = {0, 0};
 
-  // for circular buffer queue
-  array<uint32_t, 2> start_ptrs = {0, 0};
-  array<uint32_t, 2> end_ptrs = {0, 0};
+  // a queue per simulation instance, instance k uses queues[k] and
+  // the cells queue_mem[k * queue_len, (k + 1) * queue_len)
+  array<QueuePtrs, MAX_NUM_INSTANCES> queues;
+
+  // worklist of the nodes that are stepped. nodes spliced in during an
+  // iter are appended to it, and are stepped from the next iter on
+  uint32_t work_len = 0;
+  // work_len at the start of each iter
+  array<uint32_t, 2> work_iter_lens = {0, 0};
+  // VkDispatchIndirectCommand for the next iter
+  array<uint32_t, 3> dispatch_args = {0, 1, 1};
+  array<uint32_t, MAX_NUM_VERTICES> work_list = {0};
+
   array<uint32_t, MAX_STORAGE_QUEUE_LEN> queue_mem = {0};
 
   ComputeStorage();
 };
 
+// The view and proj are in CameraUniforms, so that moving the camera
+// doesn't change the recorded draws
 struct RenderPushConstants {
   mat4 model = mat4(1.0);
+  array<vec4, MAX_NUM_USER_UNIFS> user_unif_vals;
+
+  RenderPushConstants(mat4 model, const vector<UserUnif>& user_unifs);
+};
+
+const uint32_t MAX_SWAPCHAIN_IMAGES = 8;
+// each view of an offscreen render uses a slot of the camera buffer,
+// after the slots of the frames in flight
+const uint32_t MAX_THUMBNAIL_VIEWS = 8;
+// every device supports at least this maxImageDimension2D and
+// maxFramebufferWidth/Height, so any farm worker can render the views
+const uint32_t MAX_THUMBNAIL_SIZE = 4096;
+
+// the format of the node id attachment, and the id cleared to where
+// there's no node
+const VkFormat NODE_ID_FORMAT = VK_FORMAT_R32_UINT;
+const uint32_t NO_NODE_ID = 0xffffffff;
+
+// Written every frame to the camera uniform buffer slot of the frame in
+// flight being rendered
+// Note: the layout must match CameraUnifs in basic.vert
+struct CameraUniforms {
   mat4 view = mat4(1.0);
   mat4 proj = mat4(1.0);
-  array<vec4, MAX_NUM_USER_UNIFS> user_unif_vals;
+};
+
+// The per frame inputs of the cull pass. The point and line indices are
+// culled from one list, the points followed by the lines, and the
+// culled indices keep the same layout.
+// Note: the layout must match CullUnifs in cull.comp
+struct CullUniforms {
+  mat4 view_proj = mat4(1.0);
+  array<mat4, MAX_NUM_INSTANCES> models;
+  // per instance, the (first, count) of its points in xy and of its
+  // lines in zw, in the combined index list
+  array<uvec4, MAX_NUM_INSTANCES> ranges;
+  uint32_t instance_count = 0;
+  uint32_t point_index_count = 0;
+  uint32_t line_index_count = 0;
+  float viewport_height = 1.0f;
+  // points closer than this many pixels to their neighbor are thinned
+  // out, 0 to draw all of them
+  float lod_pixels = 0.0f;
+};
 
-  RenderPushConstants(mat4 model, mat4 view, mat4 proj,
-      const vector<UserUnif>& user_unifs);
+// A tube segment per line, written by the tube pass and read per
+// instance by tube.vert. The positions are in the space of the nodes.
+// Note: the layout must match Segment in tubes.comp and the inputs of
+// tube.vert
+struct TubeSegment {
+  // xyz is the position of the end, w the radius there
+  vec4 start;
+  vec4 end;
+  // the heat of the start and end in xy, their heat generation in zw
+  vec4 heat;
+  // the node indices of the start and end in xy, for the node ids
+  uvec4 nodes;
 };
 
+// Note: the layout must match PushConstants in tubes.comp
+struct TubePushConstants {
+  uint32_t point_index_count;
+  uint32_t line_count;
+  uint32_t radius_mode;
+  float radius;
+};
+
+// The user unifs are per instance, see SimInstance
 struct ComputePushConstants {
-  uint32_t node_count;
-  uint32_t inactive_node_count;
   uint32_t iter_num;
   uint32_t queue_len;
-  array<vec4, MAX_NUM_USER_UNIFS> user_unif_vals;
+  uint32_t instance_count;
+  uint32_t node_count;
 
-  ComputePushConstants(uint32_t node_count, uint32_t inactive_node_count,
-      uint32_t iter_num,
-      uint32_t queue_len,
-      const vector<UserUnif>& user_unifs);
+  ComputePushConstants(uint32_t iter_num, uint32_t queue_len,
+      uint32_t instance_count, uint32_t node_count);
+};
+
+// A simulation instance, one of the contiguous node ranges in the
+// node buffers
+struct SimInstance {
+  uint32_t node_offset = 0;
+  // includes the active and inactive nodes
+  uint32_t node_count = 0;
+  uint32_t inactive_node_count = 0;
+  uint32_t seed = 0;
+  vector<vec4> user_unif_vals;
+
+  // the size of the record written by pack, which must match the
+  // Instance struct in morph.comp
+  static VkDeviceSize record_size(uint32_t num_user_unifs);
+  void pack(uint32_t num_user_unifs, void* dst) const;
+  static SimInstance unpack(uint32_t num_user_unifs, const void* src);
 };
 
 struct MorphNode {
@@ -131,6 +319,17 @@ struct MorphNode {
       vec4 data, vec4 top_data);
 };
 
+// The GPU format of each attribute.
+// The compact format stores vel and data as fp16 and the neighbor indices
+// in neighbors and top_data as int16 (the -1/-2 sentinels included),
+// 48 bytes per node instead of 80.
+VkFormat node_attrib_format(bool compact, uint32_t attrib_index);
+uint32_t node_attrib_stride(bool compact, uint32_t attrib_index);
+// The GPU format of the per node normals written by the normals pass,
+// fp16 in the compact format
+VkFormat node_normal_format(bool compact);
+uint32_t node_normal_stride(bool compact);
+
 struct MorphNodes {
   vector<vec4> pos_vec;
   vector<vec4> vel_vec;
@@ -143,27 +342,183 @@ struct MorphNodes {
   MorphNode node_at(size_t i) const;
 
   array<void*, ATTRIBUTES_COUNT> data_ptrs();
+  array<vector<vec4>*, ATTRIBUTES_COUNT> attrib_vecs();
+
+  // convert an attribute to/from its GPU format, dst/src hold
+  // node_attrib_stride bytes per node
+  void pack_attrib(uint32_t attrib_index, bool compact, void* dst);
+  void unpack_attrib(uint32_t attrib_index, bool compact, const void* src);
 };
 
 string raw_node_str(MorphNode const& node);
 
-// A single buffer in the double-buffered simulation
+// The number of buffer states in the ring. The simulation ping-pongs
+// between two of them while the last result is rendered from another.
+const uint32_t NUM_BUFFER_STATES = 3;
+
+// A single buffer state in the simulation ring
 struct BufferState {
-  array<VkBuffer, ATTRIBUTES_COUNT> vert_buffers;
-  array<VmaAllocation, ATTRIBUTES_COUNT> vert_buffer_allocs;
+  // the offsets of the attribute buffers in AppState::node_arena
+  array<VkDeviceSize, ATTRIBUTES_COUNT> vert_offsets;
   array<VkBufferView, ATTRIBUTES_COUNT> vert_buffer_views;
+  // the node normals of this state, see normals.comp
+  VkDeviceSize nor_offset;
+  VkBufferView nor_buffer_view;
 
   VkDescriptorSet render_desc_set = VK_NULL_HANDLE;
-  VkDescriptorSet compute_desc_set = VK_NULL_HANDLE;
+  // compute_desc_sets[i] reads this state and writes buffer state i,
+  // the entry for this state itself is unused
+  array<VkDescriptorSet, NUM_BUFFER_STATES> compute_desc_sets;
+  // the serial of the last frame that reads this state, it must finish
+  // before the state is written again
+  uint64_t last_read_frame = 0;
 
   BufferState();
 };
 
+// A simulation running on the compute queue. It is submitted one
+// reorder chunk at a time since the reorder runs on the host.
+struct SimJob {
+  bool in_flight = false;
+  // set if another run was requested while this one was in flight
+  bool restart = false;
+  uint32_t next_iter = 0;
+  uint32_t num_iters = 0;
+  VkCommandBuffer cmd_buffer = VK_NULL_HANDLE;
+};
+
+// The cull pass outputs of a frame in flight
+struct CullTarget {
+  // the CullUniforms followed by the indirect draw args of each
+  // instance of the point and line pipelines, at cull_args_offset.
+  // Persistently mapped, both are written by the host each frame.
+  VkBuffer args_buffer;
+  VmaAllocation args_alloc;
+  char* args_data = nullptr;
+  // the culled indices, 32-bit
+  VkBuffer index_buffer = VK_NULL_HANDLE;
+  VmaAllocation index_alloc;
+  VkDeviceSize index_capacity = 0;
+  // reads buffer state i
+  array<VkDescriptorSet, NUM_BUFFER_STATES> desc_sets;
+};
+
+// Renders the nodes without a swapchain, a view per layer of the color
+// image, see start_thumbnails
+struct OffscreenTarget {
+  uint32_t size = 0;
+  uint32_t num_views = 0;
+  VkImage color_img = VK_NULL_HANDLE;
+  VmaAllocation color_alloc;
+  // a view and framebuffer per layer
+  vector<VkImageView> layer_views;
+  vector<VkFramebuffer> framebuffers;
+  // shared by the views, each pass clears it
+  VkImage depth_img;
+  VmaAllocation depth_alloc;
+  VkImageView depth_view;
+  // the layers in order, tightly packed RGBA8, persistently mapped
+  VkBuffer readback_buffer;
+  VmaAllocation readback_alloc;
+  uint8_t* readback_data = nullptr;
+  VkCommandBuffer cmd_buffer = VK_NULL_HANDLE;
+  VkFence fence;
+  bool in_flight = false;
+  // the node ids, shared by the views like the depth. Unused, but the
+  // pipelines write them
+  VkImage id_img;
+  VmaAllocation id_alloc;
+  VkImageView id_view;
+  // set once the render pass and graphics pipelines exist
+  bool has_pipelines = false;
+};
+
+// Picks the node under the cursor from the node id attachment. Each
+// frame copies the id under the cursor to the slot of its frame in
+// flight, which is read the next time the slot comes around, once the
+// frame's fence has signaled. See update_node_pick.
+struct NodePicker {
+  // a node id per frame in flight, persistently mapped
+  VkBuffer readback_buffer;
+  VmaAllocation readback_alloc;
+  uint32_t* readback_data = nullptr;
+  // the texel each slot was copied from, (-1, -1) if it holds no pick
+  vector<ivec2> slot_texels;
+  // the texel under the cursor this frame, (-1, -1) if the cursor is
+  // not over the scene
+  ivec2 cursor_texel = ivec2(-1);
+  // the texel and node of the newest pick read back, -1 for no node
+  ivec2 picked_texel = ivec2(-1);
+  int picked_node = -1;
+};
+
+// a node inspector slot holds a vec4 per attribute, each at the start of
+// its vec4 whatever the node format, then the queue ptrs
+const size_t NODE_INSPECTOR_SLOT_SIZE =
+  sizeof(vec4) * ATTRIBUTES_COUNT + sizeof(QueuePtrs);
+
+// What a slot of the node inspector readback was copied from
+struct NodeInspectorRead {
+  // -1 if the slot holds no read
+  int node_index = -1;
+  uint32_t instance_index = 0;
+  bool compact = false;
+  bool has_queue = false;
+};
+
+/*
+   The node shown in the inspector. The frames copy its attributes, and
+   its instance's queue while no simulation is in flight, out of the
+   buffers into a slot per frame in flight, which is read once the frame
+   is done, as with NodePicker. See record_node_inspect.
+*/
+struct NodeInspector {
+  // a slot of NODE_INSPECTOR_SLOT_SIZE bytes per frame in flight,
+  // persistently mapped
+  VkBuffer readback_buffer;
+  VmaAllocation readback_alloc;
+  char* readback_data = nullptr;
+  vector<NodeInspectorRead> slot_reads;
+  // the node to inspect, -1 for none
+  int node_index = -1;
+  // what the node was last copied from, it's copied again when they
+  // change
+  int copied_node = -1;
+  int copied_buf_index = -1;
+  uint64_t copied_scene_version = 0;
+  // the last frame that copied the queue, which must finish before the
+  // compute storage is rewritten
+  uint64_t queue_read_frame = 0;
+  // the newest read, of node shown_node (-1 for none)
+  int shown_node = -1;
+  MorphNode node;
+  uint32_t instance_index = 0;
+  bool has_queue = false;
+  QueuePtrs queue;
+};
+
 struct AppState {
-  array<BufferState, 2> buffer_states;
+  array<BufferState, NUM_BUFFER_STATES> buffer_states;
+  // holds the attribute buffers of all of the buffer states
+  VkBuffer node_arena;
+  VmaAllocation node_arena_alloc;
+  // the published buffer state, which holds the newest complete result
+  // and is the one rendered
   int result_buffer = 0;
+  // the pair of buffer states the simulation runs in, iteration i reads
+  // sim_buffers[i & 1] and writes the other
+  array<uint32_t, 2> sim_buffers = {1, 2};
   // number of vertices currently in the vertex buffers
   uint32_t node_count = 0;
+  // the instances the nodes are split into, see set_initial_sim_data
+  vector<SimInstance> instances;
+  // the length of the queue region of each instance
+  uint32_t instance_queue_len = MAX_STORAGE_QUEUE_LEN;
+  // the instance records read by morph.comp
+  VkBuffer instance_buffer;
+  VmaAllocation instance_buffer_alloc;
+  // whether the buffers are in the compact node format
+  bool compact_nodes = false;
 
   VmaAllocator allocator;
 
@@ -178,6 +533,26 @@ struct AppState {
 
   GLFWwindow* win = nullptr;
   bool framebuffer_resized = false;
+  // frame pacing, see pace_frame
+  chrono::steady_clock::time_point frame_start;
+  chrono::steady_clock::time_point next_frame_deadline;
+  // the measured frame time, smoothed
+  float frame_secs = 1.0f / 30.0f;
+  // the number of frames left to render before the loop idles, see
+  // request_redraw
+  uint32_t redraw_frames = 0;
+  // the inputs of the last simulation run, see sim_inputs_key
+  string last_sim_inputs;
+  // set for the farm workers, which only simulate and have no window,
+  // surface or swapchain
+  bool headless = false;
+  // picks the physical device if there are several
+  uint32_t device_index = 0;
+  // the Vulkan version of the instance, 1.1 if the loader has it
+  uint32_t api_version = VK_API_VERSION_1_0;
+  // whether morph.comp can aggregate its queue ops per subgroup, see
+  // reserve_queue_ptrs in morph.comp
+  bool has_subgroup_ballot = false;
 
   PFN_vkDestroyDebugUtilsMessengerEXT destroy_debug_utils;
   
@@ -189,6 +564,55 @@ struct AppState {
   uint32_t target_family_index;
   VkQueue queue;
 
+  // The queue the simulation is submitted to. Either from a compute-only
+  // family or a second queue in the graphics family.
+  // Only used if has_async_compute, which also requires timeline semaphores.
+  bool has_async_compute = false;
+  uint32_t compute_family_index;
+  VkQueue compute_queue;
+  VkCommandPool compute_cmd_pool;
+  // timeline semaphore counting the submitted simulation chunks,
+  // the frames wait on the chunk that produced the published state
+  VkSemaphore sim_sema;
+  uint64_t sim_sema_value = 0;
+  uint64_t published_sim_value = 0;
+  VkFence sim_fence;
+  SimJob sim_job;
+
+  // records the run started after controls.record_next_run is set,
+  // every traj_interval-th iter
+  TrajectoryWriter traj_writer;
+  bool recording = false;
+  AttribMask traj_attribs = 0;
+  uint32_t traj_interval = 1;
+  // host visible ring the frames are copied to by the simulation,
+  // frame i goes to slot i % TRAJECTORY_RING_SLOTS
+  VkBuffer traj_ring;
+  VmaAllocation traj_ring_alloc;
+  char* traj_ring_data = nullptr;
+  VkDeviceSize traj_slot_size = 0;
+  uint64_t traj_frame_seq = 0;
+  // the iter nums of the frames captured by the chunk being simulated
+  vector<uint32_t> traj_chunk_frames;
+
+  // the trajectory being played back, which replaces the simulation
+  // results while open
+  TrajectoryReader traj_reader;
+  // the frame in the published buffer state, -1 if none
+  int shown_traj_frame = -1;
+
+  // while a snapshot is loaded, the runs start from it instead of from
+  // the generated initial data
+  SnapshotFile snapshot;
+  // the iter the current run started from
+  uint32_t sim_base_iter = 0;
+  // the number of iters run to get the published buffer state
+  uint32_t result_iter_num = 0;
+
+  MeshExporter mesh_exporter;
+  // headless only, created on the first use
+  OffscreenTarget offscreen;
+
   VkSurfaceCapabilitiesKHR surface_caps;
   VkSurfaceFormatKHR target_format;
   VkPresentModeKHR target_present_mode;
@@ -199,6 +623,8 @@ struct AppState {
   vector<VkImage> swapchain_images;
   vector<VkImageView> swapchain_img_views;
 
+  // shared by the graphics pipelines, only the attributes basic.vert
+  // takes as input
   vector<VkVertexInputBindingDescription> vert_binding_descs;
   vector<VkVertexInputAttributeDescription> vert_attr_descs;
 
@@ -206,31 +632,104 @@ struct AppState {
   VkDescriptorSetLayout render_desc_set_layout;
   VkDescriptorSetLayout compute_desc_set_layout;
 
+  // the scene is drawn in render_pass, over the color, depth and node id
+  // attachments, then ImGui in ui_render_pass over the color alone
   VkRenderPass render_pass;
+  VkRenderPass ui_render_pass;
   VkPipelineLayout render_pipeline_layout;
   array<VkPipeline, PIPELINES_COUNT> graphics_pipelines;
 
   VkPipelineLayout compute_pipeline_layout;
   VkPipeline compute_pipeline;
+  // the normals pass, shares the compute pipeline layout
+  VkPipeline normals_pipeline;
+  uint32_t workgroup_size = DEFAULT_WORKGROUP_SIZE;
+  // true once workgroup_size was benchmarked or loaded from the cache
+  bool workgroup_size_tuned = false;
 
   vector<VkFramebuffer> swapchain_framebuffers;
+  vector<VkFramebuffer> ui_framebuffers;
 
   // contains the index data for rendering with each different
   // graphics pipeline
   array<VkBuffer, PIPELINES_COUNT> index_buffers;
   array<VmaAllocation, PIPELINES_COUNT> index_buffer_allocs;
+  // the capacity of each index buffer in bytes, 0 if not yet created
+  array<VkDeviceSize, PIPELINES_COUNT> index_buffer_sizes;
+  VmaPool index_pool;
   array<uint32_t, PIPELINES_COUNT> index_counts;
+  // the (first index, index count) of each instance in each index buffer
+  array<vector<pair<uint32_t, uint32_t>>, PIPELINES_COUNT>
+    instance_index_ranges;
+  VkIndexType index_type = VK_INDEX_TYPE_UINT32;
 
   VkCommandPool cmd_pool;
+  // the primary command buffer of each swapchain image, re-recorded every
+  // frame to execute the secondaries below
   vector<VkCommandBuffer> cmd_buffers;
+  // the serial of the frame last submitted to each swapchain image, its
+  // command buffers are in use until that frame is done
+  vector<uint64_t> image_serials;
+  // the scene draws for each frame in flight and buffer state. They are
+  // only re-recorded when scene_version has moved on since, see
+  // invalidate_scene_cmds
+  vector<array<VkCommandBuffer, NUM_BUFFER_STATES>> scene_cmd_buffers;
+  vector<array<uint64_t, NUM_BUFFER_STATES>> scene_cmd_versions;
+  uint64_t scene_version = 1;
+  // the ImGui draws of each swapchain image, re-recorded every frame
+  vector<VkCommandBuffer> imgui_cmd_buffers;
+  // GPU culling of the point and line draws, see cull.comp
+  VkDescriptorSetLayout cull_desc_set_layout;
+  VkPipelineLayout cull_pipeline_layout;
+  VkPipeline cull_pipeline;
+  // the point indices followed by the line indices, 32-bit, the input
+  // of the cull and tube passes
+  VkBuffer cull_source_buffer = VK_NULL_HANDLE;
+  VmaAllocation cull_source_alloc;
+  VkDeviceSize cull_source_capacity = 0;
+  vector<CullTarget> cull_targets;
+  VkDeviceSize cull_args_offset = 0;
+  // the lines drawn as tubes, see tubes.comp and tube.vert
+  VkDescriptorSetLayout tube_desc_set_layout;
+  VkPipelineLayout tube_gen_pipeline_layout;
+  VkPipeline tube_gen_pipeline;
+  // shares the render pipeline layout
+  VkPipeline tube_pipeline;
+  // the segment of each line, rewritten every frame
+  VkBuffer tube_segment_buffer = VK_NULL_HANDLE;
+  VmaAllocation tube_segment_alloc;
+  VkDeviceSize tube_segment_capacity = 0;
+  // the unit tube drawn per segment, the vertices followed by the
+  // 16-bit indices at tube_mesh_index_offset
+  VkBuffer tube_mesh_buffer;
+  VmaAllocation tube_mesh_alloc;
+  VkDeviceSize tube_mesh_index_offset = 0;
+  uint32_t tube_mesh_index_count = 0;
+  // per frame in flight, tube_desc_sets[i][j] reads buffer state j
+  vector<array<VkDescriptorSet, NUM_BUFFER_STATES>> tube_desc_sets;
+  // CameraUniforms slots, one per frame in flight followed by the
+  // thumbnail views, persistently mapped
+  VkBuffer camera_buffer;
+  VmaAllocation camera_buffer_alloc;
+  char* camera_buffer_data = nullptr;
+  VkDeviceSize camera_slot_size = 0;
   
   vector<VkSemaphore> img_available_semas;
   vector<VkSemaphore> render_done_semas;
   vector<VkFence> in_flight_fences;
+  // the serial of the frame last submitted with each in-flight fence
+  vector<uint64_t> in_flight_serials;
+  uint64_t frame_serial = 0;
 
   VkImage depth_img;
   VmaAllocation depth_img_alloc;
   VkImageView depth_img_view;
+  // the index of the node drawn at each pixel, NO_NODE_ID if none
+  VkImage id_img;
+  VmaAllocation id_img_alloc;
+  VkImageView id_img_view;
+  NodePicker picker;
+  NodeInspector inspector;
 
   size_t current_frame;
  
@@ -40,6 +40,11 @@ string ivec4_str(ivec4 v);
 
 extern const char* INSTRUCTIONS_STRING;
 
+// Integer division, rounded up
+inline uint32_t div_ceil(uint32_t num, uint32_t denom) {
+  return (num + denom - 1) / denom;
+}
+
 // Taken from:
 // https://stackoverflow.com/questions/2590677/how-do-i-combine-hash-values-in-c0x
 template <class T>
@@ -3,8 +3,11 @@
 
 layout(location = 0) in vec3 fs_nor;
 layout(location = 1) in vec3 fs_col;
+layout(location = 2) flat in uint fs_node;
 
 layout(location = 0) out vec4 out_color;
+// the node id attachment, read back to pick the node under the cursor
+layout(location = 1) out uint out_node;
 
 void main() {
   vec3 world_light_dir = normalize(vec3(1.0,1.0,1.0));
@@ -16,5 +19,6 @@ void main() {
   //col = debug_render ? fs_col : col;
 
   out_color = vec4(col, 1.0);  
+  out_node = fs_node;
 }
 
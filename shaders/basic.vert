@@ -1,10 +1,9 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
+// Note: the layout must match RenderPushConstants in types.h
 layout(push_constant) uniform Unifs {
   mat4 model;
-  mat4 view;
-  mat4 proj;
 
 // BEGIN_USER_UNIFS
   // comps 1 min 0.0 max 4.0 speed 0.1 def 3.0
@@ -16,69 +15,29 @@ layout(push_constant) uniform Unifs {
 // END_USER_UNIFS
 } unif;
 
+// Only pos and vel are bound as inputs, see RENDER_VERT_ATTRIBS in
+// app.cpp. The locations are the attribute indices, and the normals
+// computed by normals.comp follow them.
 layout(location = 0) in vec4 vs_pos;
 layout(location = 1) in vec4 vs_vel;
-layout(location = 2) in vec4 vs_neighbors;
-layout(location = 3) in vec4 vs_data;
-layout(location = 4) in vec4 vs_top_data;
+layout(location = 5) in vec4 vs_nor;
 
-layout(binding = 0, rgba32f) uniform readonly imageBuffer buf_pos;
-layout(binding = 1, rgba32f) uniform readonly imageBuffer buf_vel;
-layout(binding = 2, rgba32f) uniform readonly imageBuffer buf_neighbors;
-layout(binding = 3, rgba32f) uniform readonly imageBuffer buf_data;
-layout(binding = 4, rgba32f) uniform readonly imageBuffer buf_top_data;
+// Note: the layout must match CameraUniforms in types.h, and the binding
+// RENDER_CAMERA_BINDING in app.cpp
+layout(binding = 0) uniform CameraUnifs {
+  mat4 view;
+  mat4 proj;
+} cam;
 
 layout(location = 0) out vec3 fs_nor;
 layout(location = 1) out vec3 fs_col;
-
-// Returns the normal as xyz, and length as w.
-// If v is a zero-vec, returns length 0 and a norm of (1,0,0)
-vec4 safe_norm(vec3 v) {
-  float len = length(v);
-  vec3 norm = len == 0.0 ? vec3(1.0,0.0,0.0) : v / len;
-  return vec4(norm, len);
-}
-
-// Note: copied from morph.comp
-vec3 node_normal(vec3 node_pos, vec4 node_neighbors) {
-  vec3 nor = vec3(0.0,1.0,0.0);
-  for (int i = 0; i < 4; ++i) {
-    int i_a = int(node_neighbors[i]);
-    int i_b = int(node_neighbors[(i + 1) % 4]);
-    if (i_a != -1 && i_b != -1) {
-      vec3 p_a = imageLoad(buf_pos, i_a).xyz;
-      vec3 p_b = imageLoad(buf_pos, i_b).xyz;
-      // TODO - why is this the 'up' direction, seems like the negative
-      // sign should be unneccessary
-      nor = safe_norm(-cross(p_a - node_pos, p_b - node_pos)).xyz;
-      break;
-    }
-  }
-  return nor;
-}
-
-// TODO - use this in morph.comp, too?
-vec3 avg_node_normal(vec3 node_pos, vec4 node_neighbors) {
-  vec3 avg_nor = vec3(0.0);
-  int num_nors = 0;
-  for (int i = 0; i < 4; ++i) {
-    int i_a = int(node_neighbors[i]);
-    int i_b = int(node_neighbors[(i + 1) % 4]);
-    if (i_a != -1 && i_b != -1) {
-      vec3 p_a = imageLoad(buf_pos, i_a).xyz;
-      vec3 p_b = imageLoad(buf_pos, i_b).xyz;
-      // TODO - why is this the 'up' direction, seems like the negative
-      // sign should be unneccessary
-      avg_nor += normalize(-cross(p_a - node_pos, p_b - node_pos));
-      num_nors += 1;
-    }
-  }
-  return avg_nor / num_nors;
-}
+// the index of the node, written to the node id attachment. Triangles
+// take it from their first vertex.
+layout(location = 2) flat out uint fs_node;
 
 void main() {
   vec3 col = vec3(0.0,1.0,0.0);
-  vec3 nor = node_normal(vs_pos.xyz, vs_neighbors);
+  vec3 nor = vs_nor.xyz;
 
   if (int(unif.render_mode.x) == 1) {
     // show heat amount
@@ -101,8 +60,9 @@ void main() {
 
   fs_nor = nor;
   fs_col = col;
+  fs_node = uint(gl_VertexIndex);
   gl_PointSize = unif.point_size.x;
-  gl_Position = unif.proj * unif.view *
+  gl_Position = cam.proj * cam.view *
     unif.model * vec4(vs_pos.xyz, 1.0);
 }
 
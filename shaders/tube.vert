@@ -0,0 +1,72 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+/*
+Draws a tube segment per instance, written by tubes.comp. The vertices
+are the rings of a unit tube, shaded like basic.vert shades the nodes.
+*/
+
+// Note: the layout must match RenderPushConstants in types.h. Only the
+// leading unifs of basic.vert are declared, render_mode must stay first.
+layout(push_constant) uniform Unifs {
+  mat4 model;
+  vec4 render_mode;
+} unif;
+
+// the ring direction in xy, and 0 at the start and 1 at the end in z
+layout(location = 0) in vec4 vs_ring;
+// the segment, per instance, see TubeSegment in types.h
+layout(location = 1) in vec4 vs_start;
+layout(location = 2) in vec4 vs_end;
+layout(location = 3) in vec4 vs_heat;
+layout(location = 4) in uvec4 vs_nodes;
+
+// Note: the layout must match CameraUniforms in types.h, and the binding
+// RENDER_CAMERA_BINDING in app.cpp
+layout(binding = 0) uniform CameraUnifs {
+  mat4 view;
+  mat4 proj;
+} cam;
+
+layout(location = 0) out vec3 fs_nor;
+layout(location = 1) out vec3 fs_col;
+// the node at the end of the ring, see basic.vert
+layout(location = 2) flat out uint fs_node;
+
+void main() {
+  vec3 axis = vs_end.xyz - vs_start.xyz;
+  float len = length(axis);
+  vec3 dir = len == 0.0 ? vec3(0.0,1.0,0.0) : axis / len;
+  // any frame around the axis will do, with u x v = dir so that the
+  // rings wind counter-clockwise seen from outside
+  vec3 helper = abs(dir.y) < 0.9 ? vec3(0.0,1.0,0.0) : vec3(1.0,0.0,0.0);
+  vec3 u = normalize(cross(helper, dir));
+  vec3 v = cross(dir, u);
+
+  float t = vs_ring.z;
+  vec3 nor = vs_ring.x * u + vs_ring.y * v;
+  float radius = mix(vs_start.w, vs_end.w, t);
+  vec3 pos = mix(vs_start.xyz, vs_end.xyz, t) + radius * nor;
+
+  vec3 col = vec3(0.0,1.0,0.0);
+  float heat = mix(vs_heat.x, vs_heat.y, t);
+  float heat_gen = mix(vs_heat.z, vs_heat.w, t);
+  if (int(unif.render_mode.x) == 1) {
+    // show heat amount
+    col = mix(vec3(0.0,0.0,1.0), vec3(1.0,0.0,0.0), clamp(heat, 0.0, 1.0));
+  } else if (int(unif.render_mode.x) == 2) {
+    // show heat generation
+    col = vec3(clamp(heat_gen, 0.0, 1.0), 0.0, 0.0);
+  } else if (int(unif.render_mode.x) == 3) {
+    // show heat sources
+    col = vec3(heat_gen > 0.0 ? 1.0 : 0.0, 0.0, 0.0);
+  } else if (int(unif.render_mode.x) == 4) {
+    // show normals
+    col = nor;
+  }
+
+  fs_nor = mat3(unif.model) * nor;
+  fs_col = col;
+  fs_node = t < 0.5 ? vs_nodes.x : vs_nodes.y;
+  gl_Position = cam.proj * cam.view * unif.model * vec4(pos, 1.0);
+}
@@ -21,16 +21,86 @@
 #include <sstream>
 #include <fstream>
 #include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <limits>
+
+// the index buffers start at this size and double when they overflow
+const VkDeviceSize MIN_INDEX_BUFFER_SIZE = 16 * 1024;
+
+// the distance between the instances of a sweep when tiled in the viewport,
+// the zygote plane is 10 units wide
+const float INSTANCE_TILE_SPACING = 15.0f;
+
+// the normals pass is cheap next to the simulation step, so it isn't tuned
+const uint32_t NORMALS_WORKGROUP_SIZE = 64;
+const uint32_t CULL_WORKGROUP_SIZE = 64;
+const uint32_t TUBE_WORKGROUP_SIZE = 64;
+// the number of sides of the tubes the lines are drawn as
+const uint32_t TUBE_SIDES = 8;
+// how often the sim-first frame loop checks the async simulation
+const uint32_t SIM_FIRST_POLL_MICROS = 200;
+// the frames rendered after a change. ImGui can take a frame to react to
+// an input, and the new state must reach a presented image
+const uint32_t REDRAW_FRAMES = 3;
+// the idle frame loop still wakes up this often, for the UI text that
+// changes without any input (e.g. the export status)
+const double IDLE_WAIT_SECS = 0.5;
+// an idle wait is not counted as a long frame beyond this
+const float MAX_FRAME_SECS = 0.1f;
+
+// the color format of the offscreen renders, which any device (software
+// ones included) can render to and copy from
+const VkFormat OFFSCREEN_FORMAT = VK_FORMAT_R8G8B8A8_UNORM;
+// the thumbnail cameras look down on the nodes from this angle
+const float THUMBNAIL_ELEVATION = (float) M_PI / 6.0f;
+
+// the trajectory staging ring holds this many frames, which bounds the
+// frames captured by a simulation chunk
+const uint32_t TRAJECTORY_RING_SLOTS = 32;
+
+const array<const char*, ATTRIBUTES_COUNT> ATTRIB_NAMES = {
+  "pos", "vel", "neighbors", "data", "top data"
+};
 
-// constrained by maxImageDimension1D = 16384
-// but also by this bug: cannot imageStore for index >= 4096
-const uint32_t MAX_NUM_VERTICES = 4096;
-const uint32_t MAX_NUM_INDICES = (int) 1e6;
-
-const uint32_t LOCAL_WORKGROUP_SIZE = 256;
+// The attributes basic.vert takes as vertex inputs, the same for all
+// of the pipelines. Of vel, only vel.w is used. The normals come from
+// the normals pass.
+const AttribMask RENDER_VERT_ATTRIBS =
+  attrib_bit(ATTRIB_POS) | attrib_bit(ATTRIB_VEL);
+// the render desc set binding of the camera uniforms, its only binding
+const uint32_t RENDER_CAMERA_BINDING = 0;
+
+// the workgroup sizes tried by the benchmark, filtered by the device limits
+const vector<uint32_t> CANDIDATE_WORKGROUP_SIZES = {
+  32, 64, 128, 256, 512, 1024
+};
+const uint32_t WORKGROUP_BENCH_ITERS = 200;
+const uint32_t WORKGROUP_BENCH_RUNS = 3;
+// benchmark results are persisted here, one line per device
+const char* WORKGROUP_CACHE_FILE = "workgroup_sizes.txt";
 
 const int max_frames_in_flight = 2;
 
+void load_cached_workgroup_size(AppState& state);
+void finish_simulation(AppState& state);
+void wait_for_frames(AppState& state, uint64_t frame_serial);
+uint32_t instance_of_node(AppState& state, uint32_t node_index);
+
+// Marks the window content as changed, so that the next frames are
+// rendered instead of skipped
+void request_redraw(AppState& state) {
+  state.redraw_frames = REDRAW_FRAMES;
+}
+
+// Marks the recorded scene draws as stale, so that they're re-recorded
+// before their next use. Needed whenever anything they bind or draw
+// changes, other than the camera.
+void invalidate_scene_cmds(AppState& state) {
+  state.scene_version += 1;
+  request_redraw(state);
+}
+
 static void check_vk_result(VkResult res) {
   assert(res == VK_SUCCESS);
 }
@@ -113,16 +183,33 @@ vector<UserUnif> parse_user_unifs(const string& shader_text) {
 /*
    Returns true on success, false on error.
    If success, out_spirv and out_unifs will be set.
+   Shaders that use subgroup ops must be compiled for Vulkan 1.1.
 */
 bool process_shader_file(
     const string& src_name,
     const string& filename,
     shaderc_shader_kind kind,
     vector<uint32_t>& out_spirv,
-    vector<UserUnif>& out_unifs) {
+    vector<UserUnif>& out_unifs,
+    const vector<string>& defines,
+    bool vulkan_1_1 = false) {
   using namespace shaderc;
   Compiler compiler;
   CompileOptions compile_options;
+  // a define is either NAME or NAME=VALUE
+  for (const string& define : defines) {
+    size_t eq = define.find('=');
+    if (eq == string::npos) {
+      compile_options.AddMacroDefinition(define);
+    } else {
+      compile_options.AddMacroDefinition(define.substr(0, eq),
+          define.substr(eq + 1));
+    }
+  }
+  if (vulkan_1_1) {
+    compile_options.SetTargetEnvironment(shaderc_target_env_vulkan,
+        shaderc_env_version_vulkan_1_1);
+  }
 
   vector<char> glsl_source_vec = read_file(filename);
   string glsl_source(glsl_source_vec.begin(), glsl_source_vec.end());
@@ -217,8 +304,17 @@ void end_single_time_commands(AppState& state, VkCommandBuffer cmd_buffer) {
     .commandBufferCount = 1,
     .pCommandBuffers = &cmd_buffer
   };
-  vkQueueSubmit(state.queue, 1, &submit_info, VK_NULL_HANDLE);
-  vkQueueWaitIdle(state.queue);
+  // wait for just this submit, the frames in flight keep running
+  VkFenceCreateInfo fence_info = {
+    .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO
+  };
+  VkFence fence;
+  VkResult res = vkCreateFence(state.device, &fence_info, nullptr, &fence);
+  assert(res == VK_SUCCESS);
+  vkQueueSubmit(state.queue, 1, &submit_info, fence);
+  vkWaitForFences(state.device, 1, &fence, VK_TRUE,
+      std::numeric_limits<uint64_t>::max());
+  vkDestroyFence(state.device, fence, nullptr);
 
   vkFreeCommandBuffers(state.device, state.cmd_pool, 1, &cmd_buffer);
 }
@@ -226,12 +322,13 @@ void end_single_time_commands(AppState& state, VkCommandBuffer cmd_buffer) {
 void copy_buffer(
     AppState& state,
     VkBuffer src_buffer, VkBuffer dst_buffer,
-    VkDeviceSize buffer_size) {
+    VkDeviceSize buffer_size,
+    VkDeviceSize src_offset = 0, VkDeviceSize dst_offset = 0) {
   VkCommandBuffer tmp_cmd_buffer = begin_single_time_commands(state);
 
   VkBufferCopy copy_region = {
-    .srcOffset = 0,
-    .dstOffset = 0,
+    .srcOffset = src_offset,
+    .dstOffset = dst_offset,
     .size = buffer_size
   };
   vkCmdCopyBuffer(tmp_cmd_buffer, src_buffer, dst_buffer,
@@ -244,11 +341,20 @@ void create_buffer(AppState& state,
     VkDeviceSize size, VkBufferUsageFlags usage,
     VmaMemoryUsage mem_usage, VmaAllocationCreateFlags flags,
     VkBuffer& buffer, VmaAllocation& allocation) {
+  // the buffers are shared by the graphics and compute queues, which
+  // avoids ownership transfers when they are from different families
+  array<uint32_t, 2> family_indices = {
+    state.target_family_index, state.compute_family_index
+  };
+  bool shared = state.compute_family_index != state.target_family_index;
   VkBufferCreateInfo buffer_info = {
     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
     .size = size,
     .usage = usage,
-    .sharingMode = VK_SHARING_MODE_EXCLUSIVE
+    .sharingMode = shared ?
+      VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE,
+    .queueFamilyIndexCount = shared ? (uint32_t) family_indices.size() : 0,
+    .pQueueFamilyIndices = shared ? family_indices.data() : nullptr
   };
   VmaAllocationCreateInfo allocation_info = {
     .flags = flags,
@@ -386,26 +492,46 @@ void enumerate_instance_layers() {
   printf("\n");
 }
 
+// The attributes are bound to consecutive bindings in attribute order,
+// the shader location is the attribute index
 void setup_vertex_attr_desc(AppState& state) {
-  state.vert_binding_descs.clear();
+  auto& binding_descs = state.vert_binding_descs;
+  auto& attr_descs = state.vert_attr_descs;
+  binding_descs.clear();
+  attr_descs.clear();
   for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+    if (!(RENDER_VERT_ATTRIBS & attrib_bit(i))) {
+      continue;
+    }
+    uint32_t binding = (uint32_t) binding_descs.size();
     VkVertexInputBindingDescription binding_desc = {
-      .binding = i,
-      .stride = sizeof(vec4),
+      .binding = binding,
+      .stride = node_attrib_stride(state.compact_nodes, i),
       .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
     };
-    state.vert_binding_descs.push_back(binding_desc);
-  }
-  state.vert_attr_descs.clear();
-  for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+    binding_descs.push_back(binding_desc);
     VkVertexInputAttributeDescription attr_desc = {
-      .binding = i,
+      .binding = binding,
       .location = i,
-      .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+      .format = node_attrib_format(state.compact_nodes, i),
       .offset = 0
     };
-    state.vert_attr_descs.push_back(attr_desc);
+    attr_descs.push_back(attr_desc);
   }
+
+  // the normals follow the attributes, at location ATTRIBUTES_COUNT
+  uint32_t nor_binding = (uint32_t) binding_descs.size();
+  binding_descs.push_back({
+    .binding = nor_binding,
+    .stride = node_normal_stride(state.compact_nodes),
+    .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
+  });
+  attr_descs.push_back({
+    .location = ATTRIBUTES_COUNT,
+    .binding = nor_binding,
+    .format = node_normal_format(state.compact_nodes),
+    .offset = 0
+  });
 }
 
 void setup_instance(AppState& state) {
@@ -413,10 +539,13 @@ void setup_instance(AppState& state) {
   enumerate_instance_layers();
   
   // gather extensions
-  uint32_t glfw_ext_count = 0;
-  const char** glfw_exts = glfwGetRequiredInstanceExtensions(&glfw_ext_count);
   vector<const char*> ext_names;
-  ext_names.insert(ext_names.end(), glfw_exts, glfw_exts + glfw_ext_count);
+  if (!state.headless) {
+    uint32_t glfw_ext_count = 0;
+    const char** glfw_exts =
+      glfwGetRequiredInstanceExtensions(&glfw_ext_count);
+    ext_names.insert(ext_names.end(), glfw_exts, glfw_exts + glfw_ext_count);
+  }
   ext_names.push_back("VK_EXT_debug_utils");
 
   // gather layers
@@ -424,6 +553,18 @@ void setup_instance(AppState& state) {
     "VK_LAYER_KHRONOS_validation"
   };
 
+  // use Vulkan 1.1 if the loader has it, for the subgroup ops. A 1.0
+  // loader has no vkEnumerateInstanceVersion
+  auto enumerate_instance_version =
+    (PFN_vkEnumerateInstanceVersion) vkGetInstanceProcAddr(
+        VK_NULL_HANDLE, "vkEnumerateInstanceVersion");
+  uint32_t loader_version = VK_API_VERSION_1_0;
+  if (enumerate_instance_version) {
+    enumerate_instance_version(&loader_version);
+  }
+  state.api_version = loader_version >= VK_API_VERSION_1_1 ?
+    VK_API_VERSION_1_1 : VK_API_VERSION_1_0;
+
   // setup instance
   VkApplicationInfo app_info = {
     .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
@@ -432,7 +573,7 @@ void setup_instance(AppState& state) {
     .applicationVersion = 1,
     .pEngineName = "my_vulkan_app",
     .engineVersion = 1,
-    .apiVersion = VK_API_VERSION_1_0
+    .apiVersion = state.api_version
   };
   VkInstanceCreateInfo inst_info = {
     .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
@@ -514,16 +655,49 @@ void log_device_properties(VkPhysicalDevice& device) {
   printf("\n");
 }
 
+// Sets has_subgroup_ballot if compute shaders can use subgroup ballots,
+// which needs Vulkan 1.1 on both the instance and the device
+void query_subgroup_support(AppState& state) {
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(state.phys_device, &props);
+  state.has_subgroup_ballot = false;
+  if (state.api_version >= VK_API_VERSION_1_1 &&
+      props.apiVersion >= VK_API_VERSION_1_1) {
+    VkPhysicalDeviceSubgroupProperties subgroup_props = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES,
+      .pNext = nullptr
+    };
+    VkPhysicalDeviceProperties2 props2 = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+      .pNext = &subgroup_props
+    };
+    vkGetPhysicalDeviceProperties2(state.phys_device, &props2);
+    VkSubgroupFeatureFlags needed_ops = VK_SUBGROUP_FEATURE_BASIC_BIT |
+      VK_SUBGROUP_FEATURE_BALLOT_BIT;
+    state.has_subgroup_ballot =
+      (subgroup_props.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) &&
+      (subgroup_props.supportedOperations & needed_ops) == needed_ops;
+    printf("subgroup size: %u\n", subgroup_props.subgroupSize);
+  }
+  printf("subgroup queue ops: %s\n\n",
+      state.has_subgroup_ballot ? "yes" : "no");
+}
+
 void setup_physical_device(AppState& state) {
   // retrieve physical device
-  // assume the first GPU will do
-  uint32_t device_count = 1;
+  // assume any GPU will do, device_index picks one when there are several
+  uint32_t device_count = 0;
+  vkEnumeratePhysicalDevices(state.inst, &device_count, nullptr);
+  assert(device_count > 0);
+  vector<VkPhysicalDevice> devices(device_count);
   VkResult res = vkEnumeratePhysicalDevices(state.inst, &device_count,
-      &state.phys_device);
-  assert(!res && device_count == 1);
+      devices.data());
+  assert(res == VK_SUCCESS);
+  state.phys_device = devices[state.device_index % device_count];
 
   enumerate_device_extensions(state.phys_device);
   log_device_properties(state.phys_device);
+  query_subgroup_support(state);
 }
 
 void setup_logical_device(AppState& state) {
@@ -543,8 +717,12 @@ void setup_logical_device(AppState& state) {
     auto& q_fam = queue_fam_props[i];
     bool supports_graphics = q_fam.queueFlags & VK_QUEUE_GRAPHICS_BIT;
     bool supports_compute = q_fam.queueFlags & VK_QUEUE_COMPUTE_BIT;
-    VkBool32 supports_present = false;
-    vkGetPhysicalDeviceSurfaceSupportKHR(state.phys_device, i, state.surface, &supports_present);
+    // without a window nothing is presented
+    VkBool32 supports_present = state.headless;
+    if (!state.headless) {
+      vkGetPhysicalDeviceSurfaceSupportKHR(state.phys_device, i,
+          state.surface, &supports_present);
+    }
     printf("G: %i, C: %i, P: %d, count: %d\n", supports_graphics ? 1 : 0,
         supports_compute ? 1 : 0, supports_present, q_fam.queueCount);
 
@@ -556,27 +734,93 @@ void setup_logical_device(AppState& state) {
   printf("\n");
   assert(found_index);
 
+  // find a queue for the simulation, prefer a compute-only family
+  // and otherwise use a second queue in the graphics family
+  state.compute_family_index = state.target_family_index;
+  uint32_t compute_queue_index = 0;
+  for (uint32_t i = 0; i < queue_family_count; ++i) {
+    VkQueueFlags flags = queue_fam_props[i].queueFlags;
+    if ((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT)) {
+      state.compute_family_index = i;
+      break;
+    }
+  }
+  if (state.compute_family_index == state.target_family_index &&
+      queue_fam_props[state.target_family_index].queueCount > 1) {
+    compute_queue_index = 1;
+  }
+  bool has_compute_queue =
+    state.compute_family_index != state.target_family_index ||
+    compute_queue_index == 1;
+
+  // the handoff between the queues uses timeline semaphores
+  uint32_t ext_count = 0;
+  vkEnumerateDeviceExtensionProperties(state.phys_device, nullptr,
+      &ext_count, nullptr);
+  vector<VkExtensionProperties> ext_props(ext_count);
+  vkEnumerateDeviceExtensionProperties(state.phys_device, nullptr,
+      &ext_count, ext_props.data());
+  bool has_timeline_semaphore = false;
+  for (VkExtensionProperties& props : ext_props) {
+    if (strcmp(props.extensionName,
+          VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME) == 0) {
+      has_timeline_semaphore = true;
+    }
+  }
+  // the timeline semaphore extension requires Vulkan 1.1 (or
+  // VK_KHR_get_physical_device_properties2, which isn't enabled)
+  VkPhysicalDeviceProperties device_props;
+  vkGetPhysicalDeviceProperties(state.phys_device, &device_props);
+  bool has_vulkan_1_1 = state.api_version >= VK_API_VERSION_1_1 &&
+    device_props.apiVersion >= VK_API_VERSION_1_1;
+  state.has_async_compute = has_compute_queue && has_timeline_semaphore &&
+    has_vulkan_1_1;
+  if (!state.has_async_compute) {
+    state.compute_family_index = state.target_family_index;
+    compute_queue_index = 0;
+  }
+  printf("async compute: %s (family %u, queue %u)\n\n",
+      state.has_async_compute ? "yes" : "no",
+      state.compute_family_index, compute_queue_index);
+
   // init logical device
 
-  float queue_priority = 1.0f;
+  array<float, 2> queue_priorities = {1.0f, 1.0f};
+  vector<VkDeviceQueueCreateInfo> queue_infos;
   VkDeviceQueueCreateInfo queue_info = {
     .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
     .pNext = nullptr,
     .queueFamilyIndex = state.target_family_index,
-    .queueCount = 1,
-    .pQueuePriorities = &queue_priority
+    .queueCount = compute_queue_index + 1,
+    .pQueuePriorities = queue_priorities.data()
   };
+  queue_infos.push_back(queue_info);
+  if (state.compute_family_index != state.target_family_index) {
+    queue_info.queueFamilyIndex = state.compute_family_index;
+    queue_info.queueCount = 1;
+    queue_infos.push_back(queue_info);
+  }
   vector<const char*> device_ext_names = {
-    VK_KHR_SWAPCHAIN_EXTENSION_NAME,
     // used by VMA:
     "VK_KHR_dedicated_allocation",
     "VK_KHR_get_memory_requirements2"
   };
+  if (!state.headless) {
+    device_ext_names.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+  }
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timeline_features = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR,
+    .pNext = nullptr,
+    .timelineSemaphore = VK_TRUE
+  };
+  if (state.has_async_compute) {
+    device_ext_names.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+  }
   VkDeviceCreateInfo device_info = {
     .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-    .pNext = nullptr,
-    .queueCreateInfoCount = 1,
-    .pQueueCreateInfos = &queue_info,
+    .pNext = state.has_async_compute ? &timeline_features : nullptr,
+    .queueCreateInfoCount = (uint32_t) queue_infos.size(),
+    .pQueueCreateInfos = queue_infos.data(),
     .enabledExtensionCount = static_cast<uint32_t>(device_ext_names.size()),
     .ppEnabledExtensionNames = device_ext_names.data(),
     .enabledLayerCount = 0,
@@ -589,6 +833,8 @@ void setup_logical_device(AppState& state) {
 
   // retrieve our queue
   vkGetDeviceQueue(state.device, state.target_family_index, 0, &state.queue);
+  vkGetDeviceQueue(state.device, state.compute_family_index,
+      compute_queue_index, &state.compute_queue);
 
   // setup the allocator
   VmaAllocatorCreateInfo allocator_info = {
@@ -634,8 +880,16 @@ void prepare_swapchain_creation(AppState& state) {
   }
   assert(found_format);
 
-  // guaranteed to be supported?
+  // FIFO is guaranteed to be supported
+  VkPresentModeKHR wanted_mode = PRESENT_MODES[state.controls.present_mode];
   state.target_present_mode = VK_PRESENT_MODE_FIFO_KHR;
+  if (std::find(present_modes.begin(), present_modes.end(), wanted_mode) !=
+      present_modes.end()) {
+    state.target_present_mode = wanted_mode;
+  } else {
+    printf("present mode %s is not supported, using fifo\n",
+        PRESENT_MODE_NAMES[state.controls.present_mode]);
+  }
 
   state.target_extent = state.surface_caps.currentExtent;
   state.target_image_count = state.surface_caps.minImageCount + 1;
@@ -645,8 +899,10 @@ void prepare_swapchain_creation(AppState& state) {
       state.surface_caps.minImageCount, state.surface_caps.maxImageCount);
 }
 
+// A view of layer base_layer of the image
 VkImageView create_image_view(AppState& state, VkImage image,
-    VkFormat format, VkImageAspectFlags aspect_flags) {
+    VkFormat format, VkImageAspectFlags aspect_flags,
+    uint32_t base_layer = 0) {
   VkImageViewCreateInfo view_info = {
     .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
     .image = image,
@@ -656,7 +912,7 @@ VkImageView create_image_view(AppState& state, VkImage image,
       .aspectMask = aspect_flags,
       .baseMipLevel = 0,
       .levelCount = 1,
-      .baseArrayLayer = 0,
+      .baseArrayLayer = base_layer,
       .layerCount = 1
     }
   };
@@ -708,25 +964,43 @@ void setup_swapchain(AppState& state) {
   }
 }
 
-void setup_renderpass(AppState& state) {
-  VkSubpassDependency dependency = {
+// A pass over a color, a depth and a node id attachment, the color ends
+// up in final_layout. The depth and node id attachments are shared by
+// the passes in a row, the node ids are left to be copied out.
+VkRenderPass create_render_pass(AppState& state, VkFormat color_format,
+    VkImageLayout final_layout) {
+  vector<VkSubpassDependency> dependencies = {{
     .srcSubpass = VK_SUBPASS_EXTERNAL,
     .dstSubpass = 0,
-    .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-    .srcAccessMask = 0,
-    .dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+    // the node ids of the previous pass may still be being copied out
+    .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+      VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+      VK_PIPELINE_STAGE_TRANSFER_BIT,
+    .srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+    .dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT |
+      VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
     .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
-      VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
-  };
+      VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+      VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT
+  }, {
+    // the node ids, and the color if final_layout is for a transfer,
+    // are copied out after the pass
+    .srcSubpass = 0,
+    .dstSubpass = VK_SUBPASS_EXTERNAL,
+    .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+    .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+    .dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT,
+    .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT
+  }};
   VkAttachmentDescription color_attachment = {
-    .format = state.target_format.format,
+    .format = color_format,
     .samples = VK_SAMPLE_COUNT_1_BIT,
     .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
     .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
     .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
     .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
     .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-    .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR
+    .finalLayout = final_layout
   };
   VkAttachmentReference color_attachment_ref = {
     .attachment = 0,
@@ -746,14 +1020,30 @@ void setup_renderpass(AppState& state) {
     .attachment = 1,
     .layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
   };
+  VkAttachmentDescription id_attachment = {
+    .format = NODE_ID_FORMAT,
+    .samples = VK_SAMPLE_COUNT_1_BIT,
+    .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+    .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+    .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+    .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+    .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    .finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+  };
+  // the fragment shader writes the color at location 0 and the node id
+  // at location 1
+  array<VkAttachmentReference, 2> color_attachment_refs = {{
+    color_attachment_ref,
+    {2, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL}
+  }};
   VkSubpassDescription subpass_desc = {
     .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
-    .colorAttachmentCount = 1,
-    .pColorAttachments = &color_attachment_ref,
+    .colorAttachmentCount = (uint32_t) color_attachment_refs.size(),
+    .pColorAttachments = color_attachment_refs.data(),
     .pDepthStencilAttachment = &depth_attachment_ref
   };
   vector<VkAttachmentDescription> attachments = {
-    color_attachment, depth_attachment
+    color_attachment, depth_attachment, id_attachment
   };
   VkRenderPassCreateInfo render_pass_info = {
     .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
@@ -761,26 +1051,86 @@ void setup_renderpass(AppState& state) {
     .pAttachments = attachments.data(),
     .subpassCount = 1,
     .pSubpasses = &subpass_desc,
+    .dependencyCount = (uint32_t) dependencies.size(),
+    .pDependencies = dependencies.data()
+  };
+  VkRenderPass render_pass;
+  VkResult res = vkCreateRenderPass(state.device, &render_pass_info,
+      nullptr, &render_pass);
+  assert(res == VK_SUCCESS);
+  return render_pass;
+}
+
+// The pass ImGui draws in after the scene, over the color alone since
+// the ImGui pipeline has a single color attachment. Presents the color.
+VkRenderPass create_ui_render_pass(AppState& state, VkFormat color_format) {
+  VkSubpassDependency dependency = {
+    .srcSubpass = VK_SUBPASS_EXTERNAL,
+    .dstSubpass = 0,
+    .srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+    .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+    .dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+    .dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+      VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+  };
+  VkAttachmentDescription color_attachment = {
+    .format = color_format,
+    .samples = VK_SAMPLE_COUNT_1_BIT,
+    .loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+    .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+    .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+    .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+    .initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR
+  };
+  VkAttachmentReference color_attachment_ref = {
+    .attachment = 0,
+    .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+  };
+  VkSubpassDescription subpass_desc = {
+    .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+    .colorAttachmentCount = 1,
+    .pColorAttachments = &color_attachment_ref
+  };
+  VkRenderPassCreateInfo render_pass_info = {
+    .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+    .attachmentCount = 1,
+    .pAttachments = &color_attachment,
+    .subpassCount = 1,
+    .pSubpasses = &subpass_desc,
     .dependencyCount = 1,
     .pDependencies = &dependency
   };
+  VkRenderPass render_pass;
   VkResult res = vkCreateRenderPass(state.device, &render_pass_info,
-      nullptr, &state.render_pass);
+      nullptr, &render_pass);
   assert(res == VK_SUCCESS);
+  return render_pass;
+}
+
+void setup_renderpass(AppState& state) {
+  state.render_pass = create_render_pass(state,
+      state.target_format.format, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+  state.ui_render_pass = create_ui_render_pass(state,
+      state.target_format.format);
+}
+
+void cleanup_renderpass(AppState& state) {
+  vkDestroyRenderPass(state.device, state.render_pass, nullptr);
+  vkDestroyRenderPass(state.device, state.ui_render_pass, nullptr);
 }
 
 void setup_render_desc_set_layout(AppState& state) {
   vector<VkDescriptorSetLayoutBinding> layout_bindings;
-  for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
-    VkDescriptorSetLayoutBinding binding = {
-      .binding = i,
-      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER,
-      .descriptorCount = 1,
-      .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
-      .pImmutableSamplers = nullptr
-    };
-    layout_bindings.push_back(binding);
-  }
+  // dynamic, the offset picks the camera slot of the frame in flight
+  VkDescriptorSetLayoutBinding camera_binding = {
+    .binding = RENDER_CAMERA_BINDING,
+    .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+    .descriptorCount = 1,
+    .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+    .pImmutableSamplers = nullptr
+  };
+  layout_bindings.push_back(camera_binding);
   VkDescriptorSetLayoutCreateInfo layout_info = {
     .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
     .bindingCount = (uint32_t) layout_bindings.size(),
@@ -815,6 +1165,25 @@ void setup_compute_desc_set_layout(AppState& state) {
     .pImmutableSamplers = nullptr
   };
   bindings.push_back(storage_binding);
+  // the simulation instance records
+  VkDescriptorSetLayoutBinding instance_binding = {
+    .binding = 2 * ATTRIBUTES_COUNT + 1,
+    .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    .descriptorCount = 1,
+    .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+    .pImmutableSamplers = nullptr
+  };
+  bindings.push_back(instance_binding);
+  // the normals of the input state, written by the normals pass and
+  // read by the simulation
+  VkDescriptorSetLayoutBinding normals_binding = {
+    .binding = 2 * ATTRIBUTES_COUNT + 2,
+    .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER,
+    .descriptorCount = 1,
+    .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+    .pImmutableSamplers = nullptr
+  };
+  bindings.push_back(normals_binding);
 
   VkDescriptorSetLayoutCreateInfo layout_info = {
     .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
@@ -826,21 +1195,91 @@ void setup_compute_desc_set_layout(AppState& state) {
   assert(res == VK_SUCCESS);
 }
 
+// A layout for a compute pass with binding i of type binding_types[i]
+VkDescriptorSetLayout create_pass_desc_set_layout(AppState& state,
+    const vector<VkDescriptorType>& binding_types) {
+  vector<VkDescriptorSetLayoutBinding> bindings;
+  for (uint32_t i = 0; i < binding_types.size(); ++i) {
+    VkDescriptorSetLayoutBinding binding = {
+      .binding = i,
+      .descriptorType = binding_types[i],
+      .descriptorCount = 1,
+      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+      .pImmutableSamplers = nullptr
+    };
+    bindings.push_back(binding);
+  }
+  VkDescriptorSetLayoutCreateInfo layout_info = {
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+    .bindingCount = (uint32_t) bindings.size(),
+    .pBindings = bindings.data()
+  };
+  VkDescriptorSetLayout layout;
+  VkResult res = vkCreateDescriptorSetLayout(state.device,
+      &layout_info, nullptr, &layout);
+  assert(res == VK_SUCCESS);
+  return layout;
+}
+
+// See cull.comp for the bindings
+void setup_cull_desc_set_layout(AppState& state) {
+  state.cull_desc_set_layout = create_pass_desc_set_layout(state, {
+    VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER,
+    VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER,
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
+  });
+}
+
+// See tubes.comp for the bindings
+void setup_tube_desc_set_layout(AppState& state) {
+  state.tube_desc_set_layout = create_pass_desc_set_layout(state, {
+    VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER,
+    VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER,
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
+  });
+}
+
 void setup_desc_set_layouts(AppState& state) {
   setup_render_desc_set_layout(state);
   setup_compute_desc_set_layout(state);
+  setup_cull_desc_set_layout(state);
+  setup_tube_desc_set_layout(state);
+}
+
+// The macros that the shaders are compiled with
+vector<string> shader_defines(AppState& state) {
+  // the limits that size the shader arrays come from types.h
+  vector<string> defines = {
+    "MAX_NUM_NODES=" + to_string(MAX_NUM_VERTICES) + "u",
+    "MAX_NUM_INSTANCES=" + to_string(MAX_NUM_INSTANCES) + "u"
+  };
+  if (state.compact_nodes) {
+    defines.push_back("COMPACT_NODES");
+  }
+  // only morph.comp uses it, which is then compiled for Vulkan 1.1
+  if (state.has_subgroup_ballot) {
+    defines.push_back("SUBGROUP_QUEUE_OPS");
+  }
+  return defines;
 }
 
 void setup_graphics_pipelines(AppState& state) {
   vector<UserUnif> vertex_unifs, frag_unifs;
   vector<uint32_t> vert_shader_code, frag_shader_code;
+  vector<string> defines = shader_defines(state);
   bool vert_res = process_shader_file(
       "vertex shader", "../shaders/basic.vert",
-      shaderc_glsl_vertex_shader, vert_shader_code, vertex_unifs);
+      shaderc_glsl_vertex_shader, vert_shader_code, vertex_unifs,
+      defines);
   assert(vert_res);
   bool frag_res = process_shader_file(
       "frag shader", "../shaders/basic.frag",
-      shaderc_glsl_fragment_shader, frag_shader_code, frag_unifs);
+      shaderc_glsl_fragment_shader, frag_shader_code, frag_unifs,
+      defines);
   assert(frag_res);
     
   VkShaderModule vert_module = create_shader_module(state.device, vert_shader_code);
@@ -884,24 +1323,22 @@ void setup_graphics_pipelines(AppState& state) {
     };
     input_assembly_infos[i] = info;
   }
-  VkViewport viewport = {
-    .x = 0.0f,
-    .y = 0.0f,
-    .width = (float) state.target_extent.width,
-    .height = (float) state.target_extent.height,
-    .minDepth = 0.0f,
-    .maxDepth = 1.0f
-  };
-  VkRect2D scissor_rect = {
-    .offset = {0, 0},
-    .extent = state.target_extent
-  };
+  // the viewport and scissor are set when recording, so that the
+  // pipelines outlive window resizes
   VkPipelineViewportStateCreateInfo viewport_state_info = {
     .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
     .viewportCount = 1,
-    .pViewports = &viewport,
+    .pViewports = nullptr,
     .scissorCount = 1,
-    .pScissors = &scissor_rect
+    .pScissors = nullptr
+  };
+  vector<VkDynamicState> dynamic_states = {
+    VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR
+  };
+  VkPipelineDynamicStateCreateInfo dynamic_state_info = {
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+    .dynamicStateCount = (uint32_t) dynamic_states.size(),
+    .pDynamicStates = dynamic_states.data()
   };
   VkPipelineRasterizationStateCreateInfo rast_info = {
     .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO,
@@ -925,16 +1362,22 @@ void setup_graphics_pipelines(AppState& state) {
     .alphaToCoverageEnable = VK_FALSE,
     .alphaToOneEnable = VK_FALSE
   };
-  VkPipelineColorBlendAttachmentState color_blend_attachment = {
-    .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
-      VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
-    .blendEnable = VK_FALSE,
-  };
+  // the color, then the node id
+  array<VkPipelineColorBlendAttachmentState, 2> color_blend_attachments = {{
+    {
+      .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT |
+        VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
+      .blendEnable = VK_FALSE,
+    }, {
+      .colorWriteMask = VK_COLOR_COMPONENT_R_BIT,
+      .blendEnable = VK_FALSE,
+    }
+  }};
   VkPipelineColorBlendStateCreateInfo color_blending = {
     .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
     .logicOpEnable = VK_FALSE,
-    .attachmentCount = 1,
-    .pAttachments = &color_blend_attachment
+    .attachmentCount = (uint32_t) color_blend_attachments.size(),
+    .pAttachments = color_blend_attachments.data()
   };
   VkPipelineDepthStencilStateCreateInfo depth_stencil = {
     .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
@@ -982,7 +1425,7 @@ void setup_graphics_pipelines(AppState& state) {
       .pMultisampleState = &multisampling,
       .pDepthStencilState = &depth_stencil,
       .pColorBlendState = &color_blending,
-      .pDynamicState = nullptr,
+      .pDynamicState = &dynamic_state_info,
       .layout = state.render_pipeline_layout,
       .renderPass = state.render_pass,
       .subpass = 0,
@@ -997,27 +1440,75 @@ void setup_graphics_pipelines(AppState& state) {
       state.graphics_pipelines.data());
   assert(res == VK_SUCCESS);
 
+  // the tube pipeline draws a unit tube per segment, with the same
+  // fragment shader and state as the triangles
+  vector<uint32_t> tube_shader_code;
+  vector<UserUnif> tube_unifs;
+  bool tube_res = process_shader_file(
+      "tube vertex shader", "../shaders/tube.vert",
+      shaderc_glsl_vertex_shader, tube_shader_code, tube_unifs,
+      defines);
+  assert(tube_res);
+  VkShaderModule tube_module = create_shader_module(state.device,
+      tube_shader_code);
+  shader_stages[0].module = tube_module;
+  vector<VkVertexInputBindingDescription> tube_binding_descs = {
+    {0, sizeof(vec4), VK_VERTEX_INPUT_RATE_VERTEX},
+    {1, sizeof(TubeSegment), VK_VERTEX_INPUT_RATE_INSTANCE}
+  };
+  vector<VkVertexInputAttributeDescription> tube_attr_descs = {
+    {0, 0, VK_FORMAT_R32G32B32A32_SFLOAT, 0},
+    {1, 1, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(TubeSegment, start)},
+    {2, 1, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(TubeSegment, end)},
+    {3, 1, VK_FORMAT_R32G32B32A32_SFLOAT, offsetof(TubeSegment, heat)},
+    {4, 1, VK_FORMAT_R32G32B32A32_UINT, offsetof(TubeSegment, nodes)}
+  };
+  VkPipelineVertexInputStateCreateInfo tube_vertex_input_info = {
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+    .vertexBindingDescriptionCount = (uint32_t) tube_binding_descs.size(),
+    .pVertexBindingDescriptions = tube_binding_descs.data(),
+    .vertexAttributeDescriptionCount = (uint32_t) tube_attr_descs.size(),
+    .pVertexAttributeDescriptions = tube_attr_descs.data()
+  };
+  VkGraphicsPipelineCreateInfo tube_pipeline_info =
+    graphics_pipeline_infos[TRIANGLES_PIPELINE];
+  tube_pipeline_info.flags = 0;
+  tube_pipeline_info.pVertexInputState = &tube_vertex_input_info;
+  res = vkCreateGraphicsPipelines(state.device, VK_NULL_HANDLE, 1,
+      &tube_pipeline_info, nullptr, &state.tube_pipeline);
+  assert(res == VK_SUCCESS);
+
   vkDestroyShaderModule(state.device, vert_module, nullptr);
   vkDestroyShaderModule(state.device, frag_module, nullptr);
+  vkDestroyShaderModule(state.device, tube_module, nullptr);
 }
 
-void setup_compute_pipeline(AppState& state) {
+// Compiles morph.comp, or basic.comp if it does not compile
+VkShaderModule create_compute_shader_module(AppState& state,
+    vector<UserUnif>& out_unifs) {
   vector<uint32_t> shader_code;
+  vector<string> defines = shader_defines(state);
   bool shader_res = process_shader_file(
       "compute shader", "../shaders/morph.comp",
-      shaderc_glsl_compute_shader, shader_code, state.compute_unifs);
+      shaderc_glsl_compute_shader, shader_code, out_unifs, defines,
+      state.has_subgroup_ballot);
   // If it does not compile, use a default shader until the problem is fixed
   if (!shader_res) {
     printf("Defaulting to shaders/basic.comp\n");
     shader_res = process_shader_file(
         "default compute shader", "../shaders/basic.comp",
-        shaderc_glsl_compute_shader, shader_code, state.compute_unifs);
+        shaderc_glsl_compute_shader, shader_code, out_unifs, defines);
     assert(shader_res);
   }
-  VkShaderModule shader_module = create_shader_module(
-      state.device, shader_code);
+  return create_shader_module(state.device, shader_code);
+}
 
-  vector<uint32_t> spec_data = {LOCAL_WORKGROUP_SIZE};
+// The workgroup x size is passed as specialization constant 1
+// Uses the compute pipeline layout unless another layout is given
+VkPipeline create_compute_pipeline(AppState& state,
+    VkShaderModule shader_module, uint32_t workgroup_size,
+    VkPipelineLayout layout = VK_NULL_HANDLE) {
+  vector<uint32_t> spec_data = {workgroup_size};
   vector<VkSpecializationMapEntry> spec_entries = {
     {1, 0, sizeof(uint32_t)}
   };
@@ -1034,6 +1525,23 @@ void setup_compute_pipeline(AppState& state) {
     .pName = "main",
     .pSpecializationInfo = &spec_info
   };
+  VkComputePipelineCreateInfo compute_pipeline_info = {
+    .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+    .stage = stage_info,
+    .layout = layout != VK_NULL_HANDLE ?
+      layout : state.compute_pipeline_layout
+  };
+  VkPipeline pipeline;
+  VkResult res = vkCreateComputePipelines(state.device, VK_NULL_HANDLE, 1,
+      &compute_pipeline_info, nullptr, &pipeline);
+  assert(res == VK_SUCCESS);
+  return pipeline;
+}
+
+void setup_compute_pipeline(AppState& state) {
+  VkShaderModule shader_module = create_compute_shader_module(
+      state, state.compute_unifs);
+
   VkPushConstantRange push_constant_range = {
     .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
     .offset = 0,
@@ -1049,24 +1557,99 @@ void setup_compute_pipeline(AppState& state) {
   VkResult res = vkCreatePipelineLayout(state.device,
       &pipeline_layout_info, nullptr,
       &state.compute_pipeline_layout);
+  assert(res == VK_SUCCESS);
 
-  VkComputePipelineCreateInfo compute_pipeline_info = {
-    .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
-    .stage = stage_info,
-    .layout = state.compute_pipeline_layout
+  state.compute_pipeline = create_compute_pipeline(state,
+      shader_module, state.workgroup_size);
+  vkDestroyShaderModule(state.device, shader_module, nullptr);
+
+  vector<uint32_t> normals_code;
+  vector<UserUnif> normals_unifs;
+  bool shader_res = process_shader_file(
+      "normals shader", "../shaders/normals.comp",
+      shaderc_glsl_compute_shader, normals_code, normals_unifs,
+      shader_defines(state));
+  assert(shader_res);
+  VkShaderModule normals_module = create_shader_module(
+      state.device, normals_code);
+  state.normals_pipeline = create_compute_pipeline(state,
+      normals_module, NORMALS_WORKGROUP_SIZE);
+  vkDestroyShaderModule(state.device, normals_module, nullptr);
+}
+
+void setup_cull_pipeline(AppState& state) {
+  vector<uint32_t> cull_code;
+  vector<UserUnif> cull_unifs;
+  bool shader_res = process_shader_file(
+      "cull shader", "../shaders/cull.comp",
+      shaderc_glsl_compute_shader, cull_code, cull_unifs,
+      shader_defines(state));
+  assert(shader_res);
+  VkShaderModule cull_module = create_shader_module(state.device, cull_code);
+
+  VkPipelineLayoutCreateInfo pipeline_layout_info = {
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+    .setLayoutCount = 1,
+    .pSetLayouts = &state.cull_desc_set_layout,
+    .pushConstantRangeCount = 0,
+    .pPushConstantRanges = nullptr
   };
-  res = vkCreateComputePipelines(state.device, VK_NULL_HANDLE, 1,
-      &compute_pipeline_info, nullptr, &state.compute_pipeline);
+  VkResult res = vkCreatePipelineLayout(state.device,
+      &pipeline_layout_info, nullptr, &state.cull_pipeline_layout);
   assert(res == VK_SUCCESS);
+  state.cull_pipeline = create_compute_pipeline(state,
+      cull_module, CULL_WORKGROUP_SIZE, state.cull_pipeline_layout);
+  vkDestroyShaderModule(state.device, cull_module, nullptr);
+}
 
-  vkDestroyShaderModule(state.device, shader_module, nullptr);
+void cleanup_cull_pipeline(AppState& state) {
+  vkDestroyPipeline(state.device, state.cull_pipeline, nullptr);
+  vkDestroyPipelineLayout(state.device, state.cull_pipeline_layout, nullptr);
+}
+
+void setup_tube_gen_pipeline(AppState& state) {
+  vector<uint32_t> tube_code;
+  vector<UserUnif> tube_unifs;
+  bool shader_res = process_shader_file(
+      "tube shader", "../shaders/tubes.comp",
+      shaderc_glsl_compute_shader, tube_code, tube_unifs,
+      shader_defines(state));
+  assert(shader_res);
+  VkShaderModule tube_module = create_shader_module(state.device, tube_code);
+
+  VkPushConstantRange push_constant_range = {
+    .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+    .offset = 0,
+    .size = (uint32_t) sizeof(TubePushConstants)
+  };
+  VkPipelineLayoutCreateInfo pipeline_layout_info = {
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+    .setLayoutCount = 1,
+    .pSetLayouts = &state.tube_desc_set_layout,
+    .pushConstantRangeCount = 1,
+    .pPushConstantRanges = &push_constant_range
+  };
+  VkResult res = vkCreatePipelineLayout(state.device,
+      &pipeline_layout_info, nullptr, &state.tube_gen_pipeline_layout);
+  assert(res == VK_SUCCESS);
+  state.tube_gen_pipeline = create_compute_pipeline(state,
+      tube_module, TUBE_WORKGROUP_SIZE, state.tube_gen_pipeline_layout);
+  vkDestroyShaderModule(state.device, tube_module, nullptr);
+}
+
+void cleanup_tube_gen_pipeline(AppState& state) {
+  vkDestroyPipeline(state.device, state.tube_gen_pipeline, nullptr);
+  vkDestroyPipelineLayout(state.device,
+      state.tube_gen_pipeline_layout, nullptr);
 }
 
+// A framebuffer of the scene pass and of the UI pass per swapchain image
 void setup_framebuffers(AppState& state) {
   state.swapchain_framebuffers.resize(state.swapchain_img_views.size());
+  state.ui_framebuffers.resize(state.swapchain_img_views.size());
   for (int i = 0; i < state.swapchain_img_views.size(); ++i) {
     vector<VkImageView> attachments = {
-      state.swapchain_img_views[i], state.depth_img_view
+      state.swapchain_img_views[i], state.depth_img_view, state.id_img_view
     };
     VkFramebufferCreateInfo framebuffer_info = {
       .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
@@ -1080,6 +1663,12 @@ void setup_framebuffers(AppState& state) {
     VkResult res = vkCreateFramebuffer(state.device, &framebuffer_info, nullptr,
         &state.swapchain_framebuffers[i]);
     assert(res == VK_SUCCESS);
+
+    framebuffer_info.renderPass = state.ui_render_pass;
+    framebuffer_info.attachmentCount = 1;
+    res = vkCreateFramebuffer(state.device, &framebuffer_info, nullptr,
+        &state.ui_framebuffers[i]);
+    assert(res == VK_SUCCESS);
   }
 }
 
@@ -1093,12 +1682,17 @@ void setup_command_pool(AppState& state) {
   VkResult res = vkCreateCommandPool(state.device, &cmd_pool_info, nullptr,
       &state.cmd_pool);
   assert(res == VK_SUCCESS);
+
+  cmd_pool_info.queueFamilyIndex = state.compute_family_index;
+  res = vkCreateCommandPool(state.device, &cmd_pool_info, nullptr,
+      &state.compute_cmd_pool);
+  assert(res == VK_SUCCESS);
 }
 
 void create_image(AppState& state, uint32_t w, uint32_t h,
     VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage,
     VmaMemoryUsage mem_usage, VmaAllocationCreateFlags flags,
-    VkImage& image, VmaAllocation& allocation) {
+    VkImage& image, VmaAllocation& allocation, uint32_t layers = 1) {
   VkImageCreateInfo img_info = {
     .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
     .imageType = VK_IMAGE_TYPE_2D,
@@ -1106,7 +1700,7 @@ void create_image(AppState& state, uint32_t w, uint32_t h,
     .extent.height = h,
     .extent.depth = 1,
     .mipLevels = 1,
-    .arrayLayers = 1,
+    .arrayLayers = layers,
     .format = format,
     .tiling = tiling,
     .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
@@ -1212,8 +1806,7 @@ void setup_depth_resources(AppState& state) {
   create_image(state, state.target_extent.width, state.target_extent.height,
       depth_format, VK_IMAGE_TILING_OPTIMAL,
       VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-      VMA_MEMORY_USAGE_GPU_ONLY,
-      VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
+      VMA_MEMORY_USAGE_GPU_ONLY, 0,
       state.depth_img,
       state.depth_img_alloc);
   state.depth_img_view = create_image_view(state, state.depth_img,
@@ -1224,31 +1817,79 @@ void setup_depth_resources(AppState& state) {
       VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
 }
 
+// The node id attachment, shared by the swapchain images like the depth.
+// The render pass clears it, so it needs no initial layout.
+void setup_node_id_resources(AppState& state) {
+  create_image(state, state.target_extent.width, state.target_extent.height,
+      NODE_ID_FORMAT, VK_IMAGE_TILING_OPTIMAL,
+      VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+      VMA_MEMORY_USAGE_GPU_ONLY, 0,
+      state.id_img,
+      state.id_img_alloc);
+  state.id_img_view = create_image_view(state, state.id_img,
+      NODE_ID_FORMAT, VK_IMAGE_ASPECT_COLOR_BIT);
+}
+
+// All of the attribute buffers of every buffer state are sub-ranges of
+// one buffer, the node arena. Each range is aligned for use as a texel
+// buffer view.
+void setup_node_arena(AppState& state) {
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(state.phys_device, &props);
+  VkDeviceSize alignment = std::max(
+      props.limits.minTexelBufferOffsetAlignment, (VkDeviceSize) 16);
+
+  VkDeviceSize arena_size = 0;
+  for (BufferState& buf_state : state.buffer_states) {
+    for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+      arena_size = (arena_size + alignment - 1) / alignment * alignment;
+      buf_state.vert_offsets[i] = arena_size;
+      arena_size += (VkDeviceSize)
+        node_attrib_stride(state.compact_nodes, i) * MAX_NUM_VERTICES;
+    }
+    arena_size = (arena_size + alignment - 1) / alignment * alignment;
+    buf_state.nor_offset = arena_size;
+    arena_size += (VkDeviceSize)
+      node_normal_stride(state.compact_nodes) * MAX_NUM_VERTICES;
+  }
+  create_buffer(state, arena_size,
+      VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+        VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+        VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT,
+      VMA_MEMORY_USAGE_GPU_ONLY, 0,
+      state.node_arena, state.node_arena_alloc);
+}
+
 void setup_buffer_state_vert_buffers(AppState& state, int buf_index) {
   BufferState& buf_state = state.buffer_states[buf_index];
 
-  VkDeviceSize buffer_size = sizeof(vec4) * MAX_NUM_VERTICES;
   for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
-    create_buffer(state, buffer_size,
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-          VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
-          VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
-          VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT,
-        VMA_MEMORY_USAGE_GPU_ONLY,
-        VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
-        buf_state.vert_buffers[i], buf_state.vert_buffer_allocs[i]);
-    
+    VkDeviceSize buffer_size = (VkDeviceSize)
+      node_attrib_stride(state.compact_nodes, i) * MAX_NUM_VERTICES;
     VkBufferViewCreateInfo buffer_view_info = {
       .sType = VK_STRUCTURE_TYPE_BUFFER_VIEW_CREATE_INFO,
-      .buffer = buf_state.vert_buffers[i],
-      .format = VK_FORMAT_R32G32B32A32_SFLOAT,
-      .offset = 0,
+      .buffer = state.node_arena,
+      .format = node_attrib_format(state.compact_nodes, i),
+      .offset = buf_state.vert_offsets[i],
       .range = buffer_size
     };
     VkResult res = vkCreateBufferView(state.device,
         &buffer_view_info, nullptr, &buf_state.vert_buffer_views[i]);
     assert(res == VK_SUCCESS);
   }
+
+  VkBufferViewCreateInfo nor_view_info = {
+    .sType = VK_STRUCTURE_TYPE_BUFFER_VIEW_CREATE_INFO,
+    .buffer = state.node_arena,
+    .format = node_normal_format(state.compact_nodes),
+    .offset = buf_state.nor_offset,
+    .range = (VkDeviceSize)
+      node_normal_stride(state.compact_nodes) * MAX_NUM_VERTICES
+  };
+  VkResult res = vkCreateBufferView(state.device,
+      &nor_view_info, nullptr, &buf_state.nor_buffer_view);
+  assert(res == VK_SUCCESS);
 }
 
 void setup_buffer_state_render_desc_sets(AppState& state, int buf_index) {
@@ -1265,25 +1906,32 @@ void setup_buffer_state_render_desc_sets(AppState& state, int buf_index) {
   assert(res == VK_SUCCESS);
 
   vector<VkWriteDescriptorSet> writes;
-  for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
-    VkWriteDescriptorSet write = {
-      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-      .dstSet = buf_state.render_desc_set,
-      .dstBinding = i,
-      .dstArrayElement = 0,
-      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER,
-      .descriptorCount = 1,
-      .pTexelBufferView = &buf_state.vert_buffer_views[i],
-    };
-    writes.push_back(write);
-  }
+  VkDescriptorBufferInfo camera_info = {
+    .buffer = state.camera_buffer,
+    .offset = 0,
+    .range = sizeof(CameraUniforms)
+  };
+  VkWriteDescriptorSet camera_write = {
+    .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+    .dstSet = buf_state.render_desc_set,
+    .dstBinding = RENDER_CAMERA_BINDING,
+    .dstArrayElement = 0,
+    .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+    .descriptorCount = 1,
+    .pBufferInfo = &camera_info
+  };
+  writes.push_back(camera_write);
   vkUpdateDescriptorSets(state.device, (uint32_t) writes.size(),
       writes.data(), 0, nullptr);
 }
 
-void setup_buffer_state_compute_desc_sets(AppState& state, int buf_index) {
+// Allocates the compute desc set that reads buf_index and writes
+// out_index
+void setup_buffer_state_compute_desc_set(AppState& state, int buf_index,
+    int out_index) {
   BufferState& buf_state = state.buffer_states[buf_index];
-  BufferState& other_buf_state = state.buffer_states[(buf_index + 1) % 2];
+  BufferState& other_buf_state = state.buffer_states[out_index];
+  VkDescriptorSet& desc_set = buf_state.compute_desc_sets[out_index];
   
   VkDescriptorSetAllocateInfo alloc_info = {
     .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
@@ -1292,7 +1940,7 @@ void setup_buffer_state_compute_desc_sets(AppState& state, int buf_index) {
     .pSetLayouts = &state.compute_desc_set_layout
   };
   VkResult res = vkAllocateDescriptorSets(state.device,
-      &alloc_info, &buf_state.compute_desc_set);
+      &alloc_info, &desc_set);
   assert(res == VK_SUCCESS);
  
   vector<VkWriteDescriptorSet> writes;
@@ -1304,7 +1952,7 @@ void setup_buffer_state_compute_desc_sets(AppState& state, int buf_index) {
     
     VkWriteDescriptorSet write = {
       .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-      .dstSet = buf_state.compute_desc_set,
+      .dstSet = desc_set,
       .dstBinding = i,
       .dstArrayElement = 0,
       .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER,
@@ -1321,7 +1969,7 @@ void setup_buffer_state_compute_desc_sets(AppState& state, int buf_index) {
   };
   VkWriteDescriptorSet compute_storage_write = {
     .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-    .dstSet = buf_state.compute_desc_set,
+    .dstSet = desc_set,
     .dstBinding = 2 * ATTRIBUTES_COUNT,
     .dstArrayElement = 0,
     .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
@@ -1329,17 +1977,55 @@ void setup_buffer_state_compute_desc_sets(AppState& state, int buf_index) {
     .pBufferInfo = &storage_buffer_info
   };
   writes.push_back(compute_storage_write);
+  // the write for the instance records
+  VkDescriptorBufferInfo instance_buffer_info = {
+    .buffer = state.instance_buffer,
+    .offset = 0,
+    .range = VK_WHOLE_SIZE
+  };
+  VkWriteDescriptorSet instance_write = {
+    .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+    .dstSet = desc_set,
+    .dstBinding = 2 * ATTRIBUTES_COUNT + 1,
+    .dstArrayElement = 0,
+    .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    .descriptorCount = 1,
+    .pBufferInfo = &instance_buffer_info
+  };
+  writes.push_back(instance_write);
+  // the write for the normals of the input state
+  VkWriteDescriptorSet normals_write = {
+    .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+    .dstSet = desc_set,
+    .dstBinding = 2 * ATTRIBUTES_COUNT + 2,
+    .dstArrayElement = 0,
+    .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER,
+    .descriptorCount = 1,
+    .pTexelBufferView = &buf_state.nor_buffer_view,
+  };
+  writes.push_back(normals_write);
 
   vkUpdateDescriptorSets(state.device, (uint32_t) writes.size(),
       writes.data(), 0, nullptr);
 }
 
+void setup_buffer_state_compute_desc_sets(AppState& state, int buf_index) {
+  for (int i = 0; i < state.buffer_states.size(); ++i) {
+    if (i != buf_index) {
+      setup_buffer_state_compute_desc_set(state, buf_index, i);
+    }
+  }
+}
+
 void setup_buffer_state_desc_sets(AppState& state, int buf_index) {
   setup_buffer_state_render_desc_sets(state, buf_index);
   setup_buffer_state_compute_desc_sets(state, buf_index);
 }
 
 void setup_buffer_states(AppState& state) {
+  // the recorded draws reference the old buffers and desc sets
+  invalidate_scene_cmds(state);
+  setup_node_arena(state);
   for (int i = 0; i < state.buffer_states.size(); ++i) {
     setup_buffer_state_vert_buffers(state, i); 
   }
@@ -1350,15 +2036,64 @@ void setup_buffer_states(AppState& state) {
 
 void setup_compute_storage_buffer(AppState& state) {
   VkDeviceSize buffer_size = sizeof(ComputeStorage);
+  // also holds the args for the indirect simulation dispatches
   create_buffer(state, buffer_size,
       VK_BUFFER_USAGE_TRANSFER_DST_BIT |
         VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
         VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
-        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+        VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
       VMA_MEMORY_USAGE_GPU_ONLY, 0,
       state.compute_storage_buffer, state.compute_storage_buffer_alloc);
 }
 
+// Sized for the max number of instances and user unifs
+void setup_sim_instance_buffer(AppState& state) {
+  VkDeviceSize buffer_size = MAX_NUM_INSTANCES *
+    SimInstance::record_size(MAX_NUM_USER_UNIFS);
+  create_buffer(state, buffer_size,
+      VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+      VMA_MEMORY_USAGE_GPU_ONLY, 0,
+      state.instance_buffer, state.instance_buffer_alloc);
+}
+
+// The ring is sized for frames of all attributes of the max node count,
+// and stays mapped
+void setup_trajectory_ring(AppState& state) {
+  state.traj_slot_size = 0;
+  for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+    state.traj_slot_size += node_attrib_stride(false, i) * MAX_NUM_VERTICES;
+  }
+  create_buffer(state, TRAJECTORY_RING_SLOTS * state.traj_slot_size,
+      VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+      VMA_MEMORY_USAGE_GPU_TO_CPU, 0,
+      state.traj_ring, state.traj_ring_alloc);
+  void* ring_data = nullptr;
+  VkResult res = vmaMapMemory(state.allocator, state.traj_ring_alloc,
+      &ring_data);
+  assert(res == VK_SUCCESS);
+  state.traj_ring_data = (char*) ring_data;
+}
+
+void setup_camera_buffer(AppState& state) {
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(state.phys_device, &props);
+  VkDeviceSize alignment = props.limits.minUniformBufferOffsetAlignment;
+  state.camera_slot_size =
+    (sizeof(CameraUniforms) + alignment - 1) / alignment * alignment;
+  create_buffer(state,
+      (max_frames_in_flight + MAX_THUMBNAIL_VIEWS) * state.camera_slot_size,
+      VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+      VMA_MEMORY_USAGE_CPU_TO_GPU, 0,
+      state.camera_buffer, state.camera_buffer_alloc);
+  void* camera_data = nullptr;
+  VkResult res = vmaMapMemory(state.allocator, state.camera_buffer_alloc,
+      &camera_data);
+  assert(res == VK_SUCCESS);
+  state.camera_buffer_data = (char*) camera_data;
+}
+
 // TODO - remove
 /*
 void old_setup_vertex_buffer(AppState& state, vector<Vertex>& vertices) {
@@ -1395,14 +2130,73 @@ void old_setup_vertex_buffer(AppState& state, vector<Vertex>& vertices) {
 }
 */
 
+// The index buffers are sub-allocated from a custom pool, and created
+// on demand by ensure_index_buffer_size
 void setup_index_buffers(AppState& state) {
+  VkBufferCreateInfo buffer_info = {
+    .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .size = MIN_INDEX_BUFFER_SIZE,
+    .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+      VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+    .sharingMode = VK_SHARING_MODE_EXCLUSIVE
+  };
+  VmaAllocationCreateInfo allocation_info = {
+    .usage = VMA_MEMORY_USAGE_GPU_ONLY
+  };
+  uint32_t mem_type_index;
+  VkResult res = vmaFindMemoryTypeIndexForBufferInfo(state.allocator,
+      &buffer_info, &allocation_info, &mem_type_index);
+  assert(res == VK_SUCCESS);
+
+  // use the default block size
+  VmaPoolCreateInfo pool_info = {
+    .memoryTypeIndex = mem_type_index
+  };
+  res = vmaCreatePool(state.allocator, &pool_info, &state.index_pool);
+  assert(res == VK_SUCCESS);
+
   for (uint32_t i = 0; i < PIPELINES_COUNT; ++i) {
-    create_buffer(state, sizeof(uint32_t) * MAX_NUM_INDICES,
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-          VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-        VMA_MEMORY_USAGE_GPU_ONLY, 0,
-        state.index_buffers[i], state.index_buffer_allocs[i]);
+    state.index_buffers[i] = VK_NULL_HANDLE;
+    state.index_buffer_sizes[i] = 0;
+    state.index_counts[i] = 0;
+  }
+}
+
+// Grows the index buffer of the pipeline geometrically if it is smaller
+// than size. The contents are not kept.
+void ensure_index_buffer_size(AppState& state, uint32_t pipeline_index,
+    VkDeviceSize size) {
+  VkDeviceSize& capacity = state.index_buffer_sizes[pipeline_index];
+  if (size <= capacity) {
+    return;
+  }
+  VkDeviceSize new_capacity = std::max(capacity, MIN_INDEX_BUFFER_SIZE);
+  while (new_capacity < size) {
+    new_capacity *= 2;
   }
+
+  VkBuffer& buffer = state.index_buffers[pipeline_index];
+  VmaAllocation& allocation = state.index_buffer_allocs[pipeline_index];
+  if (buffer != VK_NULL_HANDLE) {
+    // the frames in flight may still draw with it
+    wait_for_frames(state, state.frame_serial);
+    vmaDestroyBuffer(state.allocator, buffer, allocation);
+  }
+  VkBufferCreateInfo buffer_info = {
+    .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .size = new_capacity,
+    .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+      VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+    .sharingMode = VK_SHARING_MODE_EXCLUSIVE
+  };
+  VmaAllocationCreateInfo allocation_info = {
+    .usage = VMA_MEMORY_USAGE_GPU_ONLY,
+    .pool = state.index_pool
+  };
+  VkResult res = vmaCreateBuffer(state.allocator, &buffer_info,
+      &allocation_info, &buffer, &allocation, nullptr);
+  assert(res == VK_SUCCESS);
+  capacity = new_capacity;
 }
 
 void setup_descriptor_pool(AppState& state) {
@@ -1425,75 +2219,362 @@ void setup_descriptor_pool(AppState& state) {
 }
 
 void setup_command_buffers(AppState& state) {
-  state.cmd_buffers.resize(state.swapchain_framebuffers.size());
+  uint32_t img_count = (uint32_t) state.swapchain_framebuffers.size();
+  assert(img_count <= MAX_SWAPCHAIN_IMAGES);
+  state.cmd_buffers.resize(img_count);
   VkCommandBufferAllocateInfo cmd_buffer_info = {
     .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
     .commandPool = state.cmd_pool,
     .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-    .commandBufferCount = (uint32_t) state.swapchain_framebuffers.size()
+    .commandBufferCount = img_count
   };
   VkResult res = vkAllocateCommandBuffers(state.device, &cmd_buffer_info,
       state.cmd_buffers.data());
   assert(res == VK_SUCCESS);
+
+  cmd_buffer_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+  state.imgui_cmd_buffers.resize(img_count);
+  res = vkAllocateCommandBuffers(state.device, &cmd_buffer_info,
+      state.imgui_cmd_buffers.data());
+  assert(res == VK_SUCCESS);
+  state.image_serials.assign(img_count, 0);
+
+  state.scene_cmd_buffers.resize(max_frames_in_flight);
+  state.scene_cmd_versions.resize(max_frames_in_flight);
+  cmd_buffer_info.commandBufferCount = NUM_BUFFER_STATES;
+  for (int i = 0; i < max_frames_in_flight; ++i) {
+    res = vkAllocateCommandBuffers(state.device, &cmd_buffer_info,
+        state.scene_cmd_buffers[i].data());
+    assert(res == VK_SUCCESS);
+    // 0 is never a scene version, so they're recorded on first use
+    state.scene_cmd_versions[i].fill(0);
+  }
+}
+
+// Grows a GPU only buffer to hold at least size bytes, doubling its
+// capacity. The contents are not kept.
+// Returns true if the buffer was recreated.
+bool ensure_gpu_buffer_size(AppState& state, VkBuffer& buffer,
+    VmaAllocation& allocation, VkDeviceSize& capacity, VkDeviceSize size,
+    VkBufferUsageFlags usage) {
+  if (size <= capacity) {
+    return false;
+  }
+  VkDeviceSize new_capacity = std::max(capacity, MIN_INDEX_BUFFER_SIZE);
+  while (new_capacity < size) {
+    new_capacity *= 2;
+  }
+  if (buffer != VK_NULL_HANDLE) {
+    // the frames in flight may still use it
+    wait_for_frames(state, state.frame_serial);
+    vmaDestroyBuffer(state.allocator, buffer, allocation);
+  }
+  create_buffer(state, new_capacity, usage,
+      VMA_MEMORY_USAGE_GPU_ONLY, 0, buffer, allocation);
+  capacity = new_capacity;
+  return true;
+}
+
+// Creates the cull args buffer and desc sets of each frame in flight. The
+// culled index buffers are created on first use, see prepare_cull_target.
+void setup_cull_targets(AppState& state) {
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(state.phys_device, &props);
+  VkDeviceSize alignment = props.limits.minStorageBufferOffsetAlignment;
+  state.cull_args_offset =
+    (sizeof(CullUniforms) + alignment - 1) / alignment * alignment;
+  VkDeviceSize args_size = state.cull_args_offset +
+    2 * MAX_NUM_INSTANCES * sizeof(VkDrawIndexedIndirectCommand);
+
+  state.cull_targets.resize(max_frames_in_flight);
+  for (CullTarget& target : state.cull_targets) {
+    create_buffer(state, args_size,
+        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+          VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+        VMA_MEMORY_USAGE_CPU_TO_GPU, 0,
+        target.args_buffer, target.args_alloc);
+    void* args_data = nullptr;
+    VkResult res = vmaMapMemory(state.allocator, target.args_alloc,
+        &args_data);
+    assert(res == VK_SUCCESS);
+    target.args_data = (char*) args_data;
+    target.index_buffer = VK_NULL_HANDLE;
+    target.index_capacity = 0;
+
+    vector<VkDescriptorSetLayout> layouts(NUM_BUFFER_STATES,
+        state.cull_desc_set_layout);
+    VkDescriptorSetAllocateInfo alloc_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .descriptorPool = state.desc_pool,
+      .descriptorSetCount = (uint32_t) layouts.size(),
+      .pSetLayouts = layouts.data()
+    };
+    res = vkAllocateDescriptorSets(state.device, &alloc_info,
+        target.desc_sets.data());
+    assert(res == VK_SUCCESS);
+  }
+}
+
+void cleanup_cull_targets(AppState& state) {
+  for (CullTarget& target : state.cull_targets) {
+    vmaUnmapMemory(state.allocator, target.args_alloc);
+    vmaDestroyBuffer(state.allocator, target.args_buffer, target.args_alloc);
+    if (target.index_buffer != VK_NULL_HANDLE) {
+      vmaDestroyBuffer(state.allocator, target.index_buffer,
+          target.index_alloc);
+    }
+    vkFreeDescriptorSets(state.device, state.desc_pool,
+        (uint32_t) target.desc_sets.size(), target.desc_sets.data());
+  }
+  state.cull_targets.clear();
+}
+
+// The tube pass desc sets of each frame in flight, written when the
+// scene draws are recorded, see prepare_tube_pass
+void setup_tube_desc_sets(AppState& state) {
+  state.tube_desc_sets.resize(max_frames_in_flight);
+  for (auto& desc_sets : state.tube_desc_sets) {
+    vector<VkDescriptorSetLayout> layouts(NUM_BUFFER_STATES,
+        state.tube_desc_set_layout);
+    VkDescriptorSetAllocateInfo alloc_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .descriptorPool = state.desc_pool,
+      .descriptorSetCount = (uint32_t) layouts.size(),
+      .pSetLayouts = layouts.data()
+    };
+    VkResult res = vkAllocateDescriptorSets(state.device, &alloc_info,
+        desc_sets.data());
+    assert(res == VK_SUCCESS);
+  }
+}
+
+void cleanup_tube_desc_sets(AppState& state) {
+  for (auto& desc_sets : state.tube_desc_sets) {
+    vkFreeDescriptorSets(state.device, state.desc_pool,
+        (uint32_t) desc_sets.size(), desc_sets.data());
+  }
+  state.tube_desc_sets.clear();
+}
+
+void setup_node_picker(AppState& state) {
+  NodePicker& picker = state.picker;
+  create_buffer(state, sizeof(uint32_t) * max_frames_in_flight,
+      VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+      VMA_MEMORY_USAGE_GPU_TO_CPU, 0,
+      picker.readback_buffer, picker.readback_alloc);
+  void* readback_data = nullptr;
+  VkResult res = vmaMapMemory(state.allocator, picker.readback_alloc,
+      &readback_data);
+  assert(res == VK_SUCCESS);
+  picker.readback_data = (uint32_t*) readback_data;
+  picker.slot_texels.assign(max_frames_in_flight, ivec2(-1));
+}
+
+void cleanup_node_picker(AppState& state) {
+  vmaUnmapMemory(state.allocator, state.picker.readback_alloc);
+  vmaDestroyBuffer(state.allocator, state.picker.readback_buffer,
+      state.picker.readback_alloc);
+}
+
+void setup_node_inspector(AppState& state) {
+  NodeInspector& inspector = state.inspector;
+  create_buffer(state, NODE_INSPECTOR_SLOT_SIZE * max_frames_in_flight,
+      VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+      VMA_MEMORY_USAGE_GPU_TO_CPU, 0,
+      inspector.readback_buffer, inspector.readback_alloc);
+  void* readback_data = nullptr;
+  VkResult res = vmaMapMemory(state.allocator, inspector.readback_alloc,
+      &readback_data);
+  assert(res == VK_SUCCESS);
+  inspector.readback_data = (char*) readback_data;
+  inspector.slot_reads.assign(max_frames_in_flight, NodeInspectorRead());
+  inspector.copied_node = -1;
+}
+
+void cleanup_node_inspector(AppState& state) {
+  vmaUnmapMemory(state.allocator, state.inspector.readback_alloc);
+  vmaDestroyBuffer(state.allocator, state.inspector.readback_buffer,
+      state.inspector.readback_alloc);
 }
 
 void copy_data_to_buffer(AppState& state, StagingBuf& staging,
-    void* src_data, uint32_t buffer_size, VkBuffer& dst_buffer) {
+    void* src_data, uint32_t buffer_size, VkBuffer& dst_buffer,
+    VkDeviceSize dst_offset = 0) {
   void* staging_data;
   vmaMapMemory(state.allocator, staging.allocation, &staging_data);
   memcpy(staging_data, src_data, (size_t) buffer_size);
   vmaUnmapMemory(state.allocator, staging.allocation);
-  copy_buffer(state, staging.buf, dst_buffer, buffer_size);
+  copy_buffer(state, staging.buf, dst_buffer, buffer_size, 0, dst_offset);
 }
 
 void copy_data_from_buffer(AppState& state, StagingBuf& staging,
-    void* dst_data, uint32_t buffer_size, VkBuffer& src_buffer) {
-  copy_buffer(state, src_buffer, staging.buf, buffer_size);
+    void* dst_data, uint32_t buffer_size, VkBuffer& src_buffer,
+    VkDeviceSize src_offset = 0) {
+  copy_buffer(state, src_buffer, staging.buf, buffer_size, src_offset, 0);
   void* staging_data;
   vmaMapMemory(state.allocator, staging.allocation, &staging_data);
   memcpy(dst_data, staging_data, (size_t) buffer_size);
   vmaUnmapMemory(state.allocator, staging.allocation);
 }
 
-void write_nodes_to_buffers(AppState& state, MorphNodes& node_vecs) {
+// Uploads the unit tube drawn for each segment: TUBE_SIDES quads around
+// the z axis from z = 0 to z = 1, open at the ends
+void setup_tube_mesh(AppState& state) {
+  vector<vec4> vertices;
+  for (uint32_t end = 0; end < 2; ++end) {
+    for (uint32_t i = 0; i < TUBE_SIDES; ++i) {
+      float angle = 2.0f * (float) M_PI * i / TUBE_SIDES;
+      vertices.push_back(vec4(cos(angle), sin(angle), (float) end, 0.0f));
+    }
+  }
+  // counter-clockwise seen from outside, see tube.vert
+  vector<uint16_t> indices;
+  for (uint32_t i = 0; i < TUBE_SIDES; ++i) {
+    uint16_t a = i;
+    uint16_t b = (i + 1) % TUBE_SIDES;
+    uint16_t c = b + TUBE_SIDES;
+    uint16_t d = a + TUBE_SIDES;
+    indices.insert(indices.end(), {a, b, c, a, c, d});
+  }
+  state.tube_mesh_index_count = (uint32_t) indices.size();
+  state.tube_mesh_index_offset = sizeof(vec4) * vertices.size();
+
+  VkDeviceSize index_size = sizeof(uint16_t) * indices.size();
+  VkDeviceSize buffer_size = state.tube_mesh_index_offset + index_size;
+  create_buffer(state, buffer_size,
+      VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+        VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+      VMA_MEMORY_USAGE_GPU_ONLY, 0,
+      state.tube_mesh_buffer, state.tube_mesh_alloc);
+  vector<char> mesh_data(buffer_size);
+  memcpy(mesh_data.data(), vertices.data(), state.tube_mesh_index_offset);
+  memcpy(mesh_data.data() + state.tube_mesh_index_offset,
+      indices.data(), index_size);
+  StagingBuf staging(state, buffer_size);
+  copy_data_to_buffer(state, staging, mesh_data.data(),
+      buffer_size, state.tube_mesh_buffer);
+  staging.cleanup(state);
+}
+
+// Records the normals pass over the nodes of buffer state buf_index.
+// The caller makes the pos and neighbors writes visible to it first.
+void record_normals_pass(AppState& state, VkCommandBuffer cmd_buffer,
+    uint32_t buf_index) {
+  // the pass only writes the normals of the state it reads, so any of
+  // the desc sets that read the state will do
+  uint32_t out_index = (buf_index + 1) % NUM_BUFFER_STATES;
+  VkDescriptorSet& desc_set =
+    state.buffer_states[buf_index].compute_desc_sets[out_index];
+  vkCmdBindPipeline(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      state.normals_pipeline);
+  vkCmdBindDescriptorSets(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      state.compute_pipeline_layout, 0, 1, &desc_set, 0, nullptr);
+  ComputePushConstants push_consts(0, state.instance_queue_len,
+      (uint32_t) state.instances.size(), state.node_count);
+  vkCmdPushConstants(cmd_buffer, state.compute_pipeline_layout,
+      VK_SHADER_STAGE_COMPUTE_BIT, 0,
+      sizeof(ComputePushConstants), &push_consts);
+  vkCmdDispatch(cmd_buffer,
+      div_ceil(state.node_count, NORMALS_WORKGROUP_SIZE), 1, 1);
+}
+
+// Records the normals passes for buffer states that were just written
+// by transfers
+void record_normals_update(AppState& state, VkCommandBuffer cmd_buffer,
+    const vector<uint32_t>& buf_indices) {
+  VkMemoryBarrier transfer_barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_SHADER_READ_BIT
+  };
+  vkCmdPipelineBarrier(cmd_buffer,
+      VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+      1, &transfer_barrier,
+      0, nullptr,
+      0, nullptr);
+  for (uint32_t buf_index : buf_indices) {
+    record_normals_pass(state, cmd_buffer, buf_index);
+  }
+}
+
+// Writes the nodes to the given buffer states, and updates their normals
+void write_nodes_to_buffers(AppState& state, MorphNodes& node_vecs,
+    const vector<uint32_t>& buf_indices) {
   uint32_t node_count = node_vecs.pos_vec.size();
   assert(node_count <= MAX_NUM_VERTICES);
   state.node_count = node_count;
 
-  VkDeviceSize buffer_size = sizeof(vec4) * node_count;
-  StagingBuf staging(state, buffer_size);
+  VkDeviceSize max_buffer_size = sizeof(vec4) * node_count;
+  StagingBuf staging(state, max_buffer_size);
+  vector<char> packed(max_buffer_size);
   
-  // Always write to the first buffer
-  BufferState& buf_state = state.buffer_states[0];
-
-  array<void*, ATTRIBUTES_COUNT> copy_srcs = node_vecs.data_ptrs();
   for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
-    copy_data_to_buffer(state, staging,
-        copy_srcs[i], buffer_size, buf_state.vert_buffers[i]);
+    VkDeviceSize buffer_size = (VkDeviceSize)
+      node_attrib_stride(state.compact_nodes, i) * node_count;
+    node_vecs.pack_attrib(i, state.compact_nodes, packed.data());
+    for (uint32_t buf_index : buf_indices) {
+      copy_data_to_buffer(state, staging, packed.data(), buffer_size,
+          state.node_arena, state.buffer_states[buf_index].vert_offsets[i]);
+    }
   }
-
   staging.cleanup(state);
+
+  VkCommandBuffer cmd_buffer = begin_single_time_commands(state);
+  record_normals_update(state, cmd_buffer, buf_indices);
+  end_single_time_commands(state, cmd_buffer);
 }
 
-MorphNodes read_nodes_from_buffers(AppState& state, uint32_t buf_index) {
+// Writes the nodes to the buffer states of the simulation. Nodes that are
+// not stepped (inactive nodes without messages) never write their output,
+// so the data in the output buffer must already be consistent for them.
+void write_nodes_to_sim_buffers(AppState& state, MorphNodes& node_vecs) {
+  vector<uint32_t> buf_indices(
+      state.sim_buffers.begin(), state.sim_buffers.end());
+  write_nodes_to_buffers(state, node_vecs, buf_indices);
+}
+
+void write_nodes_to_buffers(AppState& state, MorphNodes& node_vecs) {
+  vector<uint32_t> buf_indices;
+  for (uint32_t i = 0; i < state.buffer_states.size(); ++i) {
+    buf_indices.push_back(i);
+  }
+  write_nodes_to_buffers(state, node_vecs, buf_indices);
+}
+
+// Only the attributes in attribs are read, the rest are left zeroed
+MorphNodes read_nodes_from_buffers(AppState& state, uint32_t buf_index,
+    AttribMask attribs) {
   if (state.node_count == 0) {
     return MorphNodes(0);
   }
   BufferState& buf_state = state.buffer_states[buf_index];
   MorphNodes node_vecs(state.node_count);
-  VkDeviceSize buffer_size = sizeof(vec4) * state.node_count;
+  VkDeviceSize max_buffer_size = sizeof(vec4) * state.node_count;
 
-  StagingBuf staging(state, buffer_size);
-  array<void*, ATTRIBUTES_COUNT> copy_dsts = node_vecs.data_ptrs();
+  StagingBuf staging(state, max_buffer_size);
+  vector<char> packed(max_buffer_size);
   for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
-    copy_data_from_buffer(state, staging, copy_dsts[i],
-        buffer_size, buf_state.vert_buffers[i]);
+    if (!(attribs & attrib_bit(i))) {
+      continue;
+    }
+    VkDeviceSize buffer_size = (VkDeviceSize)
+      node_attrib_stride(state.compact_nodes, i) * state.node_count;
+    copy_data_from_buffer(state, staging, packed.data(),
+        buffer_size, state.node_arena, buf_state.vert_offsets[i]);
+    node_vecs.unpack_attrib(i, state.compact_nodes, packed.data());
   }
   staging.cleanup(state);
 
   return node_vecs;
 }
 
+MorphNodes read_nodes_from_buffers(AppState& state, uint32_t buf_index) {
+  return read_nodes_from_buffers(state, buf_index, ALL_ATTRIBS);
+}
+
 void log_nodes(MorphNodes& node_vecs) {
   printf("%lu nodes:\n", node_vecs.pos_vec.size()); 
   for (int i = 0; i < node_vecs.pos_vec.size(); ++i) {
@@ -1503,102 +2584,755 @@ void log_nodes(MorphNodes& node_vecs) {
   printf("\n\n");
 }
 
-void record_render_pass(AppState& state, uint32_t buffer_index) {
-  uint32_t i = buffer_index;
-
-  // moves the command buffer back to the initial state so that we
-  // may record again
-  VkResult res = vkResetCommandBuffer(state.cmd_buffers[i],
-      VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT);
-  assert(res == VK_SUCCESS);
+// Lays the instances out in a grid in the xz plane
+mat4 instance_model_mat(uint32_t instance_index, uint32_t num_instances) {
+  uint32_t num_cols = (uint32_t) ceil(sqrt((float) num_instances));
+  vec3 cell((float) (instance_index % num_cols), 0.0f,
+      (float) (instance_index / num_cols));
+  return glm::translate(mat4(1.0f), INSTANCE_TILE_SPACING * cell);
+}
 
+// Begins a secondary command buffer that continues render_pass in
+// framebuffer, or in any framebuffer if it's VK_NULL_HANDLE
+void begin_render_pass_secondary(VkCommandBuffer cmd_buffer,
+    VkRenderPass render_pass, VkFramebuffer framebuffer,
+    VkCommandBufferUsageFlags usage) {
+  VkCommandBufferInheritanceInfo inheritance_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+    .renderPass = render_pass,
+    .subpass = 0,
+    .framebuffer = framebuffer
+  };
   VkCommandBufferBeginInfo begin_info = {
     .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
-    .pInheritanceInfo = nullptr
+    .flags = usage | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+    .pInheritanceInfo = &inheritance_info
   };
-  res = vkBeginCommandBuffer(state.cmd_buffers[i], &begin_info);
+  VkResult res = vkResetCommandBuffer(cmd_buffer, 0);
   assert(res == VK_SUCCESS);
+  res = vkBeginCommandBuffer(cmd_buffer, &begin_info);
+  assert(res == VK_SUCCESS);
+}
 
-  array<VkClearValue, 2> clear_values = {};
-  clear_values[0].color = {1.0f, 1.0f, 1.0f, 1.0f};
-  clear_values[1].depthStencil = {1.0f, 0};
-
-  VkRenderPassBeginInfo render_pass_info = {
-    .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-    .renderPass = state.render_pass,
-    .framebuffer = state.swapchain_framebuffers[i],
-    .renderArea.offset = {0, 0},
-    .renderArea.extent = state.target_extent,
-    .clearValueCount = (uint32_t) clear_values.size(),
-    .pClearValues = clear_values.data()
-  };
+// Whether the point and line draws use the output of the cull pass
+bool cull_active(AppState& state) {
+  return state.controls.gpu_cull &&
+    state.index_counts[POINTS_PIPELINE] +
+      state.index_counts[LINES_PIPELINE] > 0;
+}
 
-  BufferState& buf_state = state.buffer_states[state.result_buffer];
-  auto& vert_buffers = buf_state.vert_buffers;
-  vector<VkDeviceSize> byte_offsets(vert_buffers.size(), 0);
+// Sizes the culled index buffer of frame in flight frame for the current
+// indices, and points its desc set for buffer state buf_index at the
+// current buffers
+void prepare_cull_target(AppState& state, uint32_t frame,
+    uint32_t buf_index) {
+  CullTarget& target = state.cull_targets[frame];
+  VkDeviceSize index_size = sizeof(uint32_t) *
+    (state.index_counts[POINTS_PIPELINE] + state.index_counts[LINES_PIPELINE]);
+  if (ensure_gpu_buffer_size(state, target.index_buffer, target.index_alloc,
+        target.index_capacity, index_size,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+          VK_BUFFER_USAGE_INDEX_BUFFER_BIT)) {
+    // the other recorded draws of this frame use the old buffer
+    state.scene_cmd_versions[frame].fill(0);
+  }
 
-  // update push constants
-  Camera& cam = state.cam;
-  float aspect_ratio = state.target_extent.width / (float) state.target_extent.height;
-  mat4 model_mat = mat4(1.0f);
-  mat4 view_mat = glm::lookAt(cam.pos(), cam.pos() + cam.forward(), cam.up());
-  mat4 proj_mat = glm::perspective((float) M_PI / 4.0f, aspect_ratio, 0.1f, 10000.0f);
-  // invert Y b/c vulkan's y-axis is inverted wrt OpenGL
-	proj_mat[1][1] *= -1;
-  RenderPushConstants push_consts(model_mat, view_mat, proj_mat,
-      state.render_unifs);
+  BufferState& buf_state = state.buffer_states[buf_index];
+  VkDescriptorSet desc_set = target.desc_sets[buf_index];
+  VkDescriptorBufferInfo source_info = {
+    state.cull_source_buffer, 0, VK_WHOLE_SIZE
+  };
+  VkDescriptorBufferInfo unifs_info = {
+    target.args_buffer, 0, sizeof(CullUniforms)
+  };
+  VkDescriptorBufferInfo args_info = {
+    target.args_buffer, state.cull_args_offset, VK_WHOLE_SIZE
+  };
+  VkDescriptorBufferInfo culled_info = {
+    target.index_buffer, 0, VK_WHOLE_SIZE
+  };
+  vector<VkWriteDescriptorSet> writes;
+  array<uint32_t, 2> texel_attribs = {ATTRIB_POS, ATTRIB_NEIGHBORS};
+  for (uint32_t i = 0; i < texel_attribs.size(); ++i) {
+    VkWriteDescriptorSet write = {
+      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+      .dstSet = desc_set,
+      .dstBinding = i,
+      .dstArrayElement = 0,
+      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER,
+      .descriptorCount = 1,
+      .pTexelBufferView = &buf_state.vert_buffer_views[texel_attribs[i]]
+    };
+    writes.push_back(write);
+  }
+  vector<pair<VkDescriptorType, VkDescriptorBufferInfo*>> buffer_bindings = {
+    {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, &source_info},
+    {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, &unifs_info},
+    {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, &args_info},
+    {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, &culled_info}
+  };
+  for (uint32_t i = 0; i < buffer_bindings.size(); ++i) {
+    VkWriteDescriptorSet write = {
+      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+      .dstSet = desc_set,
+      .dstBinding = (uint32_t) texel_attribs.size() + i,
+      .dstArrayElement = 0,
+      .descriptorType = buffer_bindings[i].first,
+      .descriptorCount = 1,
+      .pBufferInfo = buffer_bindings[i].second
+    };
+    writes.push_back(write);
+  }
+  vkUpdateDescriptorSets(state.device, (uint32_t) writes.size(),
+      writes.data(), 0, nullptr);
+}
 
-  vkCmdBeginRenderPass(state.cmd_buffers[i], &render_pass_info,
-        VK_SUBPASS_CONTENTS_INLINE);
+// The offset of the indirect draw args of an instance in the args buffer
+VkDeviceSize cull_draw_args_offset(AppState& state, uint32_t pipeline_index,
+    uint32_t instance_index) {
+  return state.cull_args_offset + sizeof(VkDrawIndexedIndirectCommand) *
+    (pipeline_index * MAX_NUM_INSTANCES + instance_index);
+}
 
-  // draw the structure for each active pipeline 
-  for (uint32_t pipeline_index = 0; pipeline_index < PIPELINES_COUNT; ++pipeline_index) {
-    if (!state.controls.pipeline_toggles[pipeline_index] ||
-        state.index_counts[pipeline_index] == 0) {
-      continue;
+/*
+   Records the cull pass of frame in flight frame into cmd_buffer. The
+   host fills in the uniforms and resets the draw args, the pass then
+   appends the visible indices of each instance to its range. The target
+   is only read by the frame's last submit, which render_frame has waited
+   for.
+*/
+void record_cull_pass(AppState& state, VkCommandBuffer cmd_buffer,
+    uint32_t frame, const CameraUniforms& camera_unifs) {
+  CullTarget& target = state.cull_targets[frame];
+  uint32_t point_index_count = state.index_counts[POINTS_PIPELINE];
+  uint32_t line_index_count = state.index_counts[LINES_PIPELINE];
+  auto& point_ranges = state.instance_index_ranges[POINTS_PIPELINE];
+  auto& line_ranges = state.instance_index_ranges[LINES_PIPELINE];
+
+  CullUniforms unifs;
+  unifs.view_proj = camera_unifs.proj * camera_unifs.view;
+  unifs.instance_count = (uint32_t) std::max(
+      point_ranges.size(), line_ranges.size());
+  unifs.point_index_count = point_index_count;
+  unifs.line_index_count = line_index_count;
+  unifs.viewport_height = (float) state.target_extent.height;
+  unifs.lod_pixels = state.controls.lod_pixels;
+  for (uint32_t k = 0; k < MAX_NUM_INSTANCES; ++k) {
+    uvec2 point_range(0);
+    uvec2 line_range(0);
+    if (k < point_ranges.size()) {
+      point_range = uvec2(point_ranges[k].first, point_ranges[k].second);
+    }
+    if (k < line_ranges.size()) {
+      line_range = uvec2(point_index_count + line_ranges[k].first,
+          line_ranges[k].second);
+    }
+    unifs.models[k] = k < unifs.instance_count ?
+      instance_model_mat(k, unifs.instance_count) : mat4(1.0f);
+    unifs.ranges[k] = uvec4(point_range, line_range);
+
+    // each instance's indices are appended from the start of its range
+    array<uvec2, 2> ranges = {point_range, line_range};
+    for (uint32_t p = 0; p < ranges.size(); ++p) {
+      VkDrawIndexedIndirectCommand draw_args = {
+        .indexCount = 0,
+        .instanceCount = 1,
+        .firstIndex = ranges[p].x,
+        .vertexOffset = 0,
+        .firstInstance = 0
+      };
+      memcpy(target.args_data + cull_draw_args_offset(state, p, k),
+          &draw_args, sizeof(draw_args));
     }
-    vkCmdBindPipeline(state.cmd_buffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS,
-        state.graphics_pipelines[pipeline_index]);
-    vkCmdBindVertexBuffers(state.cmd_buffers[i], 0, vert_buffers.size(),
-        vert_buffers.data(), byte_offsets.data());
-    vkCmdBindIndexBuffer(state.cmd_buffers[i],
-        state.index_buffers[pipeline_index], 0, VK_INDEX_TYPE_UINT32);
-    vkCmdBindDescriptorSets(state.cmd_buffers[i],
-        VK_PIPELINE_BIND_POINT_GRAPHICS,
-        state.render_pipeline_layout, 0, 1,
-        &buf_state.render_desc_set, 0, nullptr);
-    vkCmdPushConstants(state.cmd_buffers[i], state.render_pipeline_layout,
-        VK_SHADER_STAGE_VERTEX_BIT, 0,
-        sizeof(RenderPushConstants), &push_consts);
-
-    vkCmdDrawIndexed(state.cmd_buffers[i], state.index_counts[pipeline_index],
-        1, 0, 0, 0);
   }
+  memcpy(target.args_data, &unifs, sizeof(unifs));
+  // the mapping need not be host coherent
+  vmaFlushAllocation(state.allocator, target.args_alloc, 0, VK_WHOLE_SIZE);
+
+  uint32_t prim_count = point_index_count + line_index_count / 2;
+  vkCmdBindPipeline(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      state.cull_pipeline);
+  vkCmdBindDescriptorSets(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      state.cull_pipeline_layout, 0, 1,
+      &target.desc_sets[state.result_buffer], 0, nullptr);
+  vkCmdDispatch(cmd_buffer, div_ceil(prim_count, CULL_WORKGROUP_SIZE), 1, 1);
+
+  VkMemoryBarrier cull_barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+      VK_ACCESS_INDEX_READ_BIT
+  };
+  vkCmdPipelineBarrier(cmd_buffer,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+        VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0,
+      1, &cull_barrier,
+      0, nullptr,
+      0, nullptr);
+}
 
-  ImGui_ImplVulkan_RenderDrawData(
-      ImGui::GetDrawData(), state.cmd_buffers[i]);
-    
-  vkCmdEndRenderPass(state.cmd_buffers[i]);
-
-  res = vkEndCommandBuffer(state.cmd_buffers[i]);
-  assert(res == VK_SUCCESS);
+// Whether the lines are drawn as tubes instead
+bool tubes_active(AppState& state) {
+  return state.controls.draw_tubes &&
+    state.controls.pipeline_toggles[LINES_PIPELINE] &&
+    state.index_counts[LINES_PIPELINE] > 0;
 }
 
-void setup_sync_objects(AppState& state) {
-  state.img_available_semas.resize(max_frames_in_flight);
-  state.render_done_semas.resize(max_frames_in_flight);
-  state.in_flight_fences.resize(max_frames_in_flight);
-  VkSemaphoreCreateInfo sema_info = {
-    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO
-  };
-  VkFenceCreateInfo fence_info = {
-    .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-    .flags = VK_FENCE_CREATE_SIGNALED_BIT
+// Sizes the segment buffer for the current lines, and points the tube
+// desc set of frame in flight frame for buffer state buf_index at the
+// current buffers
+void prepare_tube_pass(AppState& state, uint32_t frame,
+    uint32_t buf_index) {
+  VkDeviceSize segments_size = sizeof(TubeSegment) *
+    (state.index_counts[LINES_PIPELINE] / 2);
+  if (ensure_gpu_buffer_size(state, state.tube_segment_buffer,
+        state.tube_segment_alloc, state.tube_segment_capacity, segments_size,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+          VK_BUFFER_USAGE_VERTEX_BUFFER_BIT)) {
+    // the draws and desc sets of the other frames use the old buffer
+    invalidate_scene_cmds(state);
+  }
+
+  BufferState& buf_state = state.buffer_states[buf_index];
+  VkDescriptorSet desc_set = state.tube_desc_sets[frame][buf_index];
+  array<VkBufferView*, 2> texel_views = {
+    &buf_state.vert_buffer_views[ATTRIB_POS],
+    &buf_state.vert_buffer_views[ATTRIB_VEL]
   };
-  for (int i = 0; i < max_frames_in_flight; ++i) {
-    VkResult res = vkCreateSemaphore(state.device, &sema_info, nullptr,
-        &state.img_available_semas[i]);
+  array<VkDescriptorBufferInfo, 2> buffer_infos = {{
+    {state.cull_source_buffer, 0, VK_WHOLE_SIZE},
+    {state.tube_segment_buffer, 0, VK_WHOLE_SIZE}
+  }};
+  vector<VkWriteDescriptorSet> writes;
+  for (uint32_t i = 0; i < texel_views.size(); ++i) {
+    VkWriteDescriptorSet write = {
+      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+      .dstSet = desc_set,
+      .dstBinding = i,
+      .dstArrayElement = 0,
+      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER,
+      .descriptorCount = 1,
+      .pTexelBufferView = texel_views[i]
+    };
+    writes.push_back(write);
+  }
+  for (uint32_t i = 0; i < buffer_infos.size(); ++i) {
+    VkWriteDescriptorSet write = {
+      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+      .dstSet = desc_set,
+      .dstBinding = (uint32_t) texel_views.size() + i,
+      .dstArrayElement = 0,
+      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .descriptorCount = 1,
+      .pBufferInfo = &buffer_infos[i]
+    };
+    writes.push_back(write);
+  }
+  vkUpdateDescriptorSets(state.device, (uint32_t) writes.size(),
+      writes.data(), 0, nullptr);
+}
+
+// Records the tube pass of frame in flight frame into cmd_buffer, which
+// writes a segment per line of the rendered buffer state
+void record_tube_pass(AppState& state, VkCommandBuffer cmd_buffer,
+    uint32_t frame) {
+  // the segments are shared by the frames, so the draws of the previous
+  // frame must be done reading them
+  vkCmdPipelineBarrier(cmd_buffer,
+      VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+      0, nullptr,
+      0, nullptr,
+      0, nullptr);
+
+  TubePushConstants push_consts = {
+    .point_index_count = state.index_counts[POINTS_PIPELINE],
+    .line_count = state.index_counts[LINES_PIPELINE] / 2,
+    .radius_mode = (uint32_t) state.controls.tube_radius_mode,
+    .radius = state.controls.tube_radius
+  };
+  vkCmdBindPipeline(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      state.tube_gen_pipeline);
+  vkCmdBindDescriptorSets(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+      state.tube_gen_pipeline_layout, 0, 1,
+      &state.tube_desc_sets[frame][state.result_buffer], 0, nullptr);
+  vkCmdPushConstants(cmd_buffer, state.tube_gen_pipeline_layout,
+      VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(push_consts), &push_consts);
+  vkCmdDispatch(cmd_buffer,
+      div_ceil(push_consts.line_count, TUBE_WORKGROUP_SIZE), 1, 1);
+
+  VkMemoryBarrier tube_barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT
+  };
+  vkCmdPipelineBarrier(cmd_buffer,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0,
+      1, &tube_barrier,
+      0, nullptr,
+      0, nullptr);
+}
+
+// Records the tube draws into cmd_buffer, an instanced draw of the unit
+// tube per simulation instance. The render desc set is already bound.
+void record_tube_draws(AppState& state, VkCommandBuffer cmd_buffer,
+    RenderPushConstants& push_consts) {
+  vkCmdBindPipeline(cmd_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+      state.tube_pipeline);
+  array<VkBuffer, 2> vert_buffers = {
+    state.tube_mesh_buffer, state.tube_segment_buffer
+  };
+  array<VkDeviceSize, 2> byte_offsets = {0, 0};
+  vkCmdBindVertexBuffers(cmd_buffer, 0, vert_buffers.size(),
+      vert_buffers.data(), byte_offsets.data());
+  vkCmdBindIndexBuffer(cmd_buffer, state.tube_mesh_buffer,
+      state.tube_mesh_index_offset, VK_INDEX_TYPE_UINT16);
+
+  // segment i is line i, so the lines of an instance are its segments
+  auto& line_ranges = state.instance_index_ranges[LINES_PIPELINE];
+  for (uint32_t k = 0; k < line_ranges.size(); ++k) {
+    push_consts.model = instance_model_mat(k, line_ranges.size());
+    vkCmdPushConstants(cmd_buffer, state.render_pipeline_layout,
+        VK_SHADER_STAGE_VERTEX_BIT, 0,
+        sizeof(RenderPushConstants), &push_consts);
+    vkCmdDrawIndexed(cmd_buffer, state.tube_mesh_index_count,
+        line_ranges[k].second / 2, 0, 0, line_ranges[k].first / 2);
+  }
+}
+
+// Sets the viewport and scissor to cover extent
+void set_viewport(VkCommandBuffer cmd_buffer, VkExtent2D extent) {
+  VkViewport viewport = {
+    .x = 0.0f,
+    .y = 0.0f,
+    .width = (float) extent.width,
+    .height = (float) extent.height,
+    .minDepth = 0.0f,
+    .maxDepth = 1.0f
+  };
+  VkRect2D scissor_rect = {
+    .offset = {0, 0},
+    .extent = extent
+  };
+  vkCmdSetViewport(cmd_buffer, 0, 1, &viewport);
+  vkCmdSetScissor(cmd_buffer, 0, 1, &scissor_rect);
+}
+
+/*
+   Records the draws of the nodes of buffer state buf_index into
+   cmd_buffer, within a render pass. The camera is read from slot
+   camera_slot of the camera buffer. The points and lines are drawn from
+   the output of the cull pass if cull_target is given, and the lines as
+   tubes if tubes is set.
+*/
+void record_node_draws(AppState& state, VkCommandBuffer cmd_buffer,
+    uint32_t buf_index, uint32_t camera_slot, CullTarget* cull_target,
+    bool tubes) {
+  BufferState& buf_state = state.buffer_states[buf_index];
+  // the model matrix is set per instance
+  RenderPushConstants push_consts(mat4(1.0f), state.render_unifs);
+  uint32_t camera_offset = (uint32_t) (camera_slot * state.camera_slot_size);
+  bool cull = cull_target != nullptr;
+
+  // draw the structure for each active pipeline 
+  for (uint32_t pipeline_index = 0; pipeline_index < PIPELINES_COUNT; ++pipeline_index) {
+    if (!state.controls.pipeline_toggles[pipeline_index] ||
+        state.index_counts[pipeline_index] == 0) {
+      continue;
+    }
+    if (tubes && pipeline_index == LINES_PIPELINE) {
+      // the pipelines share the layout, so the desc set stays bound
+      vkCmdBindDescriptorSets(cmd_buffer,
+          VK_PIPELINE_BIND_POINT_GRAPHICS,
+          state.render_pipeline_layout, 0, 1,
+          &buf_state.render_desc_set, 1, &camera_offset);
+      record_tube_draws(state, cmd_buffer, push_consts);
+      continue;
+    }
+    vkCmdBindPipeline(cmd_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+        state.graphics_pipelines[pipeline_index]);
+    // bind only the attributes basic.vert takes as input
+    vector<VkBuffer> vert_buffers;
+    vector<VkDeviceSize> byte_offsets;
+    for (uint32_t a = 0; a < ATTRIBUTES_COUNT; ++a) {
+      if (RENDER_VERT_ATTRIBS & attrib_bit(a)) {
+        vert_buffers.push_back(state.node_arena);
+        byte_offsets.push_back(buf_state.vert_offsets[a]);
+      }
+    }
+    vert_buffers.push_back(state.node_arena);
+    byte_offsets.push_back(buf_state.nor_offset);
+    vkCmdBindVertexBuffers(cmd_buffer, 0, vert_buffers.size(),
+        vert_buffers.data(), byte_offsets.data());
+    // the points and lines are drawn from the culled indices, with the
+    // counts written by the cull pass
+    bool culled = cull && pipeline_index != TRIANGLES_PIPELINE;
+    if (culled) {
+      vkCmdBindIndexBuffer(cmd_buffer, cull_target->index_buffer, 0,
+          VK_INDEX_TYPE_UINT32);
+    } else {
+      vkCmdBindIndexBuffer(cmd_buffer,
+          state.index_buffers[pipeline_index], 0, state.index_type);
+    }
+    vkCmdBindDescriptorSets(cmd_buffer,
+        VK_PIPELINE_BIND_POINT_GRAPHICS,
+        state.render_pipeline_layout, 0, 1,
+        &buf_state.render_desc_set, 1, &camera_offset);
+
+    // a draw per instance, tiled so that they do not overlap
+    auto& index_ranges = state.instance_index_ranges[pipeline_index];
+    for (uint32_t k = 0; k < index_ranges.size(); ++k) {
+      push_consts.model = instance_model_mat(k, index_ranges.size());
+      vkCmdPushConstants(cmd_buffer, state.render_pipeline_layout,
+          VK_SHADER_STAGE_VERTEX_BIT, 0,
+          sizeof(RenderPushConstants), &push_consts);
+
+      if (culled) {
+        vkCmdDrawIndexedIndirect(cmd_buffer, cull_target->args_buffer,
+            cull_draw_args_offset(state, pipeline_index, k), 1,
+            sizeof(VkDrawIndexedIndirectCommand));
+      } else {
+        vkCmdDrawIndexed(cmd_buffer, index_ranges[k].second,
+            1, index_ranges[k].first, 0, 0);
+      }
+    }
+  }
+}
+
+/*
+   Records the draws of buffer state buf_index into the scene command
+   buffer of frame in flight frame. The camera is read from the frame's
+   slot of the camera buffer, so the draws stay valid as the camera
+   moves. They are executed in whichever swapchain image the frame
+   renders to, so the framebuffer is left out of the inheritance.
+*/
+void record_scene_draws(AppState& state, uint32_t frame,
+    uint32_t buf_index) {
+  VkCommandBuffer cmd_buffer = state.scene_cmd_buffers[frame][buf_index];
+  begin_render_pass_secondary(cmd_buffer, state.render_pass,
+      VK_NULL_HANDLE, 0);
+  // the dynamic state is not inherited from the primary
+  set_viewport(cmd_buffer, state.target_extent);
+  record_node_draws(state, cmd_buffer, buf_index, frame,
+      cull_active(state) ? &state.cull_targets[frame] : nullptr,
+      tubes_active(state));
+
+  VkResult res = vkEndCommandBuffer(cmd_buffer);
+  assert(res == VK_SUCCESS);
+  state.scene_cmd_versions[frame][buf_index] = state.scene_version;
+}
+
+/*
+   Reads the pick copied out by the last frame that used the slot of the
+   current frame in flight, which render_frame has waited for, and finds
+   the texel under the cursor for this frame. Keeps redrawing until a
+   pick at the cursor has been read back.
+*/
+void update_node_pick(AppState& state) {
+  NodePicker& picker = state.picker;
+  size_t slot = state.current_frame;
+  if (picker.slot_texels[slot].x >= 0) {
+    vmaInvalidateAllocation(state.allocator, picker.readback_alloc,
+        slot * sizeof(uint32_t), sizeof(uint32_t));
+    uint32_t id = picker.readback_data[slot];
+    int node = id < state.node_count ? (int) id : -1;
+    if (node != picker.picked_node) {
+      // for the inspector to show it
+      request_redraw(state);
+    }
+    picker.picked_texel = picker.slot_texels[slot];
+    picker.picked_node = node;
+    picker.slot_texels[slot] = ivec2(-1);
+  }
+
+  picker.cursor_texel = ivec2(-1);
+  if (!state.controls.pick_nodes || ImGui::GetIO().WantCaptureMouse) {
+    return;
+  }
+  // the cursor is in window coords, which may be scaled on high-DPI
+  // displays
+  double cursor_x, cursor_y;
+  int win_w, win_h;
+  glfwGetCursorPos(state.win, &cursor_x, &cursor_y);
+  glfwGetWindowSize(state.win, &win_w, &win_h);
+  if (win_w <= 0 || win_h <= 0) {
+    return;
+  }
+  ivec2 texel(
+      (int) floor(cursor_x * state.target_extent.width / win_w),
+      (int) floor(cursor_y * state.target_extent.height / win_h));
+  if (texel.x < 0 || texel.y < 0 ||
+      texel.x >= (int) state.target_extent.width ||
+      texel.y >= (int) state.target_extent.height) {
+    return;
+  }
+  picker.cursor_texel = texel;
+  if (texel != picker.picked_texel) {
+    request_redraw(state);
+  }
+}
+
+// Copies the node id under the cursor to the slot of the current frame
+// in flight, after the scene pass
+void record_node_pick(AppState& state, VkCommandBuffer cmd_buffer) {
+  NodePicker& picker = state.picker;
+  if (picker.cursor_texel.x < 0) {
+    return;
+  }
+  size_t slot = state.current_frame;
+  VkBufferImageCopy region = {
+    .bufferOffset = slot * sizeof(uint32_t),
+    .bufferRowLength = 0,
+    .bufferImageHeight = 0,
+    .imageSubresource = {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .mipLevel = 0,
+      .baseArrayLayer = 0,
+      .layerCount = 1
+    },
+    .imageOffset = {picker.cursor_texel.x, picker.cursor_texel.y, 0},
+    .imageExtent = {1, 1, 1}
+  };
+  vkCmdCopyImageToBuffer(cmd_buffer, state.id_img,
+      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, picker.readback_buffer,
+      1, &region);
+  VkMemoryBarrier host_barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_HOST_READ_BIT
+  };
+  vkCmdPipelineBarrier(cmd_buffer,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+      1, &host_barrier,
+      0, nullptr,
+      0, nullptr);
+  picker.slot_texels[slot] = picker.cursor_texel;
+}
+
+/*
+   Reads the node copied out by the last frame that used the slot of the
+   current frame in flight, which render_frame has waited for.
+*/
+void update_node_inspect(AppState& state) {
+  NodeInspector& inspector = state.inspector;
+  size_t slot = state.current_frame;
+  NodeInspectorRead& read = inspector.slot_reads[slot];
+  if (read.node_index < 0) {
+    return;
+  }
+  vmaInvalidateAllocation(state.allocator, inspector.readback_alloc,
+      slot * NODE_INSPECTOR_SLOT_SIZE, NODE_INSPECTOR_SLOT_SIZE);
+  const char* slot_data =
+    inspector.readback_data + slot * NODE_INSPECTOR_SLOT_SIZE;
+  MorphNodes node_vecs(1);
+  for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+    node_vecs.unpack_attrib(i, read.compact, slot_data + sizeof(vec4) * i);
+  }
+  inspector.shown_node = read.node_index;
+  inspector.node = node_vecs.node_at(0);
+  inspector.instance_index = read.instance_index;
+  inspector.has_queue = read.has_queue;
+  if (read.has_queue) {
+    memcpy(&inspector.queue, slot_data + sizeof(vec4) * ATTRIBUTES_COUNT,
+        sizeof(QueuePtrs));
+  }
+  read = NodeInspectorRead();
+  // for the inspector to show it
+  request_redraw(state);
+}
+
+/*
+   Copies the inspected node's attributes out of the published buffer
+   state to the slot of the current frame in flight, if the node or what
+   it's read from changed since the last copy. The queue of its instance
+   is copied too, unless the simulation is writing it.
+*/
+void record_node_inspect(AppState& state, VkCommandBuffer cmd_buffer) {
+  NodeInspector& inspector = state.inspector;
+  int node_index = inspector.node_index;
+  if (node_index < 0 || node_index >= (int) state.node_count ||
+      (node_index == inspector.copied_node &&
+        state.result_buffer == inspector.copied_buf_index &&
+        state.scene_version == inspector.copied_scene_version)) {
+    return;
+  }
+  size_t slot = state.current_frame;
+  VkDeviceSize slot_offset = slot * NODE_INSPECTOR_SLOT_SIZE;
+  NodeInspectorRead read;
+  read.node_index = node_index;
+  read.instance_index = instance_of_node(state, node_index);
+  read.compact = state.compact_nodes;
+  read.has_queue = !state.sim_job.in_flight;
+
+  BufferState& buf_state = state.buffer_states[state.result_buffer];
+  vector<VkBufferCopy> regions;
+  for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+    VkDeviceSize stride = node_attrib_stride(state.compact_nodes, i);
+    regions.push_back({
+      .srcOffset = buf_state.vert_offsets[i] + stride * node_index,
+      .dstOffset = slot_offset + sizeof(vec4) * i,
+      .size = stride
+    });
+  }
+  vkCmdCopyBuffer(cmd_buffer, state.node_arena, inspector.readback_buffer,
+      (uint32_t) regions.size(), regions.data());
+  if (read.has_queue) {
+    VkBufferCopy queue_region = {
+      .srcOffset = offsetof(ComputeStorage, queues) +
+        sizeof(QueuePtrs) * read.instance_index,
+      .dstOffset = slot_offset + sizeof(vec4) * ATTRIBUTES_COUNT,
+      .size = sizeof(QueuePtrs)
+    };
+    vkCmdCopyBuffer(cmd_buffer, state.compute_storage_buffer,
+        inspector.readback_buffer, 1, &queue_region);
+    // the serial this frame is submitted as
+    inspector.queue_read_frame = state.frame_serial + 1;
+  }
+  VkMemoryBarrier host_barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_HOST_READ_BIT
+  };
+  vkCmdPipelineBarrier(cmd_buffer,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+      1, &host_barrier,
+      0, nullptr,
+      0, nullptr);
+  inspector.slot_reads[slot] = read;
+  inspector.copied_node = node_index;
+  inspector.copied_buf_index = state.result_buffer;
+  inspector.copied_scene_version = state.scene_version;
+}
+
+/*
+   Records the frame for swapchain image img_index, whose last frame
+   render_frame has waited for, into the image's command buffers. The
+   camera, cull and tube state and the scene draws are those of the
+   current frame in flight. The primary command buffer only runs the
+   scene pass over the scene draws, which are re-recorded if stale, and
+   the UI pass over the ImGui draws, which change every frame. The node id under the cursor and the inspected
+   node are copied out in between.
+*/
+void record_render_pass(AppState& state, uint32_t img_index) {
+  uint32_t i = img_index;
+  uint32_t frame = (uint32_t) state.current_frame;
+  update_node_pick(state);
+  update_node_inspect(state);
+
+  // update the camera slot of this frame
+  Camera& cam = state.cam;
+  float aspect_ratio = state.target_extent.width / (float) state.target_extent.height;
+  CameraUniforms camera_unifs;
+  camera_unifs.view = glm::lookAt(cam.pos(), cam.pos() + cam.forward(), cam.up());
+  camera_unifs.proj = glm::perspective((float) M_PI / 4.0f, aspect_ratio, 0.1f, 10000.0f);
+  // invert Y b/c vulkan's y-axis is inverted wrt OpenGL
+	camera_unifs.proj[1][1] *= -1;
+  memcpy(state.camera_buffer_data + frame * state.camera_slot_size,
+      &camera_unifs, sizeof(camera_unifs));
+  // the mapping need not be host coherent
+  vmaFlushAllocation(state.allocator, state.camera_buffer_alloc,
+      frame * state.camera_slot_size, sizeof(camera_unifs));
+
+  uint32_t buf_index = state.result_buffer;
+  bool cull = cull_active(state);
+  bool tubes = tubes_active(state);
+  if (state.scene_cmd_versions[frame][buf_index] != state.scene_version) {
+    if (cull) {
+      prepare_cull_target(state, frame, buf_index);
+    }
+    if (tubes) {
+      prepare_tube_pass(state, frame, buf_index);
+    }
+    record_scene_draws(state, frame, buf_index);
+  }
+
+  VkCommandBuffer imgui_cmd_buffer = state.imgui_cmd_buffers[i];
+  begin_render_pass_secondary(imgui_cmd_buffer, state.ui_render_pass,
+      state.ui_framebuffers[i], VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+  ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), imgui_cmd_buffer);
+  VkResult res = vkEndCommandBuffer(imgui_cmd_buffer);
+  assert(res == VK_SUCCESS);
+
+  // moves the command buffer back to the initial state so that we
+  // may record again
+  res = vkResetCommandBuffer(state.cmd_buffers[i],
+      VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT);
+  assert(res == VK_SUCCESS);
+
+  VkCommandBufferBeginInfo begin_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    .pInheritanceInfo = nullptr
+  };
+  res = vkBeginCommandBuffer(state.cmd_buffers[i], &begin_info);
+  assert(res == VK_SUCCESS);
+
+  // the cull pass runs every frame since it depends on the camera
+  if (cull) {
+    record_cull_pass(state, state.cmd_buffers[i], frame, camera_unifs);
+  }
+  if (tubes) {
+    record_tube_pass(state, state.cmd_buffers[i], frame);
+  }
+
+  array<VkClearValue, 3> clear_values = {};
+  clear_values[0].color = {1.0f, 1.0f, 1.0f, 1.0f};
+  clear_values[1].depthStencil = {1.0f, 0};
+  clear_values[2].color.uint32[0] = NO_NODE_ID;
+
+  VkRenderPassBeginInfo render_pass_info = {
+    .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+    .renderPass = state.render_pass,
+    .framebuffer = state.swapchain_framebuffers[i],
+    .renderArea.offset = {0, 0},
+    .renderArea.extent = state.target_extent,
+    .clearValueCount = (uint32_t) clear_values.size(),
+    .pClearValues = clear_values.data()
+  };
+  vkCmdBeginRenderPass(state.cmd_buffers[i], &render_pass_info,
+        VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+  vkCmdExecuteCommands(state.cmd_buffers[i], 1,
+      &state.scene_cmd_buffers[frame][buf_index]);
+  vkCmdEndRenderPass(state.cmd_buffers[i]);
+
+  record_node_pick(state, state.cmd_buffers[i]);
+  record_node_inspect(state, state.cmd_buffers[i]);
+
+  VkRenderPassBeginInfo ui_pass_info = {
+    .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+    .renderPass = state.ui_render_pass,
+    .framebuffer = state.ui_framebuffers[i],
+    .renderArea.offset = {0, 0},
+    .renderArea.extent = state.target_extent,
+    .clearValueCount = 0,
+    .pClearValues = nullptr
+  };
+  vkCmdBeginRenderPass(state.cmd_buffers[i], &ui_pass_info,
+        VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+  vkCmdExecuteCommands(state.cmd_buffers[i], 1, &imgui_cmd_buffer);
+  vkCmdEndRenderPass(state.cmd_buffers[i]);
+
+  res = vkEndCommandBuffer(state.cmd_buffers[i]);
+  assert(res == VK_SUCCESS);
+}
+
+void setup_sync_objects(AppState& state) {
+  state.img_available_semas.resize(max_frames_in_flight);
+  state.render_done_semas.resize(max_frames_in_flight);
+  state.in_flight_fences.resize(max_frames_in_flight);
+  state.in_flight_serials.assign(max_frames_in_flight, 0);
+  VkSemaphoreCreateInfo sema_info = {
+    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO
+  };
+  VkFenceCreateInfo fence_info = {
+    .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+    .flags = VK_FENCE_CREATE_SIGNALED_BIT
+  };
+  for (int i = 0; i < max_frames_in_flight; ++i) {
+    VkResult res = vkCreateSemaphore(state.device, &sema_info, nullptr,
+        &state.img_available_semas[i]);
     assert(res == VK_SUCCESS);
     res = vkCreateSemaphore(state.device, &sema_info, nullptr,
         &state.render_done_semas[i]);
@@ -1607,25 +3341,72 @@ void setup_sync_objects(AppState& state) {
         &state.in_flight_fences[i]);
     assert(res == VK_SUCCESS);
   }
+
+  VkResult res = vkCreateFence(state.device, &fence_info, nullptr,
+      &state.sim_fence);
+  assert(res == VK_SUCCESS);
+  if (state.has_async_compute) {
+    VkSemaphoreTypeCreateInfoKHR type_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR,
+      .pNext = nullptr,
+      .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR,
+      .initialValue = 0
+    };
+    VkSemaphoreCreateInfo timeline_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+      .pNext = &type_info
+    };
+    res = vkCreateSemaphore(state.device, &timeline_info, nullptr,
+        &state.sim_sema);
+    assert(res == VK_SUCCESS);
+  }
+}
+
+void cleanup_buffer_states(AppState& state) {
+  for (BufferState& buf_state : state.buffer_states) {
+    for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+      vkDestroyBufferView(state.device,
+          buf_state.vert_buffer_views[i], nullptr);
+    }
+    vkDestroyBufferView(state.device, buf_state.nor_buffer_view, nullptr);
+    vector<VkDescriptorSet> desc_sets = {buf_state.render_desc_set};
+    for (VkDescriptorSet desc_set : buf_state.compute_desc_sets) {
+      if (desc_set != VK_NULL_HANDLE) {
+        desc_sets.push_back(desc_set);
+      }
+    }
+    vkFreeDescriptorSets(state.device, state.desc_pool,
+        (uint32_t) desc_sets.size(), desc_sets.data());
+  }
+  vmaDestroyBuffer(state.allocator, state.node_arena,
+      state.node_arena_alloc);
 }
 
 void cleanup_swapchain(AppState& state) {
   vkDestroyImageView(state.device, state.depth_img_view, nullptr);
   vmaDestroyImage(state.allocator, state.depth_img,
       state.depth_img_alloc);
+  vkDestroyImageView(state.device, state.id_img_view, nullptr);
+  vmaDestroyImage(state.allocator, state.id_img, state.id_img_alloc);
 
   for (VkFramebuffer& fb : state.swapchain_framebuffers) {
     vkDestroyFramebuffer(state.device, fb, nullptr);
   }
+  for (VkFramebuffer& fb : state.ui_framebuffers) {
+    vkDestroyFramebuffer(state.device, fb, nullptr);
+  }
   vkFreeCommandBuffers(state.device, state.cmd_pool,
       (uint32_t) state.cmd_buffers.size(), state.cmd_buffers.data());
-
-  for (VkPipeline& pipeline : state.graphics_pipelines) {
-    vkDestroyPipeline(state.device, pipeline, nullptr);
+  vkFreeCommandBuffers(state.device, state.cmd_pool,
+      (uint32_t) state.imgui_cmd_buffers.size(),
+      state.imgui_cmd_buffers.data());
+  for (auto& scene_cmds : state.scene_cmd_buffers) {
+    vkFreeCommandBuffers(state.device, state.cmd_pool,
+        (uint32_t) scene_cmds.size(), scene_cmds.data());
   }
-  vkDestroyPipelineLayout(state.device, state.render_pipeline_layout, nullptr);
+  cleanup_cull_targets(state);
+  cleanup_tube_desc_sets(state);
 
-  vkDestroyRenderPass(state.device, state.render_pass, nullptr);
   for (VkImageView& img_view : state.swapchain_img_views) {
     vkDestroyImageView(state.device, img_view, nullptr);
   }
@@ -1635,19 +3416,40 @@ void cleanup_swapchain(AppState& state) {
   //vkDestroySwapchainKHR(state.device, state.swapchain, nullptr);
 }
 
-void cleanup_vulkan(AppState& state) {
-  cleanup_swapchain(state);
+void cleanup_graphics_pipelines(AppState& state) {
+  for (VkPipeline& pipeline : state.graphics_pipelines) {
+    vkDestroyPipeline(state.device, pipeline, nullptr);
+  }
+  vkDestroyPipeline(state.device, state.tube_pipeline, nullptr);
+  vkDestroyPipelineLayout(state.device, state.render_pipeline_layout, nullptr);
+}
 
-  // cleanup the buffer states
-  for (BufferState& buf_state : state.buffer_states) {
-    for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
-      vkDestroyBufferView(state.device,
-          buf_state.vert_buffer_views[i], nullptr);
-      vmaDestroyBuffer(state.allocator, buf_state.vert_buffers[i],
-          buf_state.vert_buffer_allocs[i]);
+void cleanup_vulkan(AppState& state) {
+  if (!state.headless) {
+    cleanup_swapchain(state);
+    cleanup_graphics_pipelines(state);
+    cleanup_cull_pipeline(state);
+    cleanup_tube_gen_pipeline(state);
+    if (state.cull_source_buffer != VK_NULL_HANDLE) {
+      vmaDestroyBuffer(state.allocator, state.cull_source_buffer,
+          state.cull_source_alloc);
+    }
+    if (state.tube_segment_buffer != VK_NULL_HANDLE) {
+      vmaDestroyBuffer(state.allocator, state.tube_segment_buffer,
+          state.tube_segment_alloc);
     }
+    vmaDestroyBuffer(state.allocator, state.tube_mesh_buffer,
+        state.tube_mesh_alloc);
+    cleanup_node_picker(state);
+    cleanup_node_inspector(state);
+    cleanup_renderpass(state);
+  } else {
+    cleanup_offscreen_rendering(state);
   }
+
+  cleanup_buffer_states(state);
   vkDestroyPipeline(state.device, state.compute_pipeline, nullptr);
+  vkDestroyPipeline(state.device, state.normals_pipeline, nullptr);
   vkDestroyPipelineLayout(state.device, state.compute_pipeline_layout, nullptr);
 
   vkDestroyDescriptorPool(state.device, state.desc_pool, nullptr);
@@ -1656,50 +3458,102 @@ void cleanup_vulkan(AppState& state) {
       state.render_desc_set_layout, nullptr);
   vkDestroyDescriptorSetLayout(state.device,
       state.compute_desc_set_layout, nullptr);
+  vkDestroyDescriptorSetLayout(state.device,
+      state.cull_desc_set_layout, nullptr);
+  vkDestroyDescriptorSetLayout(state.device,
+      state.tube_desc_set_layout, nullptr);
 
   for (uint32_t i = 0; i < PIPELINES_COUNT; ++i) {
-    vmaDestroyBuffer(state.allocator, state.index_buffers[i],
-        state.index_buffer_allocs[i]);
+    if (state.index_buffers[i] != VK_NULL_HANDLE) {
+      vmaDestroyBuffer(state.allocator, state.index_buffers[i],
+          state.index_buffer_allocs[i]);
+    }
   }
+  vmaDestroyPool(state.allocator, state.index_pool);
   vmaDestroyBuffer(state.allocator, state.compute_storage_buffer,
       state.compute_storage_buffer_alloc);
+  vmaDestroyBuffer(state.allocator, state.instance_buffer,
+      state.instance_buffer_alloc);
+  state.traj_writer.close();
+  state.traj_reader.close();
+  vmaUnmapMemory(state.allocator, state.traj_ring_alloc);
+  vmaDestroyBuffer(state.allocator, state.traj_ring, state.traj_ring_alloc);
+  vmaUnmapMemory(state.allocator, state.camera_buffer_alloc);
+  vmaDestroyBuffer(state.allocator, state.camera_buffer,
+      state.camera_buffer_alloc);
 
   for (int i = 0; i < max_frames_in_flight; ++i) {
     vkDestroySemaphore(state.device, state.render_done_semas[i], nullptr);
     vkDestroySemaphore(state.device, state.img_available_semas[i], nullptr);
     vkDestroyFence(state.device, state.in_flight_fences[i], nullptr);
   }
+  vkDestroyFence(state.device, state.sim_fence, nullptr);
+  if (state.has_async_compute) {
+    vkDestroySemaphore(state.device, state.sim_sema, nullptr);
+  }
   vkDestroyCommandPool(state.device, state.cmd_pool, nullptr);
+  vkDestroyCommandPool(state.device, state.compute_cmd_pool, nullptr);
 
   vmaDestroyAllocator(state.allocator);
   vkDestroyDevice(state.device, nullptr);
 
   state.destroy_debug_utils(state.inst, state.debug_messenger, nullptr);
 
-  vkDestroySurfaceKHR(state.inst, state.surface, nullptr);
+  if (!state.headless) {
+    vkDestroySurfaceKHR(state.inst, state.surface, nullptr);
+  }
   vkDestroyInstance(state.inst, nullptr);
 }
 
 void reload_programs(AppState& state) {
   vkDeviceWaitIdle(state.device);
+  // the animation reruns the simulation with the new programs
+  state.last_sim_inputs.clear();
+  invalidate_scene_cmds(state);
 
   // recreate graphics and compute pipelines
 
-  for (VkPipeline& pipeline : state.graphics_pipelines) {
-    vkDestroyPipeline(state.device, pipeline, nullptr);
+  if (!state.headless || state.offscreen.has_pipelines) {
+    cleanup_graphics_pipelines(state);
+    setup_graphics_pipelines(state);
+  }
+  if (!state.headless) {
+    cleanup_cull_pipeline(state);
+    setup_cull_pipeline(state);
+    cleanup_tube_gen_pipeline(state);
+    setup_tube_gen_pipeline(state);
   }
-  vkDestroyPipelineLayout(state.device,
-      state.render_pipeline_layout, nullptr);
-  setup_graphics_pipelines(state);
 
   vkDestroyPipeline(state.device, state.compute_pipeline, nullptr);
+  vkDestroyPipeline(state.device, state.normals_pipeline, nullptr);
   vkDestroyPipelineLayout(state.device,
       state.compute_pipeline_layout, nullptr);
   setup_compute_pipeline(state);
 }
 
-void recreate_swapchain(AppState& state) {
-  // if the window is minimized, wait until it comes to the foreground
+// Switches the node buffers between the full and compact formats,
+// converting the current nodes. The shaders are recompiled for the
+// new format.
+void set_node_format(AppState& state, bool compact) {
+  if (compact == state.compact_nodes) {
+    return;
+  }
+  finish_simulation(state);
+  vkDeviceWaitIdle(state.device);
+  MorphNodes node_vecs = read_nodes_from_buffers(state, state.result_buffer);
+
+  cleanup_buffer_states(state);
+  state.compact_nodes = compact;
+  setup_vertex_attr_desc(state);
+  setup_buffer_states(state);
+  // the normals pass must be compiled for the new format before the
+  // nodes are written
+  reload_programs(state);
+  write_nodes_to_buffers(state, node_vecs);
+}
+
+void recreate_swapchain(AppState& state) {
+  // if the window is minimized, wait until it comes to the foreground
   // again
   int fb_w = 0;
   int fb_h = 0;
@@ -1711,13 +3565,24 @@ void recreate_swapchain(AppState& state) {
   vkDeviceWaitIdle(state.device);
   cleanup_swapchain(state);
 
+  VkFormat old_format = state.target_format.format;
   setup_swapchain(state);
-  setup_renderpass(state);
-  setup_graphics_pipelines(state);
+  // the viewport and scissor are dynamic, so the render pass and the
+  // pipelines only depend on the image format
+  if (state.target_format.format != old_format) {
+    cleanup_graphics_pipelines(state);
+    cleanup_renderpass(state);
+    setup_renderpass(state);
+    setup_graphics_pipelines(state);
+  }
   setup_depth_resources(state);
+  setup_node_id_resources(state);
   setup_framebuffers(state);
   setup_command_buffers(state);
+  setup_cull_targets(state);
+  setup_tube_desc_sets(state);
   ImGui_ImplVulkan_SetMinImageCount(state.surface_caps.minImageCount);
+  request_redraw(state);
 }
 
 void init_vulkan(AppState& state) {
@@ -1728,9 +3593,11 @@ void init_vulkan(AppState& state) {
   setup_surface(state); 
   setup_physical_device(state);
   setup_logical_device(state);
+  load_cached_workgroup_size(state);
   setup_swapchain(state);
   setup_command_pool(state);
   setup_depth_resources(state);
+  setup_node_id_resources(state);
   setup_index_buffers(state);
 
   setup_desc_set_layouts(state);
@@ -1739,12 +3606,51 @@ void init_vulkan(AppState& state) {
   setup_framebuffers(state);
   setup_graphics_pipelines(state);
   setup_compute_pipeline(state);
+  setup_cull_pipeline(state);
+  setup_tube_gen_pipeline(state);
 
   setup_descriptor_pool(state);
   setup_compute_storage_buffer(state);
+  setup_sim_instance_buffer(state);
+  setup_trajectory_ring(state);
+  setup_camera_buffer(state);
+  setup_tube_mesh(state);
   setup_buffer_states(state);
 
   setup_command_buffers(state);
+  setup_cull_targets(state);
+  setup_tube_desc_sets(state);
+  setup_node_picker(state);
+  setup_node_inspector(state);
+  setup_sync_objects(state);
+}
+
+// Sets up only what the simulation needs, without a window or swapchain.
+// The simulation runs on physical device device_index (mod the device
+// count).
+void init_vulkan_headless(AppState& state, uint32_t device_index) {
+  state.headless = true;
+  state.device_index = device_index;
+
+  setup_vertex_attr_desc(state);
+  setup_instance(state);
+  setup_debug_callback(state);
+  setup_physical_device(state);
+  setup_logical_device(state);
+  load_cached_workgroup_size(state);
+  setup_command_pool(state);
+  setup_index_buffers(state);
+
+  setup_desc_set_layouts(state);
+  setup_compute_pipeline(state);
+
+  setup_descriptor_pool(state);
+  setup_compute_storage_buffer(state);
+  setup_sim_instance_buffer(state);
+  setup_trajectory_ring(state);
+  setup_camera_buffer(state);
+  setup_buffer_states(state);
+
   setup_sync_objects(state);
 }
 
@@ -1764,27 +3670,65 @@ void render_frame(AppState& state) {
     recreate_swapchain(state);
     return;
   } 
+  // the image may have been acquired out of order, so its last frame
+  // can be in flight under another fence
+  wait_for_frames(state, state.image_serials[img_index]);
     
   record_render_pass(state, img_index);
 
   // submit cmd buffer to pipeline
+  vector<VkSemaphore> wait_semas = {
+    state.img_available_semas[current_frame]
+  };
   vector<VkPipelineStageFlags> wait_stages = {
     VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
   };
+  vector<VkSemaphore> signal_semas = {
+    state.render_done_semas[current_frame]
+  };
+  // the values are ignored for the binary semaphores
+  vector<uint64_t> wait_values = {0};
+  vector<uint64_t> signal_values = {0};
+  if (state.has_async_compute) {
+    // wait for the chunk that produced the published state, it has
+    // already finished but this makes its writes visible to this queue.
+    // The cull and tube passes read the nodes in compute shaders, in
+    // this submit, so they are covered too, as is the inspector's copy.
+    wait_semas.push_back(state.sim_sema);
+    wait_stages.push_back(VK_PIPELINE_STAGE_TRANSFER_BIT |
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+        VK_PIPELINE_STAGE_VERTEX_INPUT_BIT |
+        VK_PIPELINE_STAGE_VERTEX_SHADER_BIT);
+    wait_values.push_back(state.published_sim_value);
+  }
+  VkTimelineSemaphoreSubmitInfoKHR timeline_info = {
+    .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR,
+    .pNext = nullptr,
+    .waitSemaphoreValueCount = (uint32_t) wait_values.size(),
+    .pWaitSemaphoreValues = wait_values.data(),
+    .signalSemaphoreValueCount = (uint32_t) signal_values.size(),
+    .pSignalSemaphoreValues = signal_values.data()
+  };
   VkSubmitInfo submit_info = {
     .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-    .waitSemaphoreCount = 1,
-    .pWaitSemaphores = &state.img_available_semas[current_frame],
+    .pNext = state.has_async_compute ? &timeline_info : nullptr,
+    .waitSemaphoreCount = (uint32_t) wait_semas.size(),
+    .pWaitSemaphores = wait_semas.data(),
     .pWaitDstStageMask = wait_stages.data(),
     .commandBufferCount = 1,
     .pCommandBuffers = &state.cmd_buffers[img_index],
-    .signalSemaphoreCount = 1,
-    .pSignalSemaphores = &state.render_done_semas[current_frame]
+    .signalSemaphoreCount = (uint32_t) signal_semas.size(),
+    .pSignalSemaphores = signal_semas.data()
   };
   vkResetFences(state.device, 1, &state.in_flight_fences[current_frame]);
   res = vkQueueSubmit(state.queue, 1, &submit_info,
       state.in_flight_fences[current_frame]);
   assert(res == VK_SUCCESS);
+  state.frame_serial += 1;
+  state.in_flight_serials[current_frame] = state.frame_serial;
+  state.image_serials[img_index] = state.frame_serial;
+  state.buffer_states[state.result_buffer].last_read_frame =
+    state.frame_serial;
 
   // present result when done
   VkPresentInfoKHR present_info = {
@@ -1968,12 +3912,51 @@ vector<uint32_t> gen_point_indices(AppState& state, MorphNodes& node_vecs) {
   return indices;
 }
 
+// Returns the index of the instance whose range holds the node
+uint32_t instance_of_node(AppState& state, uint32_t node_index) {
+  // the instances are ordered by node_offset
+  for (uint32_t i = 1; i < state.instances.size(); ++i) {
+    if (node_index < state.instances[i].node_offset) {
+      return i - 1;
+    }
+  }
+  return state.instances.size() - 1;
+}
+
+// Reorders the primitives so that those of each instance are contiguous,
+// and returns the (first index, index count) of each instance
+vector<pair<uint32_t, uint32_t>> group_indices_by_instance(AppState& state,
+    vector<uint32_t>& indices, uint32_t prim_size) {
+  vector<vector<uint32_t>> instance_indices(state.instances.size());
+  for (uint32_t i = 0; i + prim_size <= indices.size(); i += prim_size) {
+    vector<uint32_t>& dst = instance_indices[
+      instance_of_node(state, indices[i])];
+    dst.insert(dst.end(), indices.begin() + i,
+        indices.begin() + i + prim_size);
+  }
+
+  vector<pair<uint32_t, uint32_t>> ranges;
+  indices.clear();
+  for (vector<uint32_t>& src : instance_indices) {
+    ranges.push_back({(uint32_t) indices.size(), (uint32_t) src.size()});
+    indices.insert(indices.end(), src.begin(), src.end());
+  }
+  return ranges;
+}
+
 void update_indices(AppState& state, MorphNodes& node_vecs) {
+  invalidate_scene_cmds(state);
   array<vector<uint32_t>, PIPELINES_COUNT> pipeline_indices = {
     gen_point_indices(state, node_vecs),
     gen_line_indices(state, node_vecs),
     gen_triangle_indices(state, node_vecs)
   };
+  // the number of indices per primitive of each pipeline
+  array<uint32_t, PIPELINES_COUNT> prim_sizes = {1, 2, 3};
+  for (uint32_t i = 0; i < PIPELINES_COUNT; ++i) {
+    state.instance_index_ranges[i] = group_indices_by_instance(
+        state, pipeline_indices[i], prim_sizes[i]);
+  }
 
   // debug logging
   vector<tuple<const char*, bool, int>> log_toggles = {
@@ -1997,216 +3980,1834 @@ void update_indices(AppState& state, MorphNodes& node_vecs) {
     printf("\n");
   }
 
-  // copy the indices to their respective buffers
+  // copy the indices to their respective buffers, as 16-bit indices
+  // when every node index fits
+  bool use_16_bit = state.node_count < 65536;
+  state.index_type = use_16_bit ?
+    VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
   for (uint32_t i = 0; i < PIPELINES_COUNT; ++i) {
     vector<uint32_t>& indices = pipeline_indices[i];
+    state.index_counts[i] = indices.size();
     if (indices.size() == 0) {
       continue;
     }
-    assert(indices.size() < MAX_NUM_INDICES);
-    state.index_counts[i] = indices.size();
-    VkDeviceSize buffer_size = sizeof(indices[0]) * indices.size();
+    vector<uint16_t> short_indices;
+    void* index_data = indices.data();
+    VkDeviceSize buffer_size = sizeof(uint32_t) * indices.size();
+    if (use_16_bit) {
+      short_indices.assign(indices.begin(), indices.end());
+      index_data = short_indices.data();
+      buffer_size = sizeof(uint16_t) * indices.size();
+    }
+    ensure_index_buffer_size(state, i, buffer_size);
 
     StagingBuf staging(state, buffer_size);
-    copy_data_to_buffer(state, staging, indices.data(),
+    copy_data_to_buffer(state, staging, index_data,
         buffer_size, state.index_buffers[i]);
     staging.cleanup(state);
   }
+
+  // the cull pass reads the point and line indices from one list
+  vector<uint32_t>& cull_indices = pipeline_indices[POINTS_PIPELINE];
+  cull_indices.insert(cull_indices.end(),
+      pipeline_indices[LINES_PIPELINE].begin(),
+      pipeline_indices[LINES_PIPELINE].end());
+  if (!state.headless && !cull_indices.empty()) {
+    VkDeviceSize buffer_size = sizeof(uint32_t) * cull_indices.size();
+    ensure_gpu_buffer_size(state, state.cull_source_buffer,
+        state.cull_source_alloc, state.cull_source_capacity, buffer_size,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+          VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    StagingBuf staging(state, buffer_size);
+    copy_data_to_buffer(state, staging, cull_indices.data(),
+        buffer_size, state.cull_source_buffer);
+    staging.cleanup(state);
+  }
 }
 
 // TODO - make a way to only log what is actually used
-void log_compute_storage(ComputeStorage& cs) {
+void log_compute_storage(ComputeStorage& cs, uint32_t num_queues,
+    uint32_t q_len) {
   printf(
       "ctr0 %4d, ctr1 %4d\n"
-      "start0 %4d, end0 %4d\n"
-      "start1 %4d, end1 %4d\n",
+      "work len %4d, iter0 %4d, iter1 %4d, groups %4d\n",
       cs.step_counters[0], cs.step_counters[1],
-      cs.start_ptrs[0], cs.end_ptrs[0],
-      cs.start_ptrs[1], cs.end_ptrs[1]);
-  printf("queue mem:\n");
-  uint32_t q_len = cs.queue_mem.size();
-  for (uint32_t i = 0; i < cs.queue_mem.size(); ++i) {
-    printf("(%2s %2s %2s %2s) %4d: %4d\n",
-        cs.start_ptrs[0] % q_len == i ? "s0" : "",
-        cs.end_ptrs[0] % q_len == i ? "e0" : "",
-        cs.start_ptrs[1] % q_len == i ? "s1" : "",
-        cs.end_ptrs[1] % q_len == i ? "e1" : "",
-        i, cs.queue_mem[i]);
+      cs.work_len, cs.work_iter_lens[0], cs.work_iter_lens[1],
+      cs.dispatch_args[0]);
+  for (uint32_t q = 0; q < num_queues; ++q) {
+    QueuePtrs& ptrs = cs.queues[q];
+    printf(
+        "queue %u:\n"
+        "start0 %4d, end0 %4d\n"
+        "start1 %4d, end1 %4d\n",
+        q,
+        ptrs.start_ptrs[0], ptrs.end_ptrs[0],
+        ptrs.start_ptrs[1], ptrs.end_ptrs[1]);
+    printf("queue mem:\n");
+    for (uint32_t i = 0; i < q_len; ++i) {
+      printf("(%2s %2s %2s %2s) %4d: %4d\n",
+          ptrs.start_ptrs[0] % q_len == i ? "s0" : "",
+          ptrs.end_ptrs[0] % q_len == i ? "e0" : "",
+          ptrs.start_ptrs[1] % q_len == i ? "s1" : "",
+          ptrs.end_ptrs[1] % q_len == i ? "e1" : "",
+          i, cs.queue_mem[q * q_len + i]);
+    }
+  }
+}
+
+void write_to_compute_storage(AppState& state,
+    ComputeStorage& compute_storage) {
+  // the inspector may still be copying a queue out of it
+  wait_for_frames(state, state.inspector.queue_read_frame);
+  StagingBuf staging(state, sizeof(ComputeStorage));
+  copy_data_to_buffer(state, staging, &compute_storage,
+      sizeof(compute_storage), state.compute_storage_buffer);
+  staging.cleanup(state);
+}
+
+ComputeStorage read_from_compute_storage(AppState& state) {
+  ComputeStorage compute_storage;
+  StagingBuf staging(state, sizeof(compute_storage));
+  copy_data_from_buffer(state, staging, &compute_storage,
+      sizeof(compute_storage), state.compute_storage_buffer);
+  staging.cleanup(state);
+  return compute_storage;
+}
+
+void setup_test_queue(ComputeStorage& cs) {
+  cs.queue_mem = {1, 2, 3};
+  cs.queues[0].start_ptrs = {0, 0};
+  cs.queues[0].end_ptrs = {3, 3};
+}
+
+// Fills the queue of instance queue_index, whose region of queue_mem
+// is q_len cells long
+void setup_queue_mem(ComputeStorage& cs, uint32_t queue_index,
+    uint32_t q_len, vector<uint32_t>& queue_values) {
+  assert(queue_values.size() <= q_len);
+  assert((queue_index + 1) * q_len <= cs.queue_mem.size());
+  auto region = cs.queue_mem.begin() + queue_index * q_len;
+  std::fill(region, region + q_len, 0);
+  std::copy(queue_values.begin(), queue_values.end(), region);
+  cs.queues[queue_index].start_ptrs = {0, 0};
+  uint32_t end_ptr = queue_values.size();
+  cs.queues[queue_index].end_ptrs = {end_ptr, end_ptr};
+}
+
+/*
+   Fills the worklist with every node that must be stepped: the active
+   nodes, and the inactive nodes that were sent a splice message.
+   The dispatch args are sized for the given workgroup size.
+*/
+void setup_worklist(ComputeStorage& cs, MorphNodes& node_vecs,
+    uint32_t workgroup_size) {
+  uint32_t work_len = 0;
+  for (uint32_t i = 0; i < node_vecs.pos_vec.size(); ++i) {
+    if (node_vecs.neighbors_vec[i][0] != -2.0 ||
+        node_vecs.top_data_vec[i][0] != -2.0) {
+      cs.work_list[work_len] = i;
+      work_len += 1;
+    }
+  }
+  cs.work_len = work_len;
+  cs.work_iter_lens = {work_len, work_len};
+  cs.dispatch_args = {div_ceil(work_len, workgroup_size), 1, 1};
+}
+
+// Blocks until the frames up to and including frame_serial are done
+void wait_for_frames(AppState& state, uint64_t frame_serial) {
+  for (uint32_t i = 0; i < state.in_flight_fences.size(); ++i) {
+    uint64_t serial = state.in_flight_serials[i];
+    if (serial > 0 && serial <= frame_serial) {
+      vkWaitForFences(state.device, 1, &state.in_flight_fences[i],
+          VK_TRUE, std::numeric_limits<uint64_t>::max());
+    }
+  }
+}
+
+// Picks the two buffer states other than the published one for the
+// next simulation, and waits for the frames that still read them
+void select_sim_buffers(AppState& state) {
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < state.buffer_states.size() && n < 2; ++i) {
+    if ((int) i != state.result_buffer) {
+      state.sim_buffers[n++] = i;
+      wait_for_frames(state, state.buffer_states[i].last_read_frame);
+    }
+  }
+}
+
+// Publishes the sim buffer holding the result after iter_num iters
+// for rendering
+void publish_sim_buffer(AppState& state, uint32_t iter_num) {
+  state.result_buffer = state.sim_buffers[iter_num & 1];
+  state.result_iter_num = iter_num;
+  state.published_sim_value = state.sim_sema_value;
+  request_redraw(state);
+}
+
+// Offsets the node indices in the neighbors and top_data of the node,
+// keeping the sentinels
+void offset_node_indices(MorphNode& node, uint32_t offset) {
+  for (int i = 0; i < 4; ++i) {
+    if (node.neighbors[i] >= 0.0) {
+      node.neighbors[i] += offset;
+    }
+    if (node.top_data[i] >= 0.0) {
+      node.top_data[i] += offset;
+    }
+  }
+}
+
+// The compute unif values of instance k of the sweep
+vector<vec4> sweep_unif_vals(AppState& state, uint32_t k) {
+  Controls& controls = state.controls;
+  vector<vec4> vals;
+  for (UserUnif& user_unif : state.compute_unifs) {
+    vals.push_back(user_unif.current_val);
+  }
+  uint32_t num_instances = controls.num_instances;
+  if (num_instances > 1 &&
+      (uint32_t) controls.sweep_unif_index < vals.size()) {
+    float t = k / (float) (num_instances - 1);
+    vals[controls.sweep_unif_index][controls.sweep_comp] =
+      mix(controls.sweep_min, controls.sweep_max, t);
+  }
+  return vals;
+}
+
+// Writes the instance records read by morph.comp
+void write_instances(AppState& state) {
+  uint32_t num_unifs = state.compute_unifs.size();
+  VkDeviceSize record_size = SimInstance::record_size(num_unifs);
+  VkDeviceSize buffer_size = record_size * state.instances.size();
+  vector<char> records(buffer_size);
+  for (uint32_t i = 0; i < state.instances.size(); ++i) {
+    state.instances[i].pack(num_unifs, records.data() + i * record_size);
+  }
+
+  StagingBuf staging(state, buffer_size);
+  copy_data_to_buffer(state, staging, records.data(),
+      buffer_size, state.instance_buffer);
+  staging.cleanup(state);
+}
+
+/*
+   Sets the sim buffers, compute storage and instances to the state in
+   the loaded snapshot. The attributes are copied from the mapped file
+   straight to the staging buffer, and from there to both sim buffers.
+*/
+void set_snapshot_sim_data(AppState& state) {
+  SnapshotFile& snapshot = state.snapshot;
+  const SnapshotHeader& header = snapshot.header;
+  if (state.compact_nodes != (header.compact != 0)) {
+    state.controls.compact_nodes = header.compact != 0;
+    set_node_format(state, state.controls.compact_nodes);
+  }
+  select_sim_buffers(state);
+
+  state.instances.clear();
+  VkDeviceSize record_size = SimInstance::record_size(header.num_user_unifs);
+  for (uint32_t k = 0; k < header.num_instances; ++k) {
+    state.instances.push_back(SimInstance::unpack(header.num_user_unifs,
+          snapshot.section(SNAPSHOT_INSTANCES) + k * record_size));
+  }
+  write_instances(state);
+  state.instance_queue_len = header.instance_queue_len;
+
+  // the dispatch size depends on the workgroup size of this device
+  ComputeStorage compute_storage;
+  memcpy(&compute_storage, snapshot.section(SNAPSHOT_COMPUTE_STORAGE),
+      sizeof(compute_storage));
+  compute_storage.dispatch_args[0] = div_ceil(
+      compute_storage.work_iter_lens[header.iter_num & 1],
+      state.workgroup_size);
+  write_to_compute_storage(state, compute_storage);
+
+  VkDeviceSize attribs_size = snapshot.section_size(SNAPSHOT_ATTRIBS);
+  StagingBuf staging(state, attribs_size);
+  void* staging_data;
+  vmaMapMemory(state.allocator, staging.allocation, &staging_data);
+  memcpy(staging_data, snapshot.section(SNAPSHOT_ATTRIBS), attribs_size);
+  vmaUnmapMemory(state.allocator, staging.allocation);
+
+  VkCommandBuffer cmd_buffer = begin_single_time_commands(state);
+  VkDeviceSize src_offset = 0;
+  for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+    VkDeviceSize size = (VkDeviceSize)
+      node_attrib_stride(state.compact_nodes, i) * header.node_count;
+    for (uint32_t buf_index : state.sim_buffers) {
+      VkBufferCopy region = {
+        src_offset, state.buffer_states[buf_index].vert_offsets[i], size
+      };
+      vkCmdCopyBuffer(cmd_buffer, staging.buf, state.node_arena,
+          1, &region);
+    }
+    src_offset += size;
+  }
+  state.node_count = header.node_count;
+  record_normals_update(state, cmd_buffer, vector<uint32_t>(
+        state.sim_buffers.begin(), state.sim_buffers.end()));
+  end_single_time_commands(state, cmd_buffer);
+  staging.cleanup(state);
+
+  state.sim_base_iter = header.iter_num;
+}
+
+/*
+   Generates the initial nodes of controls.num_instances instances, as
+   contiguous ranges of the node buffers, each with its own queue and
+   its own seed (controls.seed + k) and compute unif values
+   (see sweep_unif_vals).
+   If a snapshot is loaded, the run starts from it instead.
+*/
+void set_initial_sim_data(AppState& state) {
+  if (state.snapshot.is_open()) {
+    set_snapshot_sim_data(state);
+    return;
+  }
+  state.sim_base_iter = 0;
+  select_sim_buffers(state);
+
+  ivec2 zygote_samples(state.controls.num_zygote_samples);
+  vector<MorphNode> instance_nodes;
+  vector<uint32_t> instance_queue_values;
+  gen_morph_data(zygote_samples, state.controls.inactive_node_count,
+      instance_nodes, instance_queue_values);
+
+  uint32_t num_instances = state.controls.num_instances;
+  uint32_t instance_node_count = instance_nodes.size();
+  state.instance_queue_len = MAX_STORAGE_QUEUE_LEN / num_instances;
+  state.instances.resize(num_instances);
+
+  ComputeStorage compute_storage;
+  vector<MorphNode> nodes;
+  nodes.reserve(num_instances * instance_node_count);
+  for (uint32_t k = 0; k < num_instances; ++k) {
+    uint32_t offset = k * instance_node_count;
+    for (MorphNode node : instance_nodes) {
+      offset_node_indices(node, offset);
+      nodes.push_back(node);
+    }
+    vector<uint32_t> queue_values = instance_queue_values;
+    for (uint32_t& value : queue_values) {
+      value += offset;
+    }
+    setup_queue_mem(compute_storage, k, state.instance_queue_len,
+        queue_values);
+
+    SimInstance& instance = state.instances[k];
+    instance.node_offset = offset;
+    instance.node_count = instance_node_count;
+    instance.inactive_node_count = state.controls.inactive_node_count;
+    instance.seed = state.controls.seed + k;
+    instance.user_unif_vals = sweep_unif_vals(state, k);
+  }
+  write_instances(state);
+  MorphNodes node_vecs(nodes);
+
+  // init shared storage
+  setup_worklist(compute_storage, node_vecs, state.workgroup_size);
+  //setup_test_queue(compute_storage);
+  write_to_compute_storage(state, compute_storage);
+ 
+  if (state.controls.log_input_nodes) {
+    printf("input nodes:\n");
+    log_nodes(node_vecs);
+  }
+  if (state.controls.log_input_compute_storage) {
+    printf("input compute storage:\n");
+    log_compute_storage(compute_storage, num_instances,
+        state.instance_queue_len);
+  }
+
+  write_nodes_to_sim_buffers(state, node_vecs);
+}
+
+/*
+   For debugging race conditions
+*/
+void cmd_full_pipeline_barrier(VkCommandBuffer& cmd_buffer) {
+	VkMemoryBarrier memory_barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+										 VK_ACCESS_INDEX_READ_BIT |
+										 VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+										 VK_ACCESS_UNIFORM_READ_BIT |
+										 VK_ACCESS_INPUT_ATTACHMENT_READ_BIT |
+										 VK_ACCESS_SHADER_READ_BIT |
+										 VK_ACCESS_SHADER_WRITE_BIT |
+										 VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+										 VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+										 VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+										 VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+										 VK_ACCESS_TRANSFER_READ_BIT |
+										 VK_ACCESS_TRANSFER_WRITE_BIT |
+										 VK_ACCESS_HOST_READ_BIT |
+										 VK_ACCESS_HOST_WRITE_BIT,
+		.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+										 VK_ACCESS_INDEX_READ_BIT |
+										 VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
+										 VK_ACCESS_UNIFORM_READ_BIT |
+										 VK_ACCESS_INPUT_ATTACHMENT_READ_BIT |
+										 VK_ACCESS_SHADER_READ_BIT |
+										 VK_ACCESS_SHADER_WRITE_BIT |
+										 VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
+										 VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+										 VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+										 VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+										 VK_ACCESS_TRANSFER_READ_BIT |
+										 VK_ACCESS_TRANSFER_WRITE_BIT |
+										 VK_ACCESS_HOST_READ_BIT |
+										 VK_ACCESS_HOST_WRITE_BIT
+  };
+
+  vkCmdPipelineBarrier(cmd_buffer,
+      VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+      VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+      1, &memory_barrier,
+      0, nullptr,
+      0, nullptr);
+}
+
+// The bytes of a recorded frame
+VkDeviceSize trajectory_frame_size(AppState& state) {
+  VkDeviceSize frame_size = 0;
+  for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+    if (state.traj_attribs & attrib_bit(i)) {
+      frame_size += (VkDeviceSize)
+        node_attrib_stride(state.compact_nodes, i) * state.node_count;
+    }
+  }
+  return frame_size;
+}
+
+// Starts recording the run that is about to start, if one was requested.
+// Called once the run's initial data is set.
+void start_recording(AppState& state) {
+  Controls& controls = state.controls;
+  if (!controls.record_next_run) {
+    return;
+  }
+  controls.record_next_run = false;
+  AttribMask attribs = 0;
+  for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+    if (controls.record_attribs[i]) {
+      attribs |= attrib_bit(i);
+    }
+  }
+  if (attribs == 0 || !state.traj_writer.open(controls.record_path,
+        attribs, state.compact_nodes, controls.record_compress,
+        state.instances.size())) {
+    return;
+  }
+  state.recording = true;
+  state.traj_attribs = attribs;
+  state.traj_interval = std::max(controls.record_interval, 1);
+  state.traj_frame_seq = 0;
+  state.traj_chunk_frames.clear();
+}
+
+// Finishes the recording once its run is done (or abandoned)
+void stop_recording(AppState& state) {
+  if (!state.recording) {
+    return;
+  }
+  state.recording = false;
+  if (!state.traj_writer.close()) {
+    printf("recording to %s failed: %s\n", state.controls.record_path,
+        state.traj_writer.first_error().c_str());
+    return;
+  }
+  printf("recorded %u frames to %s\n", state.traj_writer.frame_count(),
+      state.controls.record_path);
+}
+
+// The end of the chunk of the simulation that starts at iter. A chunk
+// ends at a reorder, and while recording, once its frames fill the ring.
+uint32_t sim_chunk_end(AppState& state, uint32_t iter, uint32_t num_iters) {
+  uint32_t end_iter = num_iters;
+  uint32_t reorder_interval = state.controls.reorder_interval;
+  if (reorder_interval > 0) {
+    end_iter = std::min(end_iter, iter + reorder_interval);
+  }
+  if (state.recording) {
+    uint32_t interval = state.traj_interval;
+    end_iter = std::min(end_iter,
+        (iter / interval + TRAJECTORY_RING_SLOTS) * interval);
+  }
+  return end_iter;
+}
+
+// Records the copy of the recorded attributes of buffer state buf_index
+// to the next slot of the ring
+void record_trajectory_capture(AppState& state, VkCommandBuffer cmd_buffer,
+    uint32_t buf_index, uint32_t iter_num) {
+  VkMemoryBarrier capture_barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT
+  };
+  vkCmdPipelineBarrier(cmd_buffer,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+      1, &capture_barrier,
+      0, nullptr,
+      0, nullptr);
+
+  BufferState& buf_state = state.buffer_states[buf_index];
+  uint32_t slot = state.traj_frame_seq % TRAJECTORY_RING_SLOTS;
+  VkDeviceSize dst_offset = slot * state.traj_slot_size;
+  vector<VkBufferCopy> regions;
+  for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+    if (!(state.traj_attribs & attrib_bit(i))) {
+      continue;
+    }
+    VkDeviceSize size = (VkDeviceSize)
+      node_attrib_stride(state.compact_nodes, i) * state.node_count;
+    regions.push_back({buf_state.vert_offsets[i], dst_offset, size});
+    dst_offset += size;
+  }
+  vkCmdCopyBuffer(cmd_buffer, state.node_arena, state.traj_ring,
+      regions.size(), regions.data());
+
+  // the copy must finish before a later iteration overwrites the buffer
+  vkCmdPipelineBarrier(cmd_buffer,
+      VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+      0, nullptr,
+      0, nullptr,
+      0, nullptr);
+
+  state.traj_frame_seq += 1;
+  state.traj_chunk_frames.push_back(iter_num);
+}
+
+// Hands the frames captured by the finished chunk to the writer thread
+void write_captured_frames(AppState& state) {
+  if (!state.recording || state.traj_chunk_frames.empty()) {
+    return;
+  }
+  vmaInvalidateAllocation(state.allocator, state.traj_ring_alloc,
+      0, VK_WHOLE_SIZE);
+  VkDeviceSize frame_size = trajectory_frame_size(state);
+  uint64_t seq = state.traj_frame_seq - state.traj_chunk_frames.size();
+  for (uint32_t iter_num : state.traj_chunk_frames) {
+    char* frame_data = state.traj_ring_data +
+      (seq % TRAJECTORY_RING_SLOTS) * state.traj_slot_size;
+    state.traj_writer.write_frame(iter_num, state.node_count,
+        frame_data, frame_size);
+    seq += 1;
+  }
+  state.traj_chunk_frames.clear();
+}
+
+/*
+   Records iterations [start_iter, end_iter) of the simulation into
+   cmd_buffer, using the given compute pipeline.
+   Each iteration is an indirect dispatch over the worklist, with the args
+   written by the previous iteration (or by the host for the first).
+*/
+void record_simulation_dispatches(AppState& state, VkCommandBuffer cmd_buffer,
+    VkPipeline pipeline, uint32_t start_iter, uint32_t end_iter) {
+  VkMemoryBarrier mem_barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+      VK_ACCESS_INDIRECT_COMMAND_READ_BIT
+  };
+
+  if (state.recording) {
+    // the ring slots of this chunk's frames must have been written out
+    uint32_t num_frames = end_iter / state.traj_interval -
+      start_iter / state.traj_interval;
+    assert(num_frames <= TRAJECTORY_RING_SLOTS);
+    state.traj_writer.wait_for_pending(TRAJECTORY_RING_SLOTS - num_frames);
+  }
+  
+  for (uint32_t i = start_iter; i < end_iter; ++i) {
+    BufferState& cur_buf = state.buffer_states[state.sim_buffers[i & 1]];
+    VkDescriptorSet& desc_set =
+      cur_buf.compute_desc_sets[state.sim_buffers[(i + 1) & 1]];
+
+    if (i > start_iter) {
+      // require that the previous iter writes are available to
+      // this iteration's reads
+      vkCmdPipelineBarrier(cmd_buffer,
+          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+            VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0,
+          1, &mem_barrier,
+          0, nullptr,
+          0, nullptr);
+    }
+
+    // TODO - are these bindings read at the time that the dispatch is
+    // recorded, or when it executes? Makes massive difference
+
+    // rebound every iter since the normals pass binds its own
+    vkCmdBindPipeline(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    vkCmdBindDescriptorSets(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+        state.compute_pipeline_layout, 0, 1, &desc_set,
+        0, nullptr);
+
+    ComputePushConstants push_consts(i, state.instance_queue_len,
+        (uint32_t) state.instances.size(), state.node_count);
+    vkCmdPushConstants(cmd_buffer, state.compute_pipeline_layout,
+        VK_SHADER_STAGE_COMPUTE_BIT, 0, 
+        sizeof(ComputePushConstants), &push_consts);
+
+    vkCmdDispatchIndirect(cmd_buffer, state.compute_storage_buffer,
+        offsetof(ComputeStorage, dispatch_args));
+
+    // the normals of the state this iter wrote, for the next iter and
+    // the renderer
+    vkCmdPipelineBarrier(cmd_buffer,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+        1, &mem_barrier,
+        0, nullptr,
+        0, nullptr);
+    record_normals_pass(state, cmd_buffer, state.sim_buffers[(i + 1) & 1]);
+
+    uint32_t iters_done = i + 1;
+    if (state.recording && iters_done % state.traj_interval == 0) {
+      record_trajectory_capture(state, cmd_buffer,
+          state.sim_buffers[iters_done & 1], iters_done);
+    }
+  }
+
+  if (!state.traj_chunk_frames.empty()) {
+    // the host reads the ring once the chunk is done
+    VkMemoryBarrier host_barrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_HOST_READ_BIT
+    };
+    vkCmdPipelineBarrier(cmd_buffer,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_HOST_BIT, 0,
+        1, &host_barrier,
+        0, nullptr,
+        0, nullptr);
+  }
+}
+
+// Interleaves the low 10 bits of v with two zero bits between each bit
+uint32_t spread_bits_10(uint32_t v) {
+  v &= 0x3ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v << 8)) & 0x0300f00f;
+  v = (v | (v << 4)) & 0x030c30c3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+// 30-bit Morton code of a point in the unit cube
+uint32_t morton_key(vec3 unit_pos) {
+  uvec3 q = uvec3(clamp(unit_pos, vec3(0.0f), vec3(1.0f)) * 1023.0f);
+  return (spread_bits_10(q.x) << 2) | (spread_bits_10(q.y) << 1) |
+    spread_bits_10(q.z);
+}
+
+/*
+   Appends the order of the nodes in [begin, end) to new_to_old: the
+   active nodes sorted along a Morton curve over pos.xyz, followed by
+   the inactive nodes in their current order.
+*/
+void append_spatial_node_order(MorphNodes& node_vecs, uint32_t begin,
+    uint32_t end, vector<uint32_t>& new_to_old) {
+  vec3 min_pos(std::numeric_limits<float>::max());
+  vec3 max_pos(-std::numeric_limits<float>::max());
+  for (uint32_t i = begin; i < end; ++i) {
+    if (node_vecs.neighbors_vec[i][0] != -2.0) {
+      min_pos = glm::min(min_pos, vec3(node_vecs.pos_vec[i]));
+      max_pos = glm::max(max_pos, vec3(node_vecs.pos_vec[i]));
+    }
+  }
+  vec3 extent = glm::max(max_pos - min_pos, vec3(1e-6f));
+
+  vector<pair<uint32_t, uint32_t>> active_keys;
+  vector<uint32_t> inactive_indices;
+  for (uint32_t i = begin; i < end; ++i) {
+    if (node_vecs.neighbors_vec[i][0] != -2.0) {
+      vec3 unit_pos = (vec3(node_vecs.pos_vec[i]) - min_pos) / extent;
+      active_keys.push_back({morton_key(unit_pos), i});
+    } else {
+      inactive_indices.push_back(i);
+    }
+  }
+  // ties are broken by the current index, so the order is stable
+  std::sort(active_keys.begin(), active_keys.end());
+
+  for (auto& entry : active_keys) {
+    new_to_old.push_back(entry.second);
+  }
+  new_to_old.insert(new_to_old.end(),
+      inactive_indices.begin(), inactive_indices.end());
+}
+
+/*
+   Returns the node order that sorts each instance's nodes spatially,
+   see append_spatial_node_order. The nodes stay in their instance's range.
+   new_to_old[i] is the current index of the node that moves to index i.
+*/
+vector<uint32_t> spatial_node_order(MorphNodes& node_vecs,
+    const vector<SimInstance>& instances) {
+  vector<uint32_t> new_to_old;
+  new_to_old.reserve(node_vecs.pos_vec.size());
+  for (const SimInstance& instance : instances) {
+    append_spatial_node_order(node_vecs, instance.node_offset,
+        instance.node_offset + instance.node_count, new_to_old);
+  }
+  return new_to_old;
+}
+
+// Maps a node index stored in a float through the permutation.
+// Sentinels (-1.0 for a fixed edge, -2.0 for no node) are kept.
+float remap_node_index(float index, const vector<uint32_t>& old_to_new) {
+  return index < 0.0 ? index : (float) old_to_new[(uint32_t) index];
+}
+
+/*
+   Moves node new_to_old[i] to index i, and rewrites every reference to
+   a node index (neighbors, the splice targets in top_data, and the live
+   cells of the first num_queues queues) through the permutation.
+   Note that data.x/data.w hold neighbor slots, not node indices.
+*/
+void permute_nodes(MorphNodes& node_vecs, ComputeStorage& cs,
+    const vector<uint32_t>& new_to_old, uint32_t num_queues,
+    uint32_t q_len) {
+  uint32_t node_count = node_vecs.pos_vec.size();
+  vector<uint32_t> old_to_new(node_count);
+  for (uint32_t i = 0; i < node_count; ++i) {
+    old_to_new[new_to_old[i]] = i;
+  }
+
+  MorphNodes permuted(node_count);
+  for (uint32_t i = 0; i < node_count; ++i) {
+    uint32_t old_i = new_to_old[i];
+    vec4 neighbors = node_vecs.neighbors_vec[old_i];
+    vec4 top_data = node_vecs.top_data_vec[old_i];
+    for (int j = 0; j < 4; ++j) {
+      neighbors[j] = remap_node_index(neighbors[j], old_to_new);
+      if (top_data[0] != -2.0) {
+        top_data[j] = remap_node_index(top_data[j], old_to_new);
+      }
+    }
+    permuted.pos_vec[i] = node_vecs.pos_vec[old_i];
+    permuted.vel_vec[i] = node_vecs.vel_vec[old_i];
+    permuted.neighbors_vec[i] = neighbors;
+    permuted.data_vec[i] = node_vecs.data_vec[old_i];
+    permuted.top_data_vec[i] = top_data;
+  }
+  node_vecs = std::move(permuted);
+
+  // between iterations both queue ptr pairs are equal (see exclusive_step
+  // in morph.comp), so the live cells are [start_ptrs[0], end_ptrs[0])
+  for (uint32_t q = 0; q < num_queues; ++q) {
+    QueuePtrs& ptrs = cs.queues[q];
+    for (uint32_t p = ptrs.start_ptrs[0]; p != ptrs.end_ptrs[0]; ++p) {
+      uint32_t& cell = cs.queue_mem[q * q_len + p % q_len];
+      cell = old_to_new[cell];
+    }
+  }
+}
+
+// Sorts the nodes in buffer buf_index by their position so that
+// neighbors are close in memory again after growth
+void reorder_nodes(AppState& state, uint32_t buf_index) {
+  MorphNodes node_vecs = read_nodes_from_buffers(state, buf_index);
+  ComputeStorage compute_storage = read_from_compute_storage(state);
+
+  vector<uint32_t> new_to_old = spatial_node_order(node_vecs,
+      state.instances);
+  permute_nodes(node_vecs, compute_storage, new_to_old,
+      state.instances.size(), state.instance_queue_len);
+  // rebuilding the worklist also compacts it into the new order
+  setup_worklist(compute_storage, node_vecs, state.workgroup_size);
+
+  write_to_compute_storage(state, compute_storage);
+  write_nodes_to_sim_buffers(state, node_vecs);
+}
+
+void dispatch_simulation(AppState& state) { 
+  uint32_t num_iters = std::max(
+      (uint32_t) state.controls.num_iters, state.sim_base_iter);
+
+  // run the iterations in chunks, reordering the nodes between chunks
+  uint32_t iter = state.sim_base_iter;
+  while (iter < num_iters) {
+    uint32_t end_iter = sim_chunk_end(state, iter, num_iters);
+    VkCommandBuffer tmp_buffer = begin_single_time_commands(state);
+    record_simulation_dispatches(state, tmp_buffer, state.compute_pipeline,
+        iter, end_iter);
+    end_single_time_commands(state, tmp_buffer);
+    write_captured_frames(state);
+    iter = end_iter;
+
+    if (iter < num_iters && state.controls.reorder_interval > 0 &&
+        iter % state.controls.reorder_interval == 0) {
+      reorder_nodes(state, state.sim_buffers[iter & 1]);
+    }
+  }
+
+  publish_sim_buffer(state, num_iters);
+}
+
+// Submits the next chunk of the sim job to the compute queue
+void submit_simulation_chunk(AppState& state) {
+  SimJob& job = state.sim_job;
+  uint32_t end_iter = sim_chunk_end(state, job.next_iter, job.num_iters);
+
+  VkCommandBufferAllocateInfo alloc_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+    .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+    .commandPool = state.compute_cmd_pool,
+    .commandBufferCount = 1
+  };
+  VkResult res = vkAllocateCommandBuffers(state.device, &alloc_info,
+      &job.cmd_buffer);
+  assert(res == VK_SUCCESS);
+  VkCommandBufferBeginInfo begin_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+  };
+  vkBeginCommandBuffer(job.cmd_buffer, &begin_info);
+  record_simulation_dispatches(state, job.cmd_buffer,
+      state.compute_pipeline, job.next_iter, end_iter);
+  vkEndCommandBuffer(job.cmd_buffer);
+
+  // No frame reads the sim buffers, see select_sim_buffers, so the
+  // chunk does not wait on the graphics queue
+  state.sim_sema_value += 1;
+  VkTimelineSemaphoreSubmitInfoKHR timeline_info = {
+    .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR,
+    .pNext = nullptr,
+    .waitSemaphoreValueCount = 0,
+    .pWaitSemaphoreValues = nullptr,
+    .signalSemaphoreValueCount = 1,
+    .pSignalSemaphoreValues = &state.sim_sema_value
+  };
+  VkSubmitInfo submit_info = {
+    .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .pNext = &timeline_info,
+    .waitSemaphoreCount = 0,
+    .pWaitSemaphores = nullptr,
+    .pWaitDstStageMask = nullptr,
+    .commandBufferCount = 1,
+    .pCommandBuffers = &job.cmd_buffer,
+    .signalSemaphoreCount = 1,
+    .pSignalSemaphores = &state.sim_sema
+  };
+  vkResetFences(state.device, 1, &state.sim_fence);
+  res = vkQueueSubmit(state.compute_queue, 1, &submit_info, state.sim_fence);
+  assert(res == VK_SUCCESS);
+
+  job.next_iter = end_iter;
+  job.in_flight = true;
+}
+
+// Reads back the simulation result and updates the index buffers
+void process_simulation_results(AppState& state) {
+  stop_recording(state);
+
+  // the indices only depend on the neighbors
+  AttribMask read_attribs = state.controls.log_output_nodes ?
+    ALL_ATTRIBS : attrib_bit(ATTRIB_NEIGHBORS);
+  MorphNodes node_vecs = read_nodes_from_buffers(
+      state, state.result_buffer, read_attribs);
+
+  // the index buffers are shared by all frames
+  wait_for_frames(state, state.frame_serial);
+  update_indices(state, node_vecs);
+
+  if (state.controls.log_output_nodes) {
+    printf("output nodes:\n");
+    log_nodes(node_vecs);
+  }
+  if (state.controls.log_output_compute_storage) {
+    printf("output compute storage:\n");
+    ComputeStorage out_compute_storage =
+      read_from_compute_storage(state);
+    log_compute_storage(out_compute_storage, state.instances.size(),
+        state.instance_queue_len);
+  }
+}
+
+void start_async_simulation(AppState& state) {
+  set_initial_sim_data(state);
+  start_recording(state);
+
+  SimJob& job = state.sim_job;
+  job.num_iters = std::max(
+      (uint32_t) state.controls.num_iters, state.sim_base_iter);
+  job.next_iter = state.sim_base_iter;
+  if (job.next_iter == job.num_iters) {
+    publish_sim_buffer(state, job.num_iters);
+    process_simulation_results(state);
+  } else {
+    submit_simulation_chunk(state);
+  }
+}
+
+// Advances the sim job if its current chunk has finished: reorders if due
+// and submits the next chunk, or reads back the results once all are done.
+// Called every frame.
+void poll_simulation(AppState& state) {
+  SimJob& job = state.sim_job;
+  if (!job.in_flight ||
+      vkGetFenceStatus(state.device, state.sim_fence) != VK_SUCCESS) {
+    return;
+  }
+  vkFreeCommandBuffers(state.device, state.compute_cmd_pool,
+      1, &job.cmd_buffer);
+  job.in_flight = false;
+
+  write_captured_frames(state);
+
+  if (job.restart) {
+    job.restart = false;
+    stop_recording(state);
+    start_async_simulation(state);
+  } else if (job.next_iter < job.num_iters) {
+    // chunks also end at the trajectory ring, so as in
+    // run_simulation_pipeline only reorder at the reorder interval
+    uint32_t reorder_interval = state.controls.reorder_interval;
+    if (reorder_interval > 0 && job.next_iter % reorder_interval == 0) {
+      reorder_nodes(state, state.sim_buffers[job.next_iter & 1]);
+    }
+    submit_simulation_chunk(state);
+  } else {
+    publish_sim_buffer(state, job.num_iters);
+    process_simulation_results(state);
+  }
+}
+
+// Blocks until the sim job, including a requested restart, is done
+void finish_simulation(AppState& state) {
+  while (state.sim_job.in_flight) {
+    vkWaitForFences(state.device, 1, &state.sim_fence, VK_TRUE,
+        std::numeric_limits<uint64_t>::max());
+    poll_simulation(state);
+  }
+}
+
+// The inputs that determine the result of a simulation run, packed so
+// that the animation can tell when a rerun would give the same nodes
+string sim_inputs_key(AppState& state) {
+  Controls& controls = state.controls;
+  string key;
+  auto append = [&key](const void* data, size_t size) {
+    key.append((const char*) data, size);
+  };
+  array<int, 10> int_inputs = {
+    controls.num_iters, controls.num_zygote_samples,
+    controls.inactive_node_count, controls.reorder_interval,
+    controls.num_instances, controls.seed,
+    controls.sweep_unif_index, controls.sweep_comp,
+    (int) state.compact_nodes, (int) state.snapshot.is_open()
+  };
+  append(int_inputs.data(), sizeof(int_inputs));
+  array<float, 2> sweep_range = {controls.sweep_min, controls.sweep_max};
+  append(sweep_range.data(), sizeof(sweep_range));
+  for (UserUnif& unif : state.compute_unifs) {
+    append(&unif.current_val, sizeof(vec4));
+  }
+  if (state.snapshot.is_open()) {
+    key += state.snapshot.path;
+  }
+  return key;
+}
+
+// Runs the simulation from the initial data for controls.num_iters.
+// With async compute this only starts it, and if a run is already in
+// flight the new run starts once it finishes.
+void run_simulation_pipeline(AppState& state) { 
+  // the trajectory replaces the simulation until it's closed
+  if (state.traj_reader.is_open()) {
+    return;
+  }
+  state.last_sim_inputs = sim_inputs_key(state);
+
+  if (state.has_async_compute && state.controls.async_sim) {
+    if (state.sim_job.in_flight) {
+      state.sim_job.restart = true;
+    } else {
+      start_async_simulation(state);
+    }
+    return;
+  }
+
+  finish_simulation(state);
+  set_initial_sim_data(state);
+  start_recording(state);
+  dispatch_simulation(state);
+  process_simulation_results(state);
+}
+
+// Runs the simulation from the initial data for controls.num_iters on the
+// calling thread and returns the resulting nodes
+MorphNodes run_headless_simulation(AppState& state) {
+  set_initial_sim_data(state);
+  dispatch_simulation(state);
+  return read_nodes_from_buffers(state, state.result_buffer);
+}
+
+/*
+   Uploads a frame of the open trajectory to a free buffer state and
+   publishes it in place of the simulation results.
+   The frame is already in the GPU format, so it's copied to the node
+   arena as is. The attributes that were not recorded are zeroed.
+   Returns false if the frame's data is corrupt.
+*/
+bool show_trajectory_frame(AppState& state, uint32_t frame_index) {
+  TrajectoryReader& reader = state.traj_reader;
+  const TrajectoryHeader& header = reader.header;
+  const TrajectoryIndexEntry& entry = reader.frame_entry(frame_index);
+  if (state.compact_nodes != (header.compact != 0)) {
+    state.controls.compact_nodes = header.compact != 0;
+    set_node_format(state, state.controls.compact_nodes);
+  }
+  finish_simulation(state);
+  select_sim_buffers(state);
+  uint32_t buf_index = state.sim_buffers[entry.iter_num & 1];
+  BufferState& buf_state = state.buffer_states[buf_index];
+
+  StagingBuf staging(state, reader.frame_size(frame_index));
+  void* staging_data;
+  vmaMapMemory(state.allocator, staging.allocation, &staging_data);
+  if (!reader.copy_frame(frame_index, staging_data)) {
+    vmaUnmapMemory(state.allocator, staging.allocation);
+    staging.cleanup(state);
+    printf("trajectory frame %u is corrupt\n", frame_index);
+    return false;
+  }
+
+  MorphNodes node_vecs(entry.node_count);
+  VkCommandBuffer cmd_buffer = begin_single_time_commands(state);
+  VkDeviceSize src_offset = 0;
+  for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+    VkDeviceSize size = (VkDeviceSize)
+      node_attrib_stride(state.compact_nodes, i) * entry.node_count;
+    if (!(header.attribs & attrib_bit(i))) {
+      vkCmdFillBuffer(cmd_buffer, state.node_arena,
+          buf_state.vert_offsets[i], size, 0);
+      continue;
+    }
+    VkBufferCopy region = {src_offset, buf_state.vert_offsets[i], size};
+    vkCmdCopyBuffer(cmd_buffer, staging.buf, state.node_arena, 1, &region);
+    if (i == ATTRIB_NEIGHBORS) {
+      node_vecs.unpack_attrib(i, state.compact_nodes,
+          (char*) staging_data + src_offset);
+    }
+    src_offset += size;
+  }
+  state.node_count = entry.node_count;
+  record_normals_update(state, cmd_buffer, {buf_index});
+  end_single_time_commands(state, cmd_buffer);
+  vmaUnmapMemory(state.allocator, staging.allocation);
+  staging.cleanup(state);
+
+  // the nodes are split evenly between the recorded instances
+  uint32_t instance_node_count = entry.node_count / header.num_instances;
+  state.instances.resize(header.num_instances);
+  for (uint32_t k = 0; k < header.num_instances; ++k) {
+    state.instances[k].node_offset = k * instance_node_count;
+    state.instances[k].node_count = instance_node_count;
+  }
+  publish_sim_buffer(state, entry.iter_num);
+  state.shown_traj_frame = frame_index;
+
+  // the index buffers are shared by all frames
+  wait_for_frames(state, state.frame_serial);
+  update_indices(state, node_vecs);
+  return true;
+}
+
+// Closes the trajectory and goes back to showing the simulation
+void close_trajectory(AppState& state) {
+  state.traj_reader.close();
+  state.shown_traj_frame = -1;
+  state.controls.playing_trajectory = false;
+  run_simulation_pipeline(state);
+}
+
+// Opens controls.playback_path and shows its first frame.
+// Returns false if the file can't be played back.
+bool open_trajectory(AppState& state) {
+  Controls& controls = state.controls;
+  TrajectoryReader& reader = state.traj_reader;
+  if (!reader.open(controls.playback_path)) {
+    return false;
+  }
+  AttribMask required_attribs =
+    attrib_bit(ATTRIB_POS) | attrib_bit(ATTRIB_NEIGHBORS);
+  const char* error = nullptr;
+  if ((reader.header.attribs & required_attribs) != required_attribs) {
+    error = "must record pos and neighbors";
+  } else if (reader.frame_count() == 0) {
+    error = "has no frames";
+  } else if (reader.header.num_instances > MAX_NUM_INSTANCES) {
+    error = "has too many instances";
+  }
+  for (uint32_t i = 0; i < reader.frame_count() && !error; ++i) {
+    uint32_t node_count = reader.frame_entry(i).node_count;
+    if (node_count == 0 || node_count > MAX_NUM_VERTICES ||
+        node_count % reader.header.num_instances != 0) {
+      error = "has a frame with an invalid node count";
+      break;
+    }
+    // the frame is uploaded attribute by attribute, so it must hold
+    // exactly the recorded attributes
+    uint64_t expected_size = 0;
+    for (uint32_t j = 0; j < ATTRIBUTES_COUNT; ++j) {
+      if (reader.header.attribs & attrib_bit(j)) {
+        expected_size += (uint64_t)
+          node_attrib_stride(reader.header.compact != 0, j) * node_count;
+      }
+    }
+    if (reader.frame_size(i) != expected_size) {
+      error = "has a frame with an invalid size";
+    }
+  }
+  if (error) {
+    printf("cannot play back %s: the trajectory %s\n",
+        controls.playback_path, error);
+    reader.close();
+    return false;
+  }
+
+  controls.animating_sim = false;
+  controls.playing_trajectory = false;
+  controls.playback_frame = 0;
+  if (!show_trajectory_frame(state, 0)) {
+    close_trajectory(state);
+    return false;
+  }
+  return true;
+}
+
+/*
+   Saves the published state of the last run to path, see snapshot.h.
+   Returns false if there's no run to save or the file can't be written.
+*/
+bool save_snapshot(AppState& state, const string& path) {
+  finish_simulation(state);
+  if (state.traj_reader.is_open() || state.node_count == 0) {
+    printf("no simulation results to save\n");
+    return false;
+  }
+
+  SnapshotHeader header;
+  header.iter_num = state.result_iter_num;
+  header.node_count = state.node_count;
+  header.compact = state.compact_nodes ? 1 : 0;
+  header.num_instances = state.instances.size();
+  header.instance_queue_len = state.instance_queue_len;
+  header.num_user_unifs = state.compute_unifs.size();
+
+  vector<char> unif_names(
+      header.num_user_unifs * SNAPSHOT_UNIF_NAME_LEN, '\0');
+  for (uint32_t i = 0; i < header.num_user_unifs; ++i) {
+    const string& name = state.compute_unifs[i].name;
+    assert(name.size() < SNAPSHOT_UNIF_NAME_LEN);
+    memcpy(&unif_names[i * SNAPSHOT_UNIF_NAME_LEN], name.data(),
+        name.size());
+  }
+
+  VkDeviceSize record_size = SimInstance::record_size(header.num_user_unifs);
+  vector<char> instance_records(record_size * header.num_instances);
+  for (uint32_t k = 0; k < header.num_instances; ++k) {
+    state.instances[k].pack(header.num_user_unifs,
+        instance_records.data() + k * record_size);
+  }
+
+  ComputeStorage compute_storage = read_from_compute_storage(state);
+
+  // read all the attributes with one copy
+  BufferState& buf_state = state.buffer_states[state.result_buffer];
+  vector<VkBufferCopy> regions;
+  VkDeviceSize attribs_size = 0;
+  for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+    VkDeviceSize size = (VkDeviceSize)
+      node_attrib_stride(state.compact_nodes, i) * state.node_count;
+    regions.push_back({buf_state.vert_offsets[i], attribs_size, size});
+    attribs_size += size;
+  }
+  StagingBuf staging(state, attribs_size);
+  VkCommandBuffer cmd_buffer = begin_single_time_commands(state);
+  vkCmdCopyBuffer(cmd_buffer, state.node_arena, staging.buf,
+      regions.size(), regions.data());
+  end_single_time_commands(state, cmd_buffer);
+  void* attribs_data;
+  vmaMapMemory(state.allocator, staging.allocation, &attribs_data);
+
+  bool saved = write_snapshot_file(path, header, {{
+    {unif_names.data(), unif_names.size()},
+    {instance_records.data(), instance_records.size()},
+    {&compute_storage, sizeof(compute_storage)},
+    {attribs_data, attribs_size}
+  }});
+  vmaUnmapMemory(state.allocator, staging.allocation);
+  staging.cleanup(state);
+  if (saved) {
+    printf("saved the state after %u iters to %s\n",
+        header.iter_num, path.c_str());
+  }
+  return saved;
+}
+
+/*
+   Loads the snapshot at path, so that the runs start from it until it is
+   unloaded. The controls are set to match the snapshot: its node format,
+   instance count, seed and compute unif values (those of the first
+   instance, the instances keep their own values), and at least its iters.
+   Returns false if the snapshot doesn't match this build or morph.comp.
+*/
+bool load_snapshot(AppState& state, const string& path) {
+  finish_simulation(state);
+  state.snapshot.close();
+  SnapshotFile& snapshot = state.snapshot;
+  if (!snapshot.open(path)) {
+    return false;
+  }
+
+  const SnapshotHeader& header = snapshot.header;
+  VkDeviceSize attribs_size = 0;
+  for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+    attribs_size += (VkDeviceSize)
+      node_attrib_stride(header.compact != 0, i) * header.node_count;
+  }
+  const char* error = nullptr;
+  if (header.node_count == 0 || header.node_count > MAX_NUM_VERTICES ||
+      header.num_instances == 0 ||
+      header.num_instances > MAX_NUM_INSTANCES ||
+      (uint64_t) header.instance_queue_len * header.num_instances >
+        MAX_STORAGE_QUEUE_LEN) {
+    error = "is too big for this build";
+  } else if (header.instance_queue_len == 0) {
+    error = "has an invalid header";
+  } else if (snapshot.section_size(SNAPSHOT_COMPUTE_STORAGE) !=
+        sizeof(ComputeStorage) ||
+      snapshot.section_size(SNAPSHOT_ATTRIBS) != attribs_size ||
+      snapshot.section_size(SNAPSHOT_INSTANCES) != header.num_instances *
+        SimInstance::record_size(header.num_user_unifs) ||
+      snapshot.section_size(SNAPSHOT_UNIF_NAMES) !=
+        header.num_user_unifs * SNAPSHOT_UNIF_NAME_LEN) {
+    error = "has sections of the wrong size";
+  } else if (header.num_user_unifs != state.compute_unifs.size()) {
+    error = "has different compute unifs than morph.comp";
+  }
+  for (uint32_t i = 0; i < header.num_user_unifs && !error; ++i) {
+    if (snapshot.unif_name(i) != state.compute_unifs[i].name) {
+      error = "has different compute unifs than morph.comp";
+    }
+  }
+
+  // morph.comp indexes the nodes and the queue memory with these as is
+  VkDeviceSize record_size = SimInstance::record_size(header.num_user_unifs);
+  for (uint32_t k = 0; k < header.num_instances && !error; ++k) {
+    SimInstance instance = SimInstance::unpack(header.num_user_unifs,
+        snapshot.section(SNAPSHOT_INSTANCES) + k * record_size);
+    if ((uint64_t) instance.node_offset + instance.node_count >
+          header.node_count ||
+        instance.inactive_node_count > instance.node_count) {
+      error = "has an instance with invalid nodes";
+    }
+  }
+  ComputeStorage compute_storage;
+  if (!error) {
+    memcpy(&compute_storage, snapshot.section(SNAPSHOT_COMPUTE_STORAGE),
+        sizeof(compute_storage));
+    if (compute_storage.work_len > MAX_NUM_VERTICES ||
+        compute_storage.work_iter_lens[0] > compute_storage.work_len ||
+        compute_storage.work_iter_lens[1] > compute_storage.work_len) {
+      error = "has an invalid worklist";
+    }
+  }
+  for (uint32_t j = 0; !error && j < compute_storage.work_len; ++j) {
+    if (compute_storage.work_list[j] >= header.node_count) {
+      error = "has an invalid worklist";
+    }
+  }
+  uint32_t queue_len = header.instance_queue_len;
+  for (uint32_t k = 0; k < header.num_instances && !error; ++k) {
+    const QueuePtrs& queue = compute_storage.queues[k];
+    for (uint32_t p = 0; p < 2; ++p) {
+      // the ptrs only grow, and are taken mod the queue len
+      if (queue.end_ptrs[p] - queue.start_ptrs[p] > queue_len) {
+        error = "has an invalid queue";
+      }
+    }
+    // the queued values are the node indices that the next iter pops
+    uint32_t cur_index = header.iter_num & 1;
+    for (uint32_t ptr = queue.start_ptrs[cur_index];
+        !error && ptr != queue.end_ptrs[cur_index]; ++ptr) {
+      if (compute_storage.queue_mem[k * queue_len + ptr % queue_len] >=
+          header.node_count) {
+        error = "has an invalid queue";
+      }
+    }
+  }
+  if (error) {
+    printf("cannot load %s: the snapshot %s\n", path.c_str(), error);
+    snapshot.close();
+    return false;
+  }
+
+  Controls& controls = state.controls;
+  controls.compact_nodes = header.compact != 0;
+  set_node_format(state, controls.compact_nodes);
+  controls.num_instances = header.num_instances;
+  SimInstance first_instance = SimInstance::unpack(header.num_user_unifs,
+      snapshot.section(SNAPSHOT_INSTANCES));
+  controls.seed = first_instance.seed;
+  for (uint32_t i = 0; i < header.num_user_unifs; ++i) {
+    state.compute_unifs[i].current_val = first_instance.user_unif_vals[i];
+  }
+  controls.num_iters = std::max(controls.num_iters, (int) header.iter_num);
+  controls.start_iter_num = header.iter_num;
+  printf("loaded the state after %u iters from %s\n",
+      header.iter_num, path.c_str());
+  return true;
+}
+
+// Goes back to starting the runs from the generated initial data
+void unload_snapshot(AppState& state) {
+  finish_simulation(state);
+  state.snapshot.close();
+  state.controls.start_iter_num = 0;
+}
+
+/*
+   Exports the published nodes and their edges and faces to path on the
+   exporter's thread. The instances of a sweep are placed as they are
+   drawn. Returns false if there's nothing to export or an export is
+   still running.
+*/
+bool export_mesh(AppState& state, const string& path,
+    MeshExportFormat format) {
+  finish_simulation(state);
+  if (state.node_count == 0 || state.mesh_exporter.busy()) {
+    return false;
+  }
+  AttribMask read_attribs = attrib_bit(ATTRIB_POS) |
+    attrib_bit(ATTRIB_VEL) | attrib_bit(ATTRIB_NEIGHBORS);
+  MorphNodes node_vecs = read_nodes_from_buffers(
+      state, state.result_buffer, read_attribs);
+
+  MeshExportData data;
+  data.iter_num = state.result_iter_num;
+  data.line_indices = gen_line_indices(state, node_vecs);
+  data.triangle_indices = gen_triangle_indices(state, node_vecs);
+  uint32_t num_instances = state.instances.size();
+  data.positions.resize(state.node_count);
+  data.sources.resize(state.node_count);
+  data.active.resize(state.node_count);
+  for (uint32_t i = 0; i < state.node_count; ++i) {
+    vec4 pos = node_vecs.pos_vec[i];
+    mat4 model = instance_model_mat(
+        instance_of_node(state, i), num_instances);
+    data.positions[i] = vec4(vec3(model * vec4(vec3(pos), 1.0f)), pos.w);
+    data.sources[i] = node_vecs.vel_vec[i].w;
+    data.active[i] = node_vecs.neighbors_vec[i][0] != -2.0;
+  }
+  return state.mesh_exporter.start(path, format, std::move(data));
+}
+
+// The headless state has no render pass or graphics pipelines until
+// the first offscreen render. The color is left ready to be copied out.
+void setup_offscreen_rendering(AppState& state) {
+  state.render_pass = create_render_pass(state, OFFSCREEN_FORMAT,
+      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+  setup_graphics_pipelines(state);
+
+  VkCommandBufferAllocateInfo alloc_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+    .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+    .commandPool = state.cmd_pool,
+    .commandBufferCount = 1
+  };
+  VkResult res = vkAllocateCommandBuffers(state.device, &alloc_info,
+      &state.offscreen.cmd_buffer);
+  assert(res == VK_SUCCESS);
+  VkFenceCreateInfo fence_info = {
+    .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO
+  };
+  res = vkCreateFence(state.device, &fence_info, nullptr,
+      &state.offscreen.fence);
+  assert(res == VK_SUCCESS);
+  state.offscreen.has_pipelines = true;
+}
+
+void cleanup_offscreen_target(AppState& state) {
+  OffscreenTarget& target = state.offscreen;
+  if (target.color_img == VK_NULL_HANDLE) {
+    return;
+  }
+  for (uint32_t v = 0; v < target.num_views; ++v) {
+    vkDestroyFramebuffer(state.device, target.framebuffers[v], nullptr);
+    vkDestroyImageView(state.device, target.layer_views[v], nullptr);
+  }
+  target.framebuffers.clear();
+  target.layer_views.clear();
+  vmaDestroyImage(state.allocator, target.color_img, target.color_alloc);
+  vkDestroyImageView(state.device, target.depth_view, nullptr);
+  vmaDestroyImage(state.allocator, target.depth_img, target.depth_alloc);
+  vkDestroyImageView(state.device, target.id_view, nullptr);
+  vmaDestroyImage(state.allocator, target.id_img, target.id_alloc);
+  vmaUnmapMemory(state.allocator, target.readback_alloc);
+  vmaDestroyBuffer(state.allocator, target.readback_buffer,
+      target.readback_alloc);
+  target.color_img = VK_NULL_HANDLE;
+  target.num_views = 0;
+  target.size = 0;
+}
+
+void cleanup_offscreen_rendering(AppState& state) {
+  OffscreenTarget& target = state.offscreen;
+  if (!target.has_pipelines) {
+    return;
+  }
+  cleanup_offscreen_target(state);
+  vkDestroyFence(state.device, target.fence, nullptr);
+  vkFreeCommandBuffers(state.device, state.cmd_pool, 1, &target.cmd_buffer);
+  cleanup_graphics_pipelines(state);
+  vkDestroyRenderPass(state.device, state.render_pass, nullptr);
+  target.has_pipelines = false;
+}
+
+// Recreates the offscreen images if the size or number of views changed
+void ensure_offscreen_target(AppState& state, uint32_t size,
+    uint32_t num_views) {
+  OffscreenTarget& target = state.offscreen;
+  if (target.size == size && target.num_views == num_views) {
+    return;
+  }
+  cleanup_offscreen_target(state);
+  target.size = size;
+  target.num_views = num_views;
+
+  create_image(state, size, size, OFFSCREEN_FORMAT, VK_IMAGE_TILING_OPTIMAL,
+      VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+      VMA_MEMORY_USAGE_GPU_ONLY, 0,
+      target.color_img, target.color_alloc, num_views);
+  VkFormat depth_format = find_depth_format(state.phys_device);
+  create_image(state, size, size, depth_format, VK_IMAGE_TILING_OPTIMAL,
+      VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+      VMA_MEMORY_USAGE_GPU_ONLY, 0,
+      target.depth_img, target.depth_alloc);
+  target.depth_view = create_image_view(state, target.depth_img,
+      depth_format, VK_IMAGE_ASPECT_DEPTH_BIT);
+  create_image(state, size, size, NODE_ID_FORMAT, VK_IMAGE_TILING_OPTIMAL,
+      VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+      VMA_MEMORY_USAGE_GPU_ONLY, 0,
+      target.id_img, target.id_alloc);
+  target.id_view = create_image_view(state, target.id_img,
+      NODE_ID_FORMAT, VK_IMAGE_ASPECT_COLOR_BIT);
+
+  for (uint32_t v = 0; v < num_views; ++v) {
+    VkImageView layer_view = create_image_view(state, target.color_img,
+        OFFSCREEN_FORMAT, VK_IMAGE_ASPECT_COLOR_BIT, v);
+    target.layer_views.push_back(layer_view);
+    vector<VkImageView> attachments = {
+      layer_view, target.depth_view, target.id_view
+    };
+    VkFramebufferCreateInfo fb_info = {
+      .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+      .renderPass = state.render_pass,
+      .attachmentCount = (uint32_t) attachments.size(),
+      .pAttachments = attachments.data(),
+      .width = size,
+      .height = size,
+      .layers = 1
+    };
+    VkFramebuffer framebuffer;
+    VkResult res = vkCreateFramebuffer(state.device, &fb_info, nullptr,
+        &framebuffer);
+    assert(res == VK_SUCCESS);
+    target.framebuffers.push_back(framebuffer);
+  }
+
+  create_buffer(state, (VkDeviceSize) size * size * 4 * num_views,
+      VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+      VMA_MEMORY_USAGE_GPU_TO_CPU, 0,
+      target.readback_buffer, target.readback_alloc);
+  void* readback_data = nullptr;
+  VkResult res = vmaMapMemory(state.allocator, target.readback_alloc,
+      &readback_data);
+  assert(res == VK_SUCCESS);
+  target.readback_data = (uint8_t*) readback_data;
+}
+
+// The camera of view view_index of num_views, which circle the nodes
+// looking at the center of the sphere of the given radius
+CameraUniforms thumbnail_camera(vec3 center, float radius,
+    uint32_t view_index, uint32_t num_views) {
+  float fov = (float) M_PI / 4.0f;
+  float dist = radius / sin(fov / 2.0f);
+  float angle = 2.0f * (float) M_PI * view_index / num_views;
+  vec3 dir(cos(THUMBNAIL_ELEVATION) * cos(angle),
+      sin(THUMBNAIL_ELEVATION),
+      cos(THUMBNAIL_ELEVATION) * sin(angle));
+  CameraUniforms unifs;
+  unifs.view = glm::lookAt(center + dist * dir, center, vec3(0.0f, 1.0f, 0.0f));
+  unifs.proj = glm::perspective(fov, 1.0f,
+      std::max(dist - radius, 0.01f * dist), dist + radius);
+  // invert Y b/c vulkan's y-axis is inverted wrt OpenGL
+  unifs.proj[1][1] *= -1;
+  return unifs;
+}
+
+/*
+   Renders the published nodes (headless only) from num_views angles
+   around them into the layers of one image, each size by size, and
+   copies them back, all in one submission. node_vecs must hold the
+   positions and neighbors of the published nodes. num_views is at most
+   MAX_THUMBNAIL_VIEWS and size at most MAX_THUMBNAIL_SIZE. Returns
+   false if there's nothing to render. The images are picked up by
+   finish_thumbnails, so the caller can get on with other work while
+   they render.
+*/
+bool start_thumbnails(AppState& state, MorphNodes& node_vecs,
+    uint32_t num_views, uint32_t size) {
+  assert(state.headless);
+  OffscreenTarget& target = state.offscreen;
+  assert(num_views >= 1 && num_views <= MAX_THUMBNAIL_VIEWS);
+  assert(size >= 1 && size <= MAX_THUMBNAIL_SIZE);
+  if (state.node_count == 0) {
+    return false;
+  }
+  // a render that was never finished is dropped
+  if (target.in_flight) {
+    vkWaitForFences(state.device, 1, &target.fence, VK_TRUE,
+        std::numeric_limits<uint64_t>::max());
+    target.in_flight = false;
+  }
+  if (!target.has_pipelines) {
+    setup_offscreen_rendering(state);
+  }
+  ensure_offscreen_target(state, size, num_views);
+  update_indices(state, node_vecs);
+
+  // frame the active nodes as they are drawn
+  vec3 bounds_min(std::numeric_limits<float>::max());
+  vec3 bounds_max(-std::numeric_limits<float>::max());
+  uint32_t num_instances = state.instances.size();
+  for (uint32_t i = 0; i < state.node_count; ++i) {
+    if (node_vecs.neighbors_vec[i][0] == -2.0) {
+      continue;
+    }
+    mat4 model = instance_model_mat(
+        instance_of_node(state, i), num_instances);
+    vec3 pos = vec3(model * vec4(vec3(node_vecs.pos_vec[i]), 1.0f));
+    bounds_min = glm::min(bounds_min, pos);
+    bounds_max = glm::max(bounds_max, pos);
+  }
+  if (bounds_min.x > bounds_max.x) {
+    return false;
+  }
+  vec3 center = 0.5f * (bounds_min + bounds_max);
+  float radius = std::max(0.5f * length(bounds_max - bounds_min), 0.01f);
+  for (uint32_t v = 0; v < num_views; ++v) {
+    CameraUniforms camera_unifs = thumbnail_camera(
+        center, radius, v, num_views);
+    memcpy(state.camera_buffer_data +
+        (max_frames_in_flight + v) * state.camera_slot_size,
+        &camera_unifs, sizeof(camera_unifs));
+  }
+  // the mapping need not be host coherent
+  vmaFlushAllocation(state.allocator, state.camera_buffer_alloc,
+      max_frames_in_flight * state.camera_slot_size,
+      num_views * state.camera_slot_size);
+
+  VkCommandBuffer cmd_buffer = target.cmd_buffer;
+  VkResult res = vkResetCommandBuffer(cmd_buffer, 0);
+  assert(res == VK_SUCCESS);
+  VkCommandBufferBeginInfo begin_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+  };
+  res = vkBeginCommandBuffer(cmd_buffer, &begin_info);
+  assert(res == VK_SUCCESS);
+
+  array<VkClearValue, 3> clear_values = {};
+  clear_values[0].color = {1.0f, 1.0f, 1.0f, 1.0f};
+  clear_values[1].depthStencil = {1.0f, 0};
+  clear_values[2].color.uint32[0] = NO_NODE_ID;
+  VkExtent2D extent = {size, size};
+  for (uint32_t v = 0; v < num_views; ++v) {
+    VkRenderPassBeginInfo render_pass_info = {
+      .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+      .renderPass = state.render_pass,
+      .framebuffer = target.framebuffers[v],
+      .renderArea.offset = {0, 0},
+      .renderArea.extent = extent,
+      .clearValueCount = (uint32_t) clear_values.size(),
+      .pClearValues = clear_values.data()
+    };
+    vkCmdBeginRenderPass(cmd_buffer, &render_pass_info,
+        VK_SUBPASS_CONTENTS_INLINE);
+    set_viewport(cmd_buffer, extent);
+    record_node_draws(state, cmd_buffer, state.result_buffer,
+        max_frames_in_flight + v, nullptr, false);
+    vkCmdEndRenderPass(cmd_buffer);
+  }
+
+  // the layers are tightly packed one after the other
+  VkBufferImageCopy region = {
+    .bufferOffset = 0,
+    .bufferRowLength = 0,
+    .bufferImageHeight = 0,
+    .imageSubresource = {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .mipLevel = 0,
+      .baseArrayLayer = 0,
+      .layerCount = num_views
+    },
+    .imageOffset = {0, 0, 0},
+    .imageExtent = {size, size, 1}
+  };
+  vkCmdCopyImageToBuffer(cmd_buffer, target.color_img,
+      VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, target.readback_buffer,
+      1, &region);
+  VkMemoryBarrier host_barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_HOST_READ_BIT
+  };
+  vkCmdPipelineBarrier(cmd_buffer,
+      VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+      1, &host_barrier,
+      0, nullptr,
+      0, nullptr);
+  res = vkEndCommandBuffer(cmd_buffer);
+  assert(res == VK_SUCCESS);
+
+  VkSubmitInfo submit_info = {
+    .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .commandBufferCount = 1,
+    .pCommandBuffers = &cmd_buffer
+  };
+  res = vkResetFences(state.device, 1, &target.fence);
+  assert(res == VK_SUCCESS);
+  res = vkQueueSubmit(state.queue, 1, &submit_info, target.fence);
+  assert(res == VK_SUCCESS);
+  target.in_flight = true;
+  return true;
+}
+
+// Waits for the render started by start_thumbnails and hands view i to
+// the pool, to be written to <path_prefix>.view<i>.png
+void finish_thumbnails(AppState& state, const string& path_prefix,
+    PngWriterPool& pool) {
+  OffscreenTarget& target = state.offscreen;
+  if (!target.in_flight) {
+    return;
+  }
+  vkWaitForFences(state.device, 1, &target.fence, VK_TRUE,
+      std::numeric_limits<uint64_t>::max());
+  target.in_flight = false;
+  vmaInvalidateAllocation(state.allocator, target.readback_alloc,
+      0, VK_WHOLE_SIZE);
+
+  size_t layer_size = (size_t) target.size * target.size * 4;
+  for (uint32_t v = 0; v < target.num_views; ++v) {
+    const uint8_t* layer = target.readback_data + v * layer_size;
+    pool.submit(path_prefix + ".view" + to_string(v) + ".png",
+        target.size, target.size, vector<uint8_t>(layer, layer + layer_size));
   }
 }
 
-void write_to_compute_storage(AppState& state,
-    ComputeStorage& compute_storage) {
-  StagingBuf staging(state, sizeof(ComputeStorage));
-  copy_data_to_buffer(state, staging, &compute_storage,
-      sizeof(compute_storage), state.compute_storage_buffer);
-  staging.cleanup(state);
+// Resets the compute unifs to the defaults from the shader
+void reset_compute_unifs(AppState& state) {
+  for (UserUnif& user_unif : state.compute_unifs) {
+    user_unif.current_val = user_unif.default_val;
+  }
 }
 
-ComputeStorage read_from_compute_storage(AppState& state) {
-  ComputeStorage compute_storage;
-  StagingBuf staging(state, sizeof(compute_storage));
-  copy_data_from_buffer(state, staging, &compute_storage,
-      sizeof(compute_storage), state.compute_storage_buffer);
-  staging.cleanup(state);
-  return compute_storage;
+// Returns false if the compute shader has no unif with the name
+bool set_compute_unif(AppState& state, const string& name, vec4 val) {
+  for (UserUnif& user_unif : state.compute_unifs) {
+    if (user_unif.name == name) {
+      user_unif.current_val = val;
+      return true;
+    }
+  }
+  return false;
 }
 
-void setup_test_queue(ComputeStorage& cs) {
-  cs.queue_mem = {1, 2, 3};
-  cs.start_ptrs = {0, 0};
-  cs.end_ptrs = {3, 3};
+// Identifies the device and driver in the workgroup size cache
+string workgroup_cache_key(AppState& state) {
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(state.phys_device, &props);
+  array<char, 100> s;
+  sprintf(s.data(), "%x:%x:%x",
+      props.vendorID, props.deviceID, props.driverVersion);
+  return string(s.data());
 }
 
-void setup_queue_mem(ComputeStorage& cs, vector<uint32_t>& queue_values) {
-  assert(queue_values.size() <= cs.queue_mem.size());
-  std::fill(cs.queue_mem.begin(), cs.queue_mem.end(), 0);
-  std::copy(queue_values.begin(), queue_values.end(), cs.queue_mem.begin());
-  cs.start_ptrs = {0, 0};
-  uint32_t end_ptr = queue_values.size();
-  cs.end_ptrs = {end_ptr, end_ptr};
+vector<pair<string, uint32_t>> read_workgroup_cache() {
+  vector<pair<string, uint32_t>> entries;
+  ifstream file(WORKGROUP_CACHE_FILE);
+  string key;
+  uint32_t size = 0;
+  while (file >> key >> size) {
+    entries.push_back({key, size});
+  }
+  return entries;
 }
 
-void set_initial_sim_data(AppState& state) {
-  ivec2 zygote_samples(state.controls.num_zygote_samples);
-  vector<MorphNode> nodes;
-  vector<uint32_t> cs_queue_mem;
-  gen_morph_data(zygote_samples, state.controls.inactive_node_count,
-      nodes, cs_queue_mem);
-  MorphNodes node_vecs(nodes);
-
-  // init shared storage
-  ComputeStorage compute_storage;
-  setup_queue_mem(compute_storage, cs_queue_mem);
-  //setup_test_queue(compute_storage);
-  write_to_compute_storage(state, compute_storage);
- 
-  if (state.controls.log_input_nodes) {
-    printf("input nodes:\n");
-    log_nodes(node_vecs);
-  }
-  if (state.controls.log_input_compute_storage) {
-    printf("input compute storage:\n");
-    log_compute_storage(compute_storage);
+// Sets state.workgroup_size if a benchmarked size for this device
+// was persisted by a previous run
+void load_cached_workgroup_size(AppState& state) {
+  string key = workgroup_cache_key(state);
+  for (auto& entry : read_workgroup_cache()) {
+    if (entry.first == key) {
+      state.workgroup_size = entry.second;
+      state.workgroup_size_tuned = true;
+      printf("using cached workgroup size: %u\n", state.workgroup_size);
+    }
   }
+}
 
-  write_nodes_to_buffers(state, node_vecs);
+void save_cached_workgroup_size(AppState& state) {
+  string key = workgroup_cache_key(state);
+  vector<pair<string, uint32_t>> entries = read_workgroup_cache();
+  // replace the entry for this device, keep the others
+  entries.erase(std::remove_if(entries.begin(), entries.end(),
+      [&](const pair<string, uint32_t>& e) { return e.first == key; }),
+      entries.end());
+  entries.push_back({key, state.workgroup_size});
+
+  ofstream file(WORKGROUP_CACHE_FILE, ios::trunc);
+  for (auto& entry : entries) {
+    file << entry.first << " " << entry.second << "\n";
+  }
 }
 
 /*
-   For debugging race conditions
+   Returns the duration in ms of WORKGROUP_BENCH_ITERS iterations.
+   Uses timestamp queries if query_pool is given, otherwise falls back
+   to timing the submission on the host.
 */
-void cmd_full_pipeline_barrier(VkCommandBuffer& cmd_buffer) {
-	VkMemoryBarrier memory_barrier = {
-    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
-		.srcAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
-										 VK_ACCESS_INDEX_READ_BIT |
-										 VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
-										 VK_ACCESS_UNIFORM_READ_BIT |
-										 VK_ACCESS_INPUT_ATTACHMENT_READ_BIT |
-										 VK_ACCESS_SHADER_READ_BIT |
-										 VK_ACCESS_SHADER_WRITE_BIT |
-										 VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
-										 VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
-										 VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
-										 VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
-										 VK_ACCESS_TRANSFER_READ_BIT |
-										 VK_ACCESS_TRANSFER_WRITE_BIT |
-										 VK_ACCESS_HOST_READ_BIT |
-										 VK_ACCESS_HOST_WRITE_BIT,
-		.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
-										 VK_ACCESS_INDEX_READ_BIT |
-										 VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT |
-										 VK_ACCESS_UNIFORM_READ_BIT |
-										 VK_ACCESS_INPUT_ATTACHMENT_READ_BIT |
-										 VK_ACCESS_SHADER_READ_BIT |
-										 VK_ACCESS_SHADER_WRITE_BIT |
-										 VK_ACCESS_COLOR_ATTACHMENT_READ_BIT |
-										 VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
-										 VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
-										 VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
-										 VK_ACCESS_TRANSFER_READ_BIT |
-										 VK_ACCESS_TRANSFER_WRITE_BIT |
-										 VK_ACCESS_HOST_READ_BIT |
-										 VK_ACCESS_HOST_WRITE_BIT
-  };
+double time_simulation_dispatches(AppState& state, VkPipeline pipeline,
+    VkQueryPool query_pool,
+    float timestamp_period, uint64_t timestamp_mask) {
+  VkCommandBuffer tmp_buffer = begin_single_time_commands(state);
+  if (query_pool != VK_NULL_HANDLE) {
+    vkCmdResetQueryPool(tmp_buffer, query_pool, 0, 2);
+    vkCmdWriteTimestamp(tmp_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+        query_pool, 0);
+  }
+  record_simulation_dispatches(state, tmp_buffer, pipeline,
+      0, WORKGROUP_BENCH_ITERS);
+  if (query_pool != VK_NULL_HANDLE) {
+    vkCmdWriteTimestamp(tmp_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+        query_pool, 1);
+  }
+  auto start_time = chrono::steady_clock::now();
+  end_single_time_commands(state, tmp_buffer);
+  auto end_time = chrono::steady_clock::now();
 
-  vkCmdPipelineBarrier(cmd_buffer,
-      VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-      VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
-      1, &memory_barrier,
-      0, nullptr,
-      0, nullptr);
+  if (query_pool == VK_NULL_HANDLE) {
+    return chrono::duration<double, milli>(end_time - start_time).count();
+  }
+  array<uint64_t, 2> timestamps = {0, 0};
+  VkResult res = vkGetQueryPoolResults(state.device, query_pool, 0, 2,
+      sizeof(timestamps), timestamps.data(), sizeof(timestamps[0]),
+      VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+  assert(res == VK_SUCCESS);
+  uint64_t ticks = (timestamps[1] - timestamps[0]) & timestamp_mask;
+  return ticks * (double) timestamp_period / 1e6;
 }
 
-void dispatch_simulation(AppState& state) { 
-  VkCommandBuffer tmp_buffer = begin_single_time_commands(state);
+/*
+   Times the simulation with each candidate workgroup size that the
+   device supports and keeps the fastest. The sweet spot differs a lot
+   between ICDs (ex. lavapipe runs a workgroup as a loop over lanes on
+   a single thread), so the result is persisted per device.
+*/
+void tune_workgroup_size(AppState& state) {
+  finish_simulation(state);
 
-  VkMemoryBarrier mem_barrier = {
-    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
-    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
-    .dstAccessMask = VK_ACCESS_SHADER_READ_BIT
-  };
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(state.phys_device, &props);
+  uint32_t max_size = std::min(props.limits.maxComputeWorkGroupSize[0],
+      props.limits.maxComputeWorkGroupInvocations);
 
-  vkCmdBindPipeline(tmp_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-      state.compute_pipeline);
-  
-  uint32_t num_iters = state.controls.num_iters;
-  for (uint32_t i = 0; i < num_iters; ++i) {
-    BufferState& cur_buf = state.buffer_states[i & 1];
+  uint32_t queue_family_count = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties(state.phys_device,
+      &queue_family_count, nullptr);
+  vector<VkQueueFamilyProperties> queue_fam_props{queue_family_count};
+  vkGetPhysicalDeviceQueueFamilyProperties(state.phys_device,
+      &queue_family_count, queue_fam_props.data());
+  uint32_t valid_bits =
+    queue_fam_props[state.target_family_index].timestampValidBits;
+  uint64_t timestamp_mask = valid_bits >= 64 ?
+    ~0ull : (1ull << valid_bits) - 1;
+
+  VkQueryPool query_pool = VK_NULL_HANDLE;
+  if (valid_bits > 0) {
+    VkQueryPoolCreateInfo query_pool_info = {
+      .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+      .queryType = VK_QUERY_TYPE_TIMESTAMP,
+      .queryCount = 2
+    };
+    VkResult res = vkCreateQueryPool(state.device, &query_pool_info,
+        nullptr, &query_pool);
+    assert(res == VK_SUCCESS);
+  } else {
+    printf("timestamps not supported, timing on the host\n");
+  }
 
-    if (i > 0) {
-      // require that the previous iter writes are available to
-      // this iteration's reads
-      vkCmdPipelineBarrier(tmp_buffer,
-          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-          VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
-          1, &mem_barrier,
-          0, nullptr,
-          0, nullptr);
+  // the parsed unifs are discarded so that the current values are kept
+  vector<UserUnif> unused_unifs;
+  VkShaderModule shader_module = create_compute_shader_module(
+      state, unused_unifs);
+
+  printf("benchmarking workgroup sizes (%u iters):\n", WORKGROUP_BENCH_ITERS);
+  uint32_t orig_size = state.workgroup_size;
+  uint32_t fastest_size = state.workgroup_size;
+  double fastest_ms = std::numeric_limits<double>::max();
+  for (uint32_t size : CANDIDATE_WORKGROUP_SIZES) {
+    if (size > max_size) {
+      continue;
     }
+    VkPipeline pipeline = create_compute_pipeline(state,
+        shader_module, size);
+    // the initial dispatch args are sized with state.workgroup_size
+    state.workgroup_size = size;
+    double best_ms = std::numeric_limits<double>::max();
+    for (uint32_t run = 0; run < WORKGROUP_BENCH_RUNS; ++run) {
+      set_initial_sim_data(state);
+      best_ms = std::min(best_ms, time_simulation_dispatches(state,
+          pipeline, query_pool, props.limits.timestampPeriod,
+          timestamp_mask));
+    }
+    printf("%6u: %10.3f ms\n", size, best_ms);
+    vkDestroyPipeline(state.device, pipeline, nullptr);
 
-    // TODO - are these bindings read at the time that the dispatch is
-    // recorded, or when it executes? Makes massive difference
-
-    vkCmdBindDescriptorSets(tmp_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-        state.compute_pipeline_layout, 0, 1, &cur_buf.compute_desc_set,
-        0, nullptr);
-
-    ComputePushConstants push_consts(
-        state.node_count, state.controls.inactive_node_count,
-        i, MAX_STORAGE_QUEUE_LEN,
-        state.compute_unifs);
-    vkCmdPushConstants(tmp_buffer, state.compute_pipeline_layout,
-        VK_SHADER_STAGE_COMPUTE_BIT, 0, 
-        sizeof(ComputePushConstants), &push_consts);
-
-    uint32_t groups_x = state.node_count / LOCAL_WORKGROUP_SIZE + 1;
-    vkCmdDispatch(tmp_buffer, groups_x, 1, 1);
+    if (best_ms < fastest_ms) {
+      fastest_ms = best_ms;
+      fastest_size = size;
+    }
   }
-  end_single_time_commands(state, tmp_buffer);
-
-  state.result_buffer = num_iters & 1;
-}
+  printf("using workgroup size: %u\n\n", fastest_size);
 
-void run_simulation_pipeline(AppState& state) { 
-  set_initial_sim_data(state);
-  dispatch_simulation(state);
-
-  MorphNodes node_vecs = read_nodes_from_buffers(
-      state, state.result_buffer);
-
-  update_indices(state, node_vecs);
-
-  if (state.controls.log_output_nodes) {
-    printf("output nodes:\n");
-    log_nodes(node_vecs);
+  state.workgroup_size = fastest_size;
+  if (fastest_size != orig_size) {
+    vkDestroyPipeline(state.device, state.compute_pipeline, nullptr);
+    state.compute_pipeline = create_compute_pipeline(state,
+        shader_module, state.workgroup_size);
   }
-  if (state.controls.log_output_compute_storage) {
-    printf("output compute storage:\n");
-    ComputeStorage out_compute_storage =
-      read_from_compute_storage(state);
-    log_compute_storage(out_compute_storage);
+  state.workgroup_size_tuned = true;
+  save_cached_workgroup_size(state);
+
+  vkDestroyShaderModule(state.device, shader_module, nullptr);
+  if (query_pool != VK_NULL_HANDLE) {
+    vkDestroyQueryPool(state.device, query_pool, nullptr);
   }
 }
 
@@ -2215,6 +5816,15 @@ void framebuffer_resize_callback(GLFWwindow* win,
   AppState* state = reinterpret_cast<AppState*>(
       glfwGetWindowUserPointer(win));
   state->framebuffer_resized = true;
+  request_redraw(*state);
+}
+
+// Redraws on any input, so that the UI reacts to it. ImGui installs its
+// own callbacks on top of these and chains to them.
+void input_redraw_callback(GLFWwindow* win) {
+  AppState* state = reinterpret_cast<AppState*>(
+      glfwGetWindowUserPointer(win));
+  request_redraw(*state);
 }
 
 void handle_key_event(GLFWwindow* win, int key, int scancode,
@@ -2222,6 +5832,7 @@ void handle_key_event(GLFWwindow* win, int key, int scancode,
 	AppState* state = reinterpret_cast<AppState*>(
       glfwGetWindowUserPointer(win));
   Controls& controls = state->controls;
+  request_redraw(*state);
 
   if (key == GLFW_KEY_R && action == GLFW_PRESS) {
     // reset camera pos
@@ -2257,18 +5868,39 @@ void init_glfw(AppState& state) {
   glfwSetFramebufferSizeCallback(state.win,
       framebuffer_resize_callback);
   glfwSetKeyCallback(state.win, handle_key_event);
+  glfwSetMouseButtonCallback(state.win,
+      [](GLFWwindow* win, int button, int action, int mods) {
+        input_redraw_callback(win);
+      });
+  glfwSetCursorPosCallback(state.win,
+      [](GLFWwindow* win, double x, double y) {
+        input_redraw_callback(win);
+      });
+  glfwSetScrollCallback(state.win,
+      [](GLFWwindow* win, double x_offset, double y_offset) {
+        input_redraw_callback(win);
+      });
+  glfwSetCharCallback(state.win,
+      [](GLFWwindow* win, unsigned int c) {
+        input_redraw_callback(win);
+      });
+  glfwSetWindowRefreshCallback(state.win, input_redraw_callback);
 }
 
-void gen_user_uniforms_ui(vector<UserUnif>& user_unifs) {
+// Returns true if any of the values changed
+bool gen_user_uniforms_ui(vector<UserUnif>& user_unifs) {
   bool should_reset_unifs = ImGui::Button("restore defaults");
+  bool changed = should_reset_unifs;
   for (UserUnif& user_unif : user_unifs) {
     if (should_reset_unifs) {
       user_unif.current_val = user_unif.default_val;
     }
-    ImGui::DragScalarN(user_unif.name.c_str(), ImGuiDataType_Float,
-        &user_unif.current_val[0], user_unif.num_comps, user_unif.drag_speed,
+    changed |= ImGui::DragScalarN(user_unif.name.c_str(),
+        ImGuiDataType_Float, &user_unif.current_val[0],
+        user_unif.num_comps, user_unif.drag_speed,
         &user_unif.min_val, &user_unif.max_val, "%.3f");
   }
+  return changed;
 }
 
 void upload_imgui_fonts(AppState& state) {
@@ -2280,7 +5912,6 @@ void upload_imgui_fonts(AppState& state) {
 
 void update_camera_cartesian(AppState& state) {
   GLFWwindow* win = state.win;
-  Controls& controls = state.controls;
   Camera& cam = state.cam;
 
   vec3 delta(0.0);
@@ -2302,7 +5933,7 @@ void update_camera_cartesian(AppState& state) {
   if (glfwGetKey(win, GLFW_KEY_E)) {
     delta += vec3(0.0,1.0,0.0);
   }
-  float delta_secs = 1.0f / controls.target_fps;
+  float delta_secs = state.frame_secs;
   vec3 trans = delta * 20.0f * delta_secs;
   mat4 trans_mat = glm::translate(mat4(1.0), trans);
 
@@ -2323,7 +5954,6 @@ void update_camera_cartesian(AppState& state) {
 
 void update_camera_spherical(AppState& state) {
   GLFWwindow* win = state.win;
-  Controls& controls = state.controls;
   Camera& cam = state.cam;
 
   vec3 eye = cam.pos();
@@ -2352,7 +5982,12 @@ void update_camera_spherical(AppState& state) {
   if (glfwGetKey(win, GLFW_KEY_E)) {
     delta_v_angle = -1.0;
   }
-  float delta_secs = 1.0f / controls.target_fps;
+  // recomputing the view from the angles is not exact, leave the camera
+  // alone so that it doesn't drift and keep redrawing
+  if (delta_r == 0.0 && delta_h_angle == 0.0 && delta_v_angle == 0.0) {
+    return;
+  }
+  float delta_secs = state.frame_secs;
   float new_r = cur_r + 30.0f * delta_r * delta_secs;
   float new_h_angle = h_angle + M_PI / 2.0 * delta_h_angle * delta_secs;
   float new_v_angle = v_angle + M_PI / 2.0 * delta_v_angle * delta_secs;
@@ -2366,11 +6001,15 @@ void update_camera_spherical(AppState& state) {
 }
 
 void update_camera(AppState& state) {
+  mat4 old_cam_to_world = state.cam.cam_to_world;
   if (state.controls.cam_spherical_mode) {
     update_camera_spherical(state);
   } else {
     update_camera_cartesian(state);
   }
+  if (state.cam.cam_to_world != old_cam_to_world) {
+    request_redraw(state);
+  }
 }
 
 void create_ui(AppState& state) {
@@ -2378,6 +6017,20 @@ void create_ui(AppState& state) {
 
   ImGui::Begin("dev console", &controls.show_dev_console);
 
+  ImGui::Text("frame pacing:");
+  ImGui::Text("fps: %.1f, frame time: %.2f ms",
+      1.0f / state.frame_secs, 1000.0f * state.frame_secs);
+  ImGui::DragInt("target fps", &controls.target_fps, 1.0f, 0, 1000);
+  controls.target_fps = std::max(controls.target_fps, 0);
+  if (ImGui::Combo("present mode", &controls.present_mode,
+        PRESENT_MODE_NAMES.data(), PRESENT_MODE_NAMES.size())) {
+    // picked up when the swapchain is recreated
+    state.framebuffer_resized = true;
+  }
+  if (state.has_async_compute) {
+    ImGui::Checkbox("sim first", &controls.sim_first);
+  }
+
   ImGui::Separator();
   ImGui::Text("camera:");
   ImGui::Text("eye: %s", vec3_str(state.cam.pos()).c_str());
@@ -2390,13 +6043,37 @@ void create_ui(AppState& state) {
     "points", "lines", "triangles"
   };
   for (uint32_t i = 0; i < PIPELINES_COUNT; ++i) {
-    ImGui::Checkbox(pipeline_names[i], &controls.pipeline_toggles[i]);
+    if (ImGui::Checkbox(pipeline_names[i], &controls.pipeline_toggles[i])) {
+      invalidate_scene_cmds(state);
+    }
+  }
+
+  if (ImGui::Checkbox("gpu cull", &controls.gpu_cull)) {
+    invalidate_scene_cmds(state);
+  }
+  if (controls.gpu_cull) {
+    // 0 draws all of the visible points
+    ImGui::DragFloat("lod pixels (0 for off)", &controls.lod_pixels,
+        0.05f, 0.0f, 16.0f);
+  }
+  if (ImGui::Checkbox("lines as tubes", &controls.draw_tubes)) {
+    invalidate_scene_cmds(state);
+  }
+  if (controls.draw_tubes) {
+    // the segments are rewritten every frame, so the draws stay valid
+    ImGui::DragFloat("tube radius", &controls.tube_radius,
+        0.005f, 0.0f, 1.0f);
+    ImGui::Combo("tube radius from", &controls.tube_radius_mode,
+        TUBE_RADIUS_MODE_NAMES.data(), TUBE_RADIUS_MODES_COUNT);
   }
 
   ImGui::Separator();
   ImGui::Text("render program controls:");
   ImGui::PushID("render");
-  gen_user_uniforms_ui(state.render_unifs);
+  // the render unifs are pushed by the recorded scene draws
+  if (gen_user_uniforms_ui(state.render_unifs)) {
+    invalidate_scene_cmds(state);
+  }
   ImGui::PopID();
 
   ImGui::Separator();
@@ -2410,11 +6087,44 @@ void create_ui(AppState& state) {
   ImGui::Text("init data:");
   ImGui::InputInt("AxA samples", &controls.num_zygote_samples);
   ImGui::InputInt("inactive_node_count", &controls.inactive_node_count);
+  ImGui::InputInt("reorder interval", &controls.reorder_interval);
+  controls.reorder_interval = std::max(controls.reorder_interval, 0);
+  if (state.has_async_compute) {
+    ImGui::Checkbox("async simulation", &controls.async_sim);
+  }
+  if (ImGui::Checkbox("compact nodes", &controls.compact_nodes)) {
+    set_node_format(state, controls.compact_nodes);
+    run_simulation_pipeline(state);
+  }
+
+  ImGui::Text("parameter sweep:");
+  ImGui::InputInt("instances", &controls.num_instances);
+  controls.num_instances = clamp(
+      controls.num_instances, 1, (int) MAX_NUM_INSTANCES);
+  ImGui::InputInt("seed", &controls.seed);
+  controls.seed = std::max(controls.seed, 0);
+  if (controls.num_instances > 1 && !state.compute_unifs.empty()) {
+    ImGui::InputInt("sweep unif", &controls.sweep_unif_index);
+    controls.sweep_unif_index = clamp(controls.sweep_unif_index,
+        0, (int) state.compute_unifs.size() - 1);
+    UserUnif& swept_unif = state.compute_unifs[controls.sweep_unif_index];
+    ImGui::Text("sweeping: %s", swept_unif.name.c_str());
+    ImGui::InputInt("sweep comp", &controls.sweep_comp);
+    controls.sweep_comp = clamp(
+        controls.sweep_comp, 0, swept_unif.num_comps - 1);
+    ImGui::DragFloatRange2("sweep range",
+        &controls.sweep_min, &controls.sweep_max,
+        swept_unif.drag_speed, swept_unif.min_val, swept_unif.max_val);
+  }
+
+  // every instance gets an equal share of the nodes and the queue
+  uint32_t max_instance_nodes = MAX_NUM_VERTICES / controls.num_instances;
   controls.num_zygote_samples = clamp(
-      controls.num_zygote_samples, 2, (int) sqrt(MAX_NUM_VERTICES));
-  uint32_t max_num_inactive_nodes = MAX_NUM_VERTICES -
+      controls.num_zygote_samples, 2, (int) sqrt(max_instance_nodes));
+  uint32_t max_num_inactive_nodes = max_instance_nodes -
     (uint32_t) pow(controls.num_zygote_samples, 2);
-  max_num_inactive_nodes = std::min(max_num_inactive_nodes, MAX_STORAGE_QUEUE_LEN);
+  max_num_inactive_nodes = std::min(max_num_inactive_nodes,
+      MAX_STORAGE_QUEUE_LEN / controls.num_instances);
   controls.inactive_node_count = clamp(
       controls.inactive_node_count, 0, (int) max_num_inactive_nodes);
   
@@ -2424,6 +6134,116 @@ void create_ui(AppState& state) {
   if (ImGui::Button("run once")) {
     run_simulation_pipeline(state);  
   }
+  if (state.sim_job.in_flight) {
+    ImGui::Text("simulating: %u / %u iters",
+        state.sim_job.next_iter, state.sim_job.num_iters);
+  }
+  ImGui::Text("workgroup size: %u", state.workgroup_size);
+  if (ImGui::Button("retune workgroup size")) {
+    tune_workgroup_size(state);
+    run_simulation_pipeline(state);
+  }
+
+  ImGui::Text("recording:");
+  for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+    string label = string("record ") + ATTRIB_NAMES[i];
+    ImGui::Checkbox(label.c_str(), &controls.record_attribs[i]);
+  }
+  ImGui::InputInt("record interval", &controls.record_interval);
+  controls.record_interval = std::max(controls.record_interval, 1);
+  if (trajectory_zstd_supported()) {
+    ImGui::Checkbox("compress", &controls.record_compress);
+  }
+  ImGui::InputText("record path", controls.record_path,
+      sizeof(controls.record_path));
+  if (ImGui::Button("record next run")) {
+    controls.record_next_run = true;
+    run_simulation_pipeline(state);
+  }
+  string record_error = state.traj_writer.first_error();
+  if (state.recording) {
+    if (record_error.empty()) {
+      ImGui::Text("recording: %u frames", state.traj_writer.frame_count());
+    } else {
+      ImGui::Text("recording failed: %s", record_error.c_str());
+    }
+  } else if (controls.record_next_run) {
+    ImGui::Text("recording the next run");
+  } else if (!record_error.empty()) {
+    ImGui::Text("the last recording failed: %s", record_error.c_str());
+  }
+
+  ImGui::Text("playback:");
+  TrajectoryReader& reader = state.traj_reader;
+  if (!reader.is_open()) {
+    ImGui::InputText("playback path", controls.playback_path,
+        sizeof(controls.playback_path));
+    if (ImGui::Button("open trajectory")) {
+      open_trajectory(state);
+    }
+  } else {
+    int last_frame = reader.frame_count() - 1;
+    string play_btn_text(controls.playing_trajectory ?
+        "PAUSE playback" : "PLAY playback");
+    if (ImGui::Button(play_btn_text.c_str())) {
+      controls.playing_trajectory = !controls.playing_trajectory;
+    }
+    if (controls.playing_trajectory) {
+      controls.playback_frame = controls.playback_frame < last_frame ?
+        controls.playback_frame + 1 : 0;
+    }
+    ImGui::SliderInt("frame", &controls.playback_frame, 0, last_frame);
+    controls.playback_frame = clamp(controls.playback_frame, 0, last_frame);
+    const TrajectoryIndexEntry& entry =
+      reader.frame_entry(controls.playback_frame);
+    int seek_iter = entry.iter_num;
+    if (ImGui::InputInt("seek iter", &seek_iter)) {
+      controls.playback_frame = reader.find_frame(std::max(seek_iter, 0));
+    }
+    ImGui::Text("iter %u, %u nodes", entry.iter_num, entry.node_count);
+    if (ImGui::Button("close trajectory")) {
+      close_trajectory(state);
+    } else if (controls.playback_frame != state.shown_traj_frame &&
+        !show_trajectory_frame(state, controls.playback_frame)) {
+      printf("stopped the playback of %s\n", controls.playback_path);
+      close_trajectory(state);
+    }
+  }
+
+  ImGui::Text("export:");
+  ImGui::InputText("export path", controls.export_path,
+      sizeof(controls.export_path));
+  for (int i = 0; i < EXPORT_FORMATS_COUNT; ++i) {
+    if (i > 0) {
+      ImGui::SameLine();
+    }
+    ImGui::RadioButton(EXPORT_FORMAT_NAMES[i], &controls.export_format, i);
+  }
+  if (state.mesh_exporter.busy()) {
+    ImGui::Text("exporting to %s", state.mesh_exporter.last_path.c_str());
+  } else if (ImGui::Button("export mesh")) {
+    export_mesh(state, controls.export_path,
+        (MeshExportFormat) controls.export_format);
+  }
+
+  ImGui::Text("snapshot:");
+  ImGui::InputText("snapshot path", controls.snapshot_path,
+      sizeof(controls.snapshot_path));
+  if (ImGui::Button("save snapshot")) {
+    save_snapshot(state, controls.snapshot_path);
+  }
+  if (ImGui::Button("load snapshot") &&
+      load_snapshot(state, controls.snapshot_path)) {
+    run_simulation_pipeline(state);
+  }
+  if (state.snapshot.is_open()) {
+    ImGui::Text("resuming from iter %u of %s",
+        state.snapshot.header.iter_num, state.snapshot.path.c_str());
+    if (ImGui::Button("unload snapshot")) {
+      unload_snapshot(state);
+      run_simulation_pipeline(state);
+    }
+  }
   ImGui::Text("animation:");
   string anim_btn_text(controls.animating_sim ? "PAUSE" : "PLAY");
   if (ImGui::Button(anim_btn_text.c_str())) {
@@ -2442,7 +6262,11 @@ void create_ui(AppState& state) {
     if (controls.loop_at_end && controls.num_iters == controls.end_iter_num) {
       controls.num_iters = controls.start_iter_num;
     }
-    run_simulation_pipeline(state);
+    // only rerun if the iter num or another input changed, an unchanged
+    // run would give the same nodes
+    if (sim_inputs_key(state) != state.last_sim_inputs) {
+      run_simulation_pipeline(state);
+    }
   }
 
   vector<pair<string, bool*>> log_controls = {
@@ -2470,6 +6294,17 @@ void create_ui(AppState& state) {
   if (ImGui::Button("log buffers")) {
     log_buffers(state);
   }
+  VmaStats mem_stats;
+  vmaCalculateStats(state.allocator, &mem_stats);
+  ImGui::Text("memory: %u blocks, %u allocations, %.1f MB used",
+      mem_stats.total.blockCount, mem_stats.total.allocationCount,
+      mem_stats.total.usedBytes / (1024.0 * 1024.0));
+  if (ImGui::Button("log allocator stats")) {
+    char* stats_str = nullptr;
+    vmaBuildStatsString(state.allocator, &stats_str, VK_TRUE);
+    printf("allocator stats:\n%s\n\n", stats_str);
+    vmaFreeStatsString(state.allocator, stats_str);
+  }
 
   ImGui::Separator();
   ImGui::Text("instructions:");
@@ -2478,6 +6313,131 @@ void create_ui(AppState& state) {
   ImGui::End();
 }
 
+// Picks the node to inspect, the frames then copy it out, see
+// record_node_inspect
+void update_node_inspector(AppState& state) {
+  NodeInspector& inspector = state.inspector;
+  int node_index = state.controls.pin_inspected_node ?
+    inspector.node_index : state.picker.picked_node;
+  if (node_index >= (int) state.node_count) {
+    node_index = -1;
+  }
+  if (node_index != inspector.node_index) {
+    inspector.node_index = node_index;
+    request_redraw(state);
+  }
+}
+
+// Shows the node under the cursor, or the pinned node
+void create_inspector_ui(AppState& state) {
+  Controls& controls = state.controls;
+  NodeInspector& inspector = state.inspector;
+
+  ImGui::Begin("node inspector");
+  ImGui::Checkbox("pick nodes", &controls.pick_nodes);
+  ImGui::SameLine();
+  ImGui::Checkbox("pin", &controls.pin_inspected_node);
+  update_node_inspector(state);
+  if (inspector.node_index < 0) {
+    ImGui::Text("hover over a node to inspect it");
+    ImGui::End();
+    return;
+  }
+  if (inspector.shown_node != inspector.node_index) {
+    ImGui::Text("reading node %d", inspector.node_index);
+    ImGui::End();
+    return;
+  }
+
+  const MorphNode& node = inspector.node;
+  ImGui::Text("node %d of instance %u, iter %u%s", inspector.node_index,
+      inspector.instance_index, state.result_iter_num,
+      node.neighbors[0] == -2.0 ? " (inactive)" : "");
+  array<vec4, ATTRIBUTES_COUNT> attribs = {
+    node.pos, node.vel, node.neighbors, node.data, node.top_data
+  };
+  for (uint32_t i = 0; i < ATTRIBUTES_COUNT; ++i) {
+    ImGui::Text("%-10s %s", ATTRIB_NAMES[i], vec4_str(attribs[i]).c_str());
+  }
+
+  // inspect a neighbor by clicking it, which pins it
+  ImGui::Text("neighbors:");
+  array<const char*, 4> neighbor_names = {"right", "upper", "left", "lower"};
+  for (int j = 0; j < 4; ++j) {
+    int neighbor = (int) node.neighbors[j];
+    ImGui::SameLine();
+    if (neighbor < 0) {
+      ImGui::Text("%s -", neighbor_names[j]);
+      continue;
+    }
+    string label = string(neighbor_names[j]) + " " + to_string(neighbor);
+    ImGui::PushID(j);
+    if (ImGui::SmallButton(label.c_str())) {
+      inspector.node_index = neighbor;
+      controls.pin_inspected_node = true;
+      request_redraw(state);
+    }
+    ImGui::PopID();
+  }
+
+  if (!inspector.has_queue) {
+    ImGui::Text("queue: not read while simulating");
+  } else {
+    // the queue read by even iters and the one by odd iters
+    const QueuePtrs& queue = inspector.queue;
+    for (uint32_t p = 0; p < 2; ++p) {
+      ImGui::Text("queue %u: start %u, end %u, len %u", p,
+          queue.start_ptrs[p], queue.end_ptrs[p],
+          queue.end_ptrs[p] - queue.start_ptrs[p]);
+    }
+  }
+  ImGui::End();
+}
+
+/*
+   Waits until the next frame is due, at controls.target_fps, and
+   measures the frame time.
+   In sim-first mode the wait, and the wait for the frame in flight that
+   the next render reuses (which is where FIFO blocks on vsync), is spent
+   submitting the next async simulation chunks as soon as the previous
+   ones finish, rather than once per frame.
+*/
+void pace_frame(AppState& state) {
+  Controls& controls = state.controls;
+  auto deadline = state.next_frame_deadline;
+  if (controls.sim_first) {
+    VkFence& frame_fence = state.in_flight_fences[state.current_frame];
+    while (state.sim_job.in_flight &&
+        (chrono::steady_clock::now() < deadline ||
+         vkGetFenceStatus(state.device, frame_fence) == VK_NOT_READY)) {
+      poll_simulation(state);
+      std::this_thread::sleep_for(
+          chrono::microseconds(SIM_FIRST_POLL_MICROS));
+    }
+  }
+  std::this_thread::sleep_until(deadline);
+
+  auto now = chrono::steady_clock::now();
+  float secs = std::min(MAX_FRAME_SECS,
+      chrono::duration<float>(now - state.frame_start).count());
+  state.frame_start = now;
+  // smoothed so that the readout and the camera speed don't jitter
+  state.frame_secs = glm::mix(state.frame_secs, secs, 0.1f);
+
+  if (controls.target_fps > 0) {
+    auto frame_dur = chrono::duration_cast<chrono::steady_clock::duration>(
+        chrono::duration<double>(1.0 / controls.target_fps));
+    // keep to the schedule, unless a frame ran long, then restart it
+    // rather than rushing the next frames to catch up
+    state.next_frame_deadline = deadline + frame_dur;
+    if (state.next_frame_deadline < now) {
+      state.next_frame_deadline = now + frame_dur;
+    }
+  } else {
+    state.next_frame_deadline = now;
+  }
+}
+
 void main_loop(AppState& state) {
   IMGUI_CHECKVERSION();
   ImGui::CreateContext();
@@ -2497,12 +6457,26 @@ void main_loop(AppState& state) {
     .ImageCount = state.target_image_count,
     .CheckVkResultFn = check_vk_result
   };
-  ImGui_ImplVulkan_Init(&init_info, state.render_pass);
+  ImGui_ImplVulkan_Init(&init_info, state.ui_render_pass);
   upload_imgui_fonts(state);
 
   state.current_frame = 0;
+  state.frame_start = chrono::steady_clock::now();
+  state.next_frame_deadline = state.frame_start;
+  request_redraw(state);
   while (!glfwWindowShouldClose(state.win)) {
-    glfwPollEvents();
+    pace_frame(state);
+    // block until there's input if nothing is changing by itself
+    Controls& controls = state.controls;
+    bool idle = state.redraw_frames == 0 && !state.sim_job.in_flight &&
+      !controls.playing_trajectory &&
+      !(controls.animating_sim && controls.delta_iters != 0) &&
+      !state.mesh_exporter.busy();
+    if (idle) {
+      glfwWaitEventsTimeout(IDLE_WAIT_SECS);
+    } else {
+      glfwPollEvents();
+    }
 
     update_camera(state);
 
@@ -2510,12 +6484,24 @@ void main_loop(AppState& state) {
     ImGui_ImplGlfw_NewFrame();
     ImGui::NewFrame();
 
+    poll_simulation(state);
     create_ui(state);
+    create_inspector_ui(state);
     ImGui::Render();
 
-    render_frame(state);
+    // skip the frame if nothing changed, the last presented image stays
+    // on screen
+    if (state.redraw_frames > 0) {
+      state.redraw_frames -= 1;
+      render_frame(state);
+    }
   }
   vkDeviceWaitIdle(state.device);
+  if (state.sim_job.in_flight) {
+    vkFreeCommandBuffers(state.device, state.compute_cmd_pool,
+        1, &state.sim_job.cmd_buffer);
+    state.sim_job.in_flight = false;
+  }
 
   ImGui_ImplVulkan_Shutdown();
   ImGui_ImplGlfw_Shutdown();
@@ -2529,19 +6515,25 @@ void cleanup_state(AppState& state) {
   glfwTerminate();
 }
 
-void run_app(int argc, char** argv) {
-  signal(SIGSEGV, handle_segfault);
-
-  // setup the environment for the vulkan loader
-  char icd_env_entry[] = ENV_VK_ICD_FILENAMES;
-  char layer_env_entry[] = ENV_VK_LAYER_PATH;
+// setup the environment for the vulkan loader
+void setup_loader_env() {
+  static char icd_env_entry[] = ENV_VK_ICD_FILENAMES;
+  static char layer_env_entry[] = ENV_VK_LAYER_PATH;
   putenv(icd_env_entry);
   putenv(layer_env_entry);
+}
+
+void run_app(int argc, char** argv) {
+  signal(SIGSEGV, handle_segfault);
+  setup_loader_env();
 
   AppState state;
 
   init_glfw(state);
   init_vulkan(state);
+  if (!state.workgroup_size_tuned) {
+    tune_workgroup_size(state);
+  }
   
   main_loop(state);
   cleanup_state(state);
@@ -0,0 +1,195 @@
+#include "export.h"
+
+#include <cstdarg>
+#include <cstring>
+
+// the output is formatted into blocks of this size before being written
+const size_t EXPORT_BLOCK_SIZE = 4 * 1024 * 1024;
+
+/*
+   Accumulates the output in a large block and writes it out once full,
+   so that the formatting doesn't make a write call per value.
+*/
+struct ExportWriter {
+  FILE* file;
+  vector<char> block;
+  bool ok = true;
+
+  ExportWriter(FILE* file) : file(file) {
+    block.reserve(EXPORT_BLOCK_SIZE);
+  }
+
+  void flush() {
+    ok = ok && fwrite(block.data(), 1, block.size(), file) == block.size();
+    block.clear();
+  }
+
+  void write(const void* data, size_t size) {
+    if (block.size() + size > EXPORT_BLOCK_SIZE) {
+      flush();
+    }
+    const char* bytes = (const char*) data;
+    block.insert(block.end(), bytes, bytes + size);
+  }
+
+  template <typename T>
+  void write_value(T value) {
+    write(&value, sizeof(value));
+  }
+
+  void print(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+    array<char, 256> line;
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line.data(), line.size(), format, args);
+    va_end(args);
+    write(line.data(), std::min((size_t) len, line.size() - 1));
+  }
+};
+
+// Maps the node indices to the indices of the active nodes, returns the
+// number of active nodes
+uint32_t compact_node_indices(const MeshExportData& data,
+    vector<uint32_t>& out_new_indices) {
+  uint32_t num_active = 0;
+  out_new_indices.resize(data.positions.size());
+  for (uint32_t i = 0; i < data.positions.size(); ++i) {
+    out_new_indices[i] = data.active[i] ? num_active++ : 0;
+  }
+  return num_active;
+}
+
+// Returns the primitives whose nodes are all active, remapped
+vector<uint32_t> compact_prims(const MeshExportData& data,
+    const vector<uint32_t>& new_indices, const vector<uint32_t>& indices,
+    uint32_t prim_size) {
+  vector<uint32_t> out_indices;
+  out_indices.reserve(indices.size());
+  for (size_t i = 0; i + prim_size <= indices.size(); i += prim_size) {
+    bool all_active = true;
+    for (uint32_t j = 0; j < prim_size; ++j) {
+      all_active = all_active && data.active[indices[i + j]];
+    }
+    if (all_active) {
+      for (uint32_t j = 0; j < prim_size; ++j) {
+        out_indices.push_back(new_indices[indices[i + j]]);
+      }
+    }
+  }
+  return out_indices;
+}
+
+void write_ply(ExportWriter& out, const MeshExportData& data,
+    uint32_t num_active, const vector<uint32_t>& lines,
+    const vector<uint32_t>& triangles) {
+  out.print("ply\n");
+  out.print("format binary_little_endian 1.0\n");
+  out.print("comment mesh_morph nodes after %u iters\n", data.iter_num);
+  out.print("element vertex %u\n", num_active);
+  out.print("property float x\n");
+  out.print("property float y\n");
+  out.print("property float z\n");
+  out.print("property float heat\n");
+  out.print("property float source\n");
+  out.print("element edge %u\n", (uint32_t) lines.size() / 2);
+  out.print("property int vertex1\n");
+  out.print("property int vertex2\n");
+  out.print("element face %u\n", (uint32_t) triangles.size() / 3);
+  out.print("property list uchar int vertex_indices\n");
+  out.print("end_header\n");
+
+  for (uint32_t i = 0; i < data.positions.size(); ++i) {
+    if (!data.active[i]) {
+      continue;
+    }
+    out.write(&data.positions[i], sizeof(vec4));
+    out.write_value(data.sources[i]);
+  }
+  out.write(lines.data(), sizeof(uint32_t) * lines.size());
+  for (size_t i = 0; i < triangles.size(); i += 3) {
+    out.write_value((uint8_t) 3);
+    out.write(&triangles[i], sizeof(uint32_t) * 3);
+  }
+}
+
+void write_obj(ExportWriter& out, const MeshExportData& data,
+    const vector<uint32_t>& lines, const vector<uint32_t>& triangles) {
+  // OBJ has no place for the heat and source strength, see the PLY export
+  out.print("# mesh_morph nodes after %u iters\n", data.iter_num);
+  for (uint32_t i = 0; i < data.positions.size(); ++i) {
+    if (data.active[i]) {
+      vec4 pos = data.positions[i];
+      out.print("v %.6g %.6g %.6g\n", pos.x, pos.y, pos.z);
+    }
+  }
+  // OBJ indices are 1-based
+  for (size_t i = 0; i < lines.size(); i += 2) {
+    out.print("l %u %u\n", lines[i] + 1, lines[i + 1] + 1);
+  }
+  for (size_t i = 0; i < triangles.size(); i += 3) {
+    out.print("f %u %u %u\n",
+        triangles[i] + 1, triangles[i + 1] + 1, triangles[i + 2] + 1);
+  }
+}
+
+bool write_mesh_file(const string& path, MeshExportFormat format,
+    const MeshExportData& data) {
+  vector<uint32_t> new_indices;
+  uint32_t num_active = compact_node_indices(data, new_indices);
+  vector<uint32_t> lines = compact_prims(
+      data, new_indices, data.line_indices, 2);
+  vector<uint32_t> triangles = compact_prims(
+      data, new_indices, data.triangle_indices, 3);
+
+  string tmp_path = path + ".tmp";
+  FILE* file = fopen(tmp_path.c_str(), "wb");
+  if (!file) {
+    printf("cannot open the export file %s\n", tmp_path.c_str());
+    return false;
+  }
+  ExportWriter out(file);
+  if (format == EXPORT_PLY) {
+    write_ply(out, data, num_active, lines, triangles);
+  } else {
+    write_obj(out, data, lines, triangles);
+  }
+  out.flush();
+  bool ok = fclose(file) == 0 && out.ok;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    printf("failed to write the export file %s\n", path.c_str());
+    remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool MeshExporter::start(const string& path, MeshExportFormat format,
+    MeshExportData data) {
+  if (running) {
+    return false;
+  }
+  if (worker.joinable()) {
+    worker.join();
+  }
+  running = true;
+  last_path = path;
+  worker = thread([this, path, format](MeshExportData data) {
+    bool succeeded = write_mesh_file(path, format, data);
+    if (succeeded) {
+      printf("exported the mesh to %s\n", path.c_str());
+    }
+    last_succeeded = succeeded;
+    running = false;
+  }, std::move(data));
+  return true;
+}
+
+void MeshExporter::wait() {
+  if (worker.joinable()) {
+    worker.join();
+  }
+}
+
+MeshExporter::~MeshExporter() {
+  wait();
+}
@@ -0,0 +1,557 @@
+#include "farm.h"
+#include "app.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <deque>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <csignal>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// a job that was running on a worker that died is retried this many times
+const uint32_t MAX_FARM_JOB_ATTEMPTS = 2;
+// the threads per worker that write the thumbnails. There is already a
+// worker per core, so this only overlaps the writes with the next job.
+const uint32_t FARM_PNG_THREADS = 2;
+const char* FARM_METRICS_HEADER =
+  "name,seed,iters,active_nodes,edges,sources,total_heat,sim_ms";
+
+// The name is used in the output paths, so it must stay in out_dir
+bool is_valid_job_name(const string& name) {
+  return name.find('/') == string::npos &&
+    name.find("..") == string::npos;
+}
+
+bool parse_farm_job(const string& line, FarmJob& out_job) {
+  FarmJob job;
+  job.spec = line;
+  istringstream tokens(line);
+  if (!(tokens >> job.name) || job.name[0] == '#') {
+    return false;
+  }
+  if (!is_valid_job_name(job.name)) {
+    printf("job %s: the name cannot contain '/' or '..'\n",
+        job.name.c_str());
+    return false;
+  }
+  string token;
+  while (tokens >> token) {
+    size_t eq_pos = token.find('=');
+    if (eq_pos == string::npos) {
+      printf("job %s: expected key=value, got %s\n",
+          job.name.c_str(), token.c_str());
+      return false;
+    }
+    string key = token.substr(0, eq_pos);
+    string value = token.substr(eq_pos + 1);
+    // the number conversions throw on malformed values
+    try {
+      if (key == "seed") {
+        job.seed = stoul(value);
+      } else if (key == "iters") {
+        job.num_iters = stoul(value);
+      } else if (key == "samples") {
+        job.num_zygote_samples = stoi(value);
+      } else if (key == "inactive") {
+        job.inactive_node_count = stoi(value);
+      } else if (key == "resume") {
+        job.resume_path = value;
+      } else if (key == "checkpoint") {
+        job.checkpoint = stoi(value) != 0;
+      } else if (key == "views") {
+        job.num_views = stoul(value);
+        if (job.num_views < 1 || job.num_views > MAX_THUMBNAIL_VIEWS) {
+          printf("job %s: views must be 1 to %u\n",
+              job.name.c_str(), MAX_THUMBNAIL_VIEWS);
+          return false;
+        }
+      } else if (key == "view_size") {
+        job.view_size = stoul(value);
+        if (job.view_size < 1 || job.view_size > MAX_THUMBNAIL_SIZE) {
+          printf("job %s: view_size must be 1 to %u\n",
+              job.name.c_str(), MAX_THUMBNAIL_SIZE);
+          return false;
+        }
+      } else {
+        // a compute unif, with up to four comma separated comps
+        vec4 val(0.0f);
+        istringstream comps(value);
+        string comp;
+        for (int i = 0; i < 4 && getline(comps, comp, ','); ++i) {
+          val[i] = stof(comp);
+        }
+        job.unif_vals.push_back({key, val});
+      }
+    } catch (const std::exception&) {
+      printf("job %s: bad value for %s: %s\n",
+          job.name.c_str(), key.c_str(), value.c_str());
+      return false;
+    }
+  }
+  out_job = std::move(job);
+  return true;
+}
+
+bool file_exists(const string& path) {
+  return access(path.c_str(), F_OK) == 0;
+}
+
+string farm_job_path(const string& out_dir, const string& name,
+    const char* ext) {
+  return out_dir + "/" + name + ext;
+}
+
+// Sends the line and a newline, returns false if the peer is gone
+bool send_line(int fd, const string& line) {
+  string msg = line + "\n";
+  size_t sent = 0;
+  while (sent < msg.size()) {
+    ssize_t n = send(fd, msg.data() + sent, msg.size() - sent, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+// Moves the first complete line in buf to out_line
+bool pop_line(string& buf, string& out_line) {
+  size_t end = buf.find('\n');
+  if (end == string::npos) {
+    return false;
+  }
+  out_line = buf.substr(0, end);
+  buf.erase(0, end + 1);
+  return true;
+}
+
+// Reads from fd into buf, returns false on EOF or error
+bool recv_some(int fd, string& buf) {
+  char chunk[4096];
+  ssize_t n = 0;
+  do {
+    n = recv(fd, chunk, sizeof(chunk), 0);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    return false;
+  }
+  buf.append(chunk, n);
+  return true;
+}
+
+// Blocks until a full line arrives, returns false if the peer is gone
+bool read_line(int fd, string& buf, string& out_line) {
+  while (!pop_line(buf, out_line)) {
+    if (!recv_some(fd, buf)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool make_socket_addr(const string& sock_path, sockaddr_un& out_addr) {
+  memset(&out_addr, 0, sizeof(out_addr));
+  out_addr.sun_family = AF_UNIX;
+  if (sock_path.size() >= sizeof(out_addr.sun_path)) {
+    printf("socket path is too long: %s\n", sock_path.c_str());
+    return false;
+  }
+  strcpy(out_addr.sun_path, sock_path.c_str());
+  return true;
+}
+
+// Writes the nodes as the node count followed by each attribute array.
+// The file is renamed into place once complete.
+bool write_nodes_file(const string& path, MorphNodes& node_vecs) {
+  string tmp_path = path + ".tmp";
+  FILE* file = fopen(tmp_path.c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  uint32_t node_count = node_vecs.pos_vec.size();
+  bool ok = fwrite(&node_count, sizeof(node_count), 1, file) == 1;
+  for (vector<vec4>* attrib_vec : node_vecs.attrib_vecs()) {
+    ok = ok && fwrite(attrib_vec->data(), sizeof(vec4),
+        node_count, file) == node_count;
+  }
+  ok = fclose(file) == 0 && ok;
+  return ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+// The metrics row of a finished job, see FARM_METRICS_HEADER
+string farm_metrics_row(const FarmJob& job, MorphNodes& node_vecs,
+    double sim_ms) {
+  uint32_t active_nodes = 0;
+  uint32_t edge_ends = 0;
+  uint32_t sources = 0;
+  double total_heat = 0.0;
+  for (uint32_t i = 0; i < node_vecs.pos_vec.size(); ++i) {
+    vec4 neighbors = node_vecs.neighbors_vec[i];
+    if (neighbors[0] == -2.0) {
+      continue;
+    }
+    active_nodes += 1;
+    for (int j = 0; j < 4; ++j) {
+      edge_ends += neighbors[j] != -1.0 ? 1 : 0;
+    }
+    sources += node_vecs.vel_vec[i].w != 0.0 ? 1 : 0;
+    total_heat += node_vecs.pos_vec[i].w;
+  }
+  array<char, 256> row;
+  snprintf(row.data(), row.size(), "%s,%u,%u,%u,%u,%u,%.6f,%.3f",
+      job.name.c_str(), job.seed, job.num_iters, active_nodes,
+      edge_ends / 2, sources, total_heat, sim_ms);
+  return string(row.data());
+}
+
+// Runs the job and writes its nodes and thumbnails, returns the reply for
+// the driver
+string run_farm_job(AppState& state, const FarmJob& job,
+    const string& out_dir, PngWriterPool& png_pool) {
+  string failed_reply = "failed " + job.name;
+  int samples = job.num_zygote_samples;
+  if (samples < 2 || job.inactive_node_count < 0 ||
+      (uint32_t) (samples * samples + job.inactive_node_count) >
+        MAX_NUM_VERTICES ||
+      (uint32_t) job.inactive_node_count > MAX_STORAGE_QUEUE_LEN) {
+    printf("job %s: too many nodes\n", job.name.c_str());
+    return failed_reply;
+  }
+  Controls& controls = state.controls;
+  controls.num_zygote_samples = samples;
+  controls.inactive_node_count = job.inactive_node_count;
+  controls.num_iters = job.num_iters;
+  controls.seed = job.seed;
+  controls.num_instances = 1;
+
+  reset_compute_unifs(state);
+  for (auto& unif_val : job.unif_vals) {
+    if (!set_compute_unif(state, unif_val.first, unif_val.second)) {
+      printf("job %s: no compute unif named %s\n",
+          job.name.c_str(), unif_val.first.c_str());
+      return failed_reply;
+    }
+  }
+
+  if (!job.resume_path.empty()) {
+    if (!load_snapshot(state, job.resume_path)) {
+      return failed_reply;
+    }
+    controls.num_iters = job.num_iters;
+  }
+
+  auto start_time = chrono::steady_clock::now();
+  MorphNodes node_vecs = run_headless_simulation(state);
+  double sim_ms = chrono::duration<double, milli>(
+      chrono::steady_clock::now() - start_time).count();
+  // the thumbnails render while the nodes are written
+  bool rendering = job.num_views > 0 &&
+    start_thumbnails(state, node_vecs, job.num_views, job.view_size);
+  unload_snapshot(state);
+
+  if (job.checkpoint && !save_snapshot(state,
+        farm_job_path(out_dir, job.name, ".snap"))) {
+    printf("job %s: failed to write the snapshot\n", job.name.c_str());
+    return failed_reply;
+  }
+
+  if (!write_nodes_file(farm_job_path(out_dir, job.name, ".nodes"),
+        node_vecs)) {
+    printf("job %s: failed to write the nodes\n", job.name.c_str());
+    return failed_reply;
+  }
+
+  // the job is only done once its images are written
+  if (rendering) {
+    finish_thumbnails(state,
+        farm_job_path(out_dir, job.name, ""), png_pool);
+    if (png_pool.wait() > 0) {
+      printf("job %s: failed to write the thumbnails\n", job.name.c_str());
+      return failed_reply;
+    }
+  }
+  return "done " + farm_metrics_row(job, node_vecs, sim_ms);
+}
+
+/*
+   A worker process. It asks the driver for jobs until told to quit.
+   Messages are lines: the worker sends "ready" once, then "done <row>"
+   or "failed <name>" per job; the driver sends "job <spec>" or "quit".
+*/
+int run_farm_worker(const string& sock_path, uint32_t worker_index,
+    const string& out_dir) {
+  sockaddr_un addr;
+  if (!make_socket_addr(sock_path, addr)) {
+    return 1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0) {
+    printf("worker %u: cannot connect to %s\n",
+        worker_index, sock_path.c_str());
+    return 1;
+  }
+
+  AppState state;
+  init_vulkan_headless(state, worker_index);
+  PngWriterPool png_pool;
+  png_pool.start(FARM_PNG_THREADS);
+
+  string buf, line;
+  bool connected = send_line(fd, "ready");
+  while (connected && read_line(fd, buf, line)) {
+    if (line == "quit") {
+      break;
+    }
+    FarmJob job;
+    string reply = "failed ?";
+    if (line.compare(0, 4, "job ") == 0 &&
+        parse_farm_job(line.substr(4), job)) {
+      reply = run_farm_job(state, job, out_dir, png_pool);
+    }
+    connected = send_line(fd, reply);
+  }
+  close(fd);
+
+  vkDeviceWaitIdle(state.device);
+  cleanup_vulkan(state);
+  return 0;
+}
+
+// The jobs whose results are not yet in out_dir
+deque<FarmJob> read_pending_farm_jobs(const FarmOptions& options,
+    uint32_t& out_num_done) {
+  deque<FarmJob> jobs;
+  out_num_done = 0;
+  FILE* file = fopen(options.jobs_path.c_str(), "r");
+  if (!file) {
+    printf("cannot open the jobs file %s\n", options.jobs_path.c_str());
+    return jobs;
+  }
+  array<char, 4096> line_buf;
+  while (fgets(line_buf.data(), line_buf.size(), file)) {
+    string line(line_buf.data());
+    line.erase(line.find_last_not_of("\r\n") + 1);
+    FarmJob job;
+    if (!parse_farm_job(line, job)) {
+      continue;
+    }
+    if (file_exists(farm_job_path(options.out_dir, job.name, ".done"))) {
+      out_num_done += 1;
+    } else {
+      jobs.push_back(std::move(job));
+    }
+  }
+  fclose(file);
+  return jobs;
+}
+
+// A connected worker, and the job it is running (or -1). A worker that
+// asks for a job while there's none is kept waiting until no job can be
+// requeued, then told to quit.
+struct FarmConn {
+  int fd = -1;
+  string buf;
+  int job_index = -1;
+  bool waiting = false;
+  bool quit_sent = false;
+};
+
+int run_farm(const FarmOptions& options) {
+  mkdir(options.out_dir.c_str(), 0755);
+
+  uint32_t num_done = 0;
+  deque<FarmJob> pending = read_pending_farm_jobs(options, num_done);
+  uint32_t num_jobs = pending.size();
+  printf("farm: %u jobs to run, %u already done\n", num_jobs, num_done);
+  if (num_jobs == 0) {
+    return 0;
+  }
+
+  string metrics_path = options.out_dir + "/metrics.csv";
+  bool has_header = file_exists(metrics_path);
+  FILE* metrics_file = fopen(metrics_path.c_str(), "a");
+  assert(metrics_file);
+  if (!has_header) {
+    fprintf(metrics_file, "%s\n", FARM_METRICS_HEADER);
+  }
+
+  string sock_path = options.out_dir + "/farm.sock";
+  sockaddr_un addr;
+  if (!make_socket_addr(sock_path, addr)) {
+    return num_jobs;
+  }
+  unlink(sock_path.c_str());
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(listen_fd >= 0);
+  int res = ::bind(listen_fd, (sockaddr*) &addr, sizeof(addr));
+  assert(res == 0);
+  res = listen(listen_fd, options.num_workers);
+  assert(res == 0);
+
+  // a worker that dies must not kill the driver on the next send
+  signal(SIGPIPE, SIG_IGN);
+  // the workers must not inherit unwritten output
+  fflush(metrics_file);
+  fflush(stdout);
+  uint32_t live_workers = 0;
+  uint32_t num_spawned = 0;
+  auto spawn_worker = [&]() {
+    uint32_t i = num_spawned++;
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(listen_fd);
+      _exit(run_farm_worker(sock_path, i, options.out_dir));
+    } else if (pid > 0) {
+      live_workers += 1;
+    } else {
+      printf("farm: fork failed for worker %u\n", i);
+    }
+  };
+  uint32_t num_workers = std::min(options.num_workers, num_jobs);
+  for (uint32_t i = 0; i < num_workers; ++i) {
+    spawn_worker();
+  }
+
+  // jobs are indexed by their position in all_jobs
+  vector<FarmJob> all_jobs(pending.begin(), pending.end());
+  vector<uint32_t> attempts(num_jobs, 0);
+  deque<uint32_t> job_queue;
+  for (uint32_t i = 0; i < num_jobs; ++i) {
+    job_queue.push_back(i);
+  }
+  uint32_t num_completed = 0;
+  uint32_t num_failed = 0;
+  // a worker is respawned at most once per requeued job
+  uint32_t num_requeued = 0;
+  uint32_t num_respawned = 0;
+
+  // hands the connection its next job, or leaves it waiting for one
+  auto assign_job = [&](FarmConn& conn) {
+    conn.job_index = -1;
+    conn.waiting = job_queue.empty();
+    if (conn.waiting) {
+      return;
+    }
+    conn.job_index = job_queue.front();
+    job_queue.pop_front();
+    attempts[conn.job_index] += 1;
+    send_line(conn.fd, "job " + all_jobs[conn.job_index].spec);
+  };
+
+  vector<FarmConn> conns;
+  while (live_workers > 0 || !conns.empty()) {
+    vector<pollfd> poll_fds = {{listen_fd, POLLIN, 0}};
+    for (FarmConn& conn : conns) {
+      poll_fds.push_back({conn.fd, POLLIN, 0});
+    }
+    // wake up periodically to reap workers that died before connecting
+    poll(poll_fds.data(), poll_fds.size(), 1000);
+
+    if (poll_fds[0].revents & POLLIN) {
+      int fd = accept(listen_fd, nullptr, nullptr);
+      if (fd >= 0) {
+        FarmConn conn;
+        conn.fd = fd;
+        conns.push_back(conn);
+      }
+    }
+    for (uint32_t i = 1; i < poll_fds.size(); ++i) {
+      if (!poll_fds[i].revents) {
+        continue;
+      }
+      FarmConn& conn = conns[i - 1];
+      bool connected = recv_some(conn.fd, conn.buf);
+      string line;
+      while (connected && pop_line(conn.buf, line)) {
+        if (line.compare(0, 5, "done ") == 0 && conn.job_index >= 0) {
+          const FarmJob& job = all_jobs[conn.job_index];
+          fprintf(metrics_file, "%s\n", line.substr(5).c_str());
+          fflush(metrics_file);
+          FILE* marker = fopen(
+              farm_job_path(options.out_dir, job.name, ".done").c_str(), "w");
+          if (marker) {
+            fclose(marker);
+          }
+          num_completed += 1;
+          printf("farm: %u / %u done (%s)\n",
+              num_completed, num_jobs, job.name.c_str());
+        } else if (line.compare(0, 7, "failed ") == 0 &&
+            conn.job_index >= 0) {
+          num_failed += 1;
+          printf("farm: job %s failed\n",
+              all_jobs[conn.job_index].name.c_str());
+        }
+        assign_job(conn);
+      }
+      if (!connected) {
+        // the worker quit or died, requeue the job it was running
+        if (conn.job_index >= 0) {
+          if (attempts[conn.job_index] < MAX_FARM_JOB_ATTEMPTS) {
+            job_queue.push_back(conn.job_index);
+            num_requeued += 1;
+          } else {
+            num_failed += 1;
+            printf("farm: job %s failed, its worker died\n",
+                all_jobs[conn.job_index].name.c_str());
+          }
+        }
+        close(conn.fd);
+        conn.fd = -1;
+      }
+    }
+    conns.erase(std::remove_if(conns.begin(), conns.end(),
+          [](const FarmConn& conn) { return conn.fd < 0; }), conns.end());
+
+    int status = 0;
+    while (live_workers > 0 && waitpid(-1, &status, WNOHANG) > 0) {
+      live_workers -= 1;
+    }
+
+    // a requeued job goes to a waiting worker, or to a new one if every
+    // worker is gone
+    bool any_running = false;
+    for (FarmConn& conn : conns) {
+      if (conn.waiting && !conn.quit_sent) {
+        assign_job(conn);
+      }
+      any_running = any_running || conn.job_index >= 0;
+    }
+    if (!job_queue.empty() && live_workers == 0 &&
+        num_respawned < num_requeued) {
+      num_respawned += 1;
+      spawn_worker();
+    }
+    // the waiting workers are only let go once no job can come back
+    if (job_queue.empty() && !any_running) {
+      for (FarmConn& conn : conns) {
+        if (conn.waiting && !conn.quit_sent) {
+          send_line(conn.fd, "quit");
+          conn.quit_sent = true;
+        }
+      }
+    }
+  }
+
+  close(listen_fd);
+  unlink(sock_path.c_str());
+  fclose(metrics_file);
+
+  // jobs left in the queue had no worker left to run them
+  num_failed += job_queue.size();
+  printf("farm: %u done, %u failed\n", num_completed, num_failed);
+  return num_failed;
+}
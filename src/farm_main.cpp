@@ -0,0 +1,36 @@
+#include <stdlib.h>
+#include <csignal>
+#include <algorithm>
+#include "app.h"
+#include "farm.h"
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    printf("Incorrect usage. Please use:\n\n"
+        "morph_farm jobs_file out_dir [num_workers]\n\n"
+        "where num_workers defaults to the number of cores. "
+        "See farm.h for the jobs file format.\n");
+    return 1;
+  }
+  signal(SIGSEGV, handle_segfault);
+  setup_loader_env();
+
+  FarmOptions options;
+  options.jobs_path = argv[1];
+  options.out_dir = argv[2];
+  long num_workers = std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+  if (argc > 3) {
+    char* end = nullptr;
+    num_workers = strtol(argv[3], &end, 10);
+    if (end == argv[3] || *end != '\0' || num_workers < 1 ||
+        num_workers > 1024) {
+      printf("num_workers must be a number from 1 to 1024, got %s\n",
+          argv[3]);
+      return 1;
+    }
+  }
+  options.num_workers = (uint32_t) num_workers;
+
+  int num_failed = run_farm(options);
+  return num_failed == 0 ? 0 : 1;
+}
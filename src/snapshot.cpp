@@ -0,0 +1,113 @@
+#include "snapshot.h"
+
+#include <cassert>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool write_snapshot_file(const string& path, SnapshotHeader header,
+    const array<SnapshotSectionData, SNAPSHOT_SECTIONS_COUNT>& sections) {
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  uint64_t offset = sizeof(header);
+  for (uint32_t i = 0; i < SNAPSHOT_SECTIONS_COUNT; ++i) {
+    // keep the sections aligned for the vec4 data
+    offset = (offset + 15) / 16 * 16;
+    header.section_offsets[i] = offset;
+    header.section_sizes[i] = sections[i].size;
+    offset += sections[i].size;
+  }
+
+  string tmp_path = path + ".tmp";
+  FILE* file = fopen(tmp_path.c_str(), "wb");
+  if (!file) {
+    printf("cannot open the snapshot file %s\n", tmp_path.c_str());
+    return false;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  for (uint32_t i = 0; i < SNAPSHOT_SECTIONS_COUNT && ok; ++i) {
+    ok = fseeko(file, header.section_offsets[i], SEEK_SET) == 0 &&
+      fwrite(sections[i].data, 1, sections[i].size, file) ==
+        sections[i].size;
+  }
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    printf("failed to write the snapshot file %s\n", path.c_str());
+    remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool SnapshotFile::open(const string& snapshot_path) {
+  assert(!is_open());
+  path = snapshot_path;
+  fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    printf("cannot open the snapshot file %s\n", path.c_str());
+    return false;
+  }
+  struct stat file_stat;
+  fstat(fd, &file_stat);
+  map_size = file_stat.st_size;
+  const char* error = nullptr;
+  if (map_size < sizeof(SnapshotHeader)) {
+    error = "is not a snapshot file";
+  } else {
+    void* mapping = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+      error = "cannot be mapped";
+    } else {
+      map_data = (const char*) mapping;
+      memcpy(&header, map_data, sizeof(header));
+    }
+  }
+
+  if (!error && (memcmp(header.magic, SNAPSHOT_MAGIC,
+          sizeof(header.magic)) != 0 ||
+        header.version != SNAPSHOT_VERSION)) {
+    error = "is not a snapshot file of this version";
+  }
+  for (uint32_t i = 0; i < SNAPSHOT_SECTIONS_COUNT && !error; ++i) {
+    if (header.section_offsets[i] > map_size ||
+        header.section_sizes[i] > map_size - header.section_offsets[i]) {
+      error = "is truncated";
+    }
+  }
+  if (error) {
+    printf("snapshot file %s %s\n", path.c_str(), error);
+    close();
+    return false;
+  }
+  return true;
+}
+
+void SnapshotFile::close() {
+  if (map_data) {
+    munmap((void*) map_data, map_size);
+    map_data = nullptr;
+  }
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+SnapshotFile::~SnapshotFile() {
+  close();
+}
+
+const char* SnapshotFile::section(SnapshotSection section_index) const {
+  return map_data + header.section_offsets[section_index];
+}
+
+uint64_t SnapshotFile::section_size(SnapshotSection section_index) const {
+  return header.section_sizes[section_index];
+}
+
+string SnapshotFile::unif_name(uint32_t unif_index) const {
+  const char* name = section(SNAPSHOT_UNIF_NAMES) +
+    unif_index * SNAPSHOT_UNIF_NAME_LEN;
+  return string(name, strnlen(name, SNAPSHOT_UNIF_NAME_LEN));
+}
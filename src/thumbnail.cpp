@@ -0,0 +1,337 @@
+#include "thumbnail.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+const uint8_t PNG_SIGNATURE[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+// the LZ77 window of deflate, and its shortest and longest matches
+const uint32_t DEFLATE_WINDOW = 32768;
+const uint32_t DEFLATE_MIN_MATCH = 3;
+const uint32_t DEFLATE_MAX_MATCH = 258;
+// the match finder hashes the next 3 bytes, and tries at most this many
+// earlier positions with the same hash
+const uint32_t LZ_HASH_BITS = 15;
+const uint32_t LZ_MAX_CHAIN = 16;
+
+// the first length of each length code from 257, and its extra bits
+const array<uint16_t, 29> DEFLATE_LEN_BASE = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+const array<uint8_t, 29> DEFLATE_LEN_EXTRA = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+// the first distance of each distance code, and its extra bits
+const array<uint16_t, 30> DEFLATE_DIST_BASE = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+  16385, 24577
+};
+const array<uint8_t, 30> DEFLATE_DIST_EXTRA = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+uint32_t png_crc32(const uint8_t* data, size_t size, uint32_t crc) {
+  static array<uint32_t, 256> table = [] {
+    array<uint32_t, 256> t;
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      }
+      t[i] = c;
+    }
+    return t;
+  }();
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i) {
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+void append_u32_be(vector<uint8_t>& out, uint32_t v) {
+  out.insert(out.end(), {
+    (uint8_t) (v >> 24), (uint8_t) (v >> 16), (uint8_t) (v >> 8), (uint8_t) v
+  });
+}
+
+// Appends a chunk: the length, type, data and the CRC of type and data
+void append_png_chunk(vector<uint8_t>& out, const char* type,
+    const vector<uint8_t>& data) {
+  append_u32_be(out, data.size());
+  size_t type_start = out.size();
+  out.insert(out.end(), type, type + 4);
+  out.insert(out.end(), data.begin(), data.end());
+  append_u32_be(out, png_crc32(
+        out.data() + type_start, out.size() - type_start, 0));
+}
+
+// Writes the bits of a deflate stream, least significant first
+struct DeflateBits {
+  vector<uint8_t>& out;
+  uint64_t bits = 0;
+  uint32_t count = 0;
+
+  DeflateBits(vector<uint8_t>& out) : out(out) {}
+
+  void put(uint32_t value, uint32_t n) {
+    bits |= (uint64_t) value << count;
+    count += n;
+    while (count >= 8) {
+      out.push_back((uint8_t) bits);
+      bits >>= 8;
+      count -= 8;
+    }
+  }
+
+  // the Huffman codes are packed from their most significant bit
+  void put_code(uint32_t code, uint32_t n) {
+    uint32_t reversed = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+      reversed |= ((code >> i) & 1) << (n - 1 - i);
+    }
+    put(reversed, n);
+  }
+
+  void flush() {
+    if (count > 0) {
+      out.push_back((uint8_t) bits);
+    }
+    bits = 0;
+    count = 0;
+  }
+};
+
+// A literal/length symbol in the fixed Huffman code
+void put_fixed_symbol(DeflateBits& bits, uint32_t symbol) {
+  if (symbol < 144) {
+    bits.put_code(0x30 + symbol, 8);
+  } else if (symbol < 256) {
+    bits.put_code(0x190 + symbol - 144, 9);
+  } else if (symbol < 280) {
+    bits.put_code(symbol - 256, 7);
+  } else {
+    bits.put_code(0xc0 + symbol - 280, 8);
+  }
+}
+
+void put_fixed_match(DeflateBits& bits, uint32_t len, uint32_t dist) {
+  uint32_t l = std::upper_bound(DEFLATE_LEN_BASE.begin(),
+      DEFLATE_LEN_BASE.end(), len) - DEFLATE_LEN_BASE.begin() - 1;
+  put_fixed_symbol(bits, 257 + l);
+  bits.put(len - DEFLATE_LEN_BASE[l], DEFLATE_LEN_EXTRA[l]);
+  uint32_t d = std::upper_bound(DEFLATE_DIST_BASE.begin(),
+      DEFLATE_DIST_BASE.end(), dist) - DEFLATE_DIST_BASE.begin() - 1;
+  bits.put_code(d, 5);
+  bits.put(dist - DEFLATE_DIST_BASE[d], DEFLATE_DIST_EXTRA[d]);
+}
+
+uint32_t lz_hash(const uint8_t* p) {
+  uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+   A zlib stream of a single deflate block with the fixed Huffman codes.
+   The matches are found greedily on hash chains over the window. The
+   renders are mostly flat background, so this gets most of what a full
+   encoder would without the cost of building the dynamic codes.
+*/
+vector<uint8_t> zlib_fixed(const vector<uint8_t>& raw) {
+  vector<uint8_t> out = {0x78, 0x01};
+  out.reserve(raw.size() / 4 + 64);
+  DeflateBits bits(out);
+  // final block, fixed codes
+  bits.put(1, 1);
+  bits.put(1, 2);
+
+  // head holds the last position of each hash, prev the position before
+  // each one in the window with the same hash
+  vector<int32_t> head(1 << LZ_HASH_BITS, -1);
+  vector<int32_t> prev(DEFLATE_WINDOW, -1);
+  auto insert = [&](size_t pos) {
+    uint32_t h = lz_hash(raw.data() + pos);
+    prev[pos % DEFLATE_WINDOW] = head[h];
+    head[h] = (int32_t) pos;
+  };
+
+  size_t n = raw.size();
+  size_t pos = 0;
+  while (pos < n) {
+    uint32_t best_len = 0;
+    uint32_t best_dist = 0;
+    if (pos + DEFLATE_MIN_MATCH <= n) {
+      uint32_t max_len = (uint32_t) std::min(
+          (size_t) DEFLATE_MAX_MATCH, n - pos);
+      int32_t cand = head[lz_hash(raw.data() + pos)];
+      for (uint32_t chain = 0; cand >= 0 && chain < LZ_MAX_CHAIN &&
+          pos - cand <= DEFLATE_WINDOW; ++chain) {
+        const uint8_t* a = raw.data() + cand;
+        const uint8_t* b = raw.data() + pos;
+        uint32_t len = 0;
+        while (len < max_len && a[len] == b[len]) {
+          len += 1;
+        }
+        if (len > best_len) {
+          best_len = len;
+          best_dist = (uint32_t) (pos - cand);
+          if (len == max_len) {
+            break;
+          }
+        }
+        cand = prev[cand % DEFLATE_WINDOW];
+      }
+      insert(pos);
+    }
+
+    if (best_len >= DEFLATE_MIN_MATCH) {
+      put_fixed_match(bits, best_len, best_dist);
+      for (size_t i = pos + 1; i < pos + best_len &&
+          i + DEFLATE_MIN_MATCH <= n; ++i) {
+        insert(i);
+      }
+      pos += best_len;
+    } else {
+      put_fixed_symbol(bits, raw[pos]);
+      pos += 1;
+    }
+  }
+  put_fixed_symbol(bits, 256);
+  bits.flush();
+
+  // the sums are reduced before they can overflow
+  uint32_t a = 1;
+  uint32_t b = 0;
+  for (size_t i = 0; i < n; ) {
+    size_t end = std::min(n, i + 5552);
+    for (; i < end; ++i) {
+      a += raw[i];
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  append_u32_be(out, (b << 16) | a);
+  return out;
+}
+
+bool write_png_file(const string& path, uint32_t width, uint32_t height,
+    const vector<uint8_t>& rgba) {
+  if (rgba.size() != (size_t) width * height * 4) {
+    return false;
+  }
+  // each row starts with its filter type, of none, sub and up the one
+  // with the smallest sum of the filtered bytes taken as signed, the
+  // usual heuristic
+  size_t row_size = (size_t) width * 4;
+  vector<uint8_t> raw;
+  raw.reserve((row_size + 1) * height);
+  array<vector<uint8_t>, 3> filtered;
+  for (auto& f : filtered) {
+    f.resize(row_size);
+  }
+  for (uint32_t y = 0; y < height; ++y) {
+    const uint8_t* row = rgba.data() + y * row_size;
+    const uint8_t* above = y > 0 ? row - row_size : nullptr;
+    array<uint64_t, 3> costs = {0, 0, 0};
+    for (size_t i = 0; i < row_size; ++i) {
+      uint8_t left = i >= 4 ? row[i - 4] : 0;
+      uint8_t up = above ? above[i] : 0;
+      filtered[0][i] = row[i];
+      filtered[1][i] = row[i] - left;
+      filtered[2][i] = row[i] - up;
+      for (uint32_t f = 0; f < filtered.size(); ++f) {
+        costs[f] += std::abs((int) (int8_t) filtered[f][i]);
+      }
+    }
+    uint32_t best = std::min_element(costs.begin(), costs.end()) -
+      costs.begin();
+    raw.push_back((uint8_t) best);
+    raw.insert(raw.end(), filtered[best].begin(), filtered[best].end());
+  }
+
+  vector<uint8_t> ihdr;
+  append_u32_be(ihdr, width);
+  append_u32_be(ihdr, height);
+  // 8 bits per channel, RGBA, deflate, adaptive filtering, no interlace
+  ihdr.insert(ihdr.end(), {8, 6, 0, 0, 0});
+
+  vector<uint8_t> png(PNG_SIGNATURE, PNG_SIGNATURE + sizeof(PNG_SIGNATURE));
+  append_png_chunk(png, "IHDR", ihdr);
+  append_png_chunk(png, "IDAT", zlib_fixed(raw));
+  append_png_chunk(png, "IEND", {});
+
+  string tmp_path = path + ".tmp";
+  FILE* file = fopen(tmp_path.c_str(), "wb");
+  if (!file) {
+    printf("cannot open the image file %s\n", tmp_path.c_str());
+    return false;
+  }
+  bool ok = fwrite(png.data(), 1, png.size(), file) == png.size();
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    printf("failed to write the image file %s\n", path.c_str());
+    remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+void PngWriterPool::start(uint32_t num_threads) {
+  for (uint32_t i = 0; i < num_threads; ++i) {
+    workers.emplace_back(&PngWriterPool::run_worker, this);
+  }
+}
+
+void PngWriterPool::submit(const string& path, uint32_t width,
+    uint32_t height, vector<uint8_t> rgba) {
+  assert(!workers.empty());
+  {
+    lock_guard<mutex> lock(task_mutex);
+    tasks.push_back({path, width, height, std::move(rgba)});
+    num_pending += 1;
+  }
+  task_cond.notify_all();
+}
+
+uint32_t PngWriterPool::wait() {
+  unique_lock<mutex> lock(task_mutex);
+  task_cond.wait(lock, [&] { return num_pending == 0; });
+  uint32_t failed = num_failed;
+  num_failed = 0;
+  return failed;
+}
+
+PngWriterPool::~PngWriterPool() {
+  {
+    lock_guard<mutex> lock(task_mutex);
+    quitting = true;
+  }
+  task_cond.notify_all();
+  for (thread& worker : workers) {
+    worker.join();
+  }
+}
+
+void PngWriterPool::run_worker() {
+  unique_lock<mutex> lock(task_mutex);
+  while (true) {
+    task_cond.wait(lock, [&] { return !tasks.empty() || quitting; });
+    if (tasks.empty()) {
+      break;
+    }
+    PngTask task = std::move(tasks.front());
+    tasks.pop_front();
+    lock.unlock();
+    bool ok = write_png_file(task.path, task.width, task.height, task.rgba);
+    lock.lock();
+    num_failed += ok ? 0 : 1;
+    num_pending -= 1;
+    task_cond.notify_all();
+  }
+}
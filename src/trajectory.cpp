@@ -0,0 +1,401 @@
+#include "trajectory.h"
+
+#include <cassert>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef MORPH_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// fast levels keep the writer ahead of the simulation
+const int TRAJECTORY_ZSTD_LEVEL = 1;
+// the frames are large, so buffer the file writes in big blocks
+const size_t TRAJECTORY_FILE_BUFFER_SIZE = 4 * 1024 * 1024;
+// playback keeps this many frames on either side of the current one ready
+const uint32_t TRAJECTORY_PREFETCH_RADIUS = 4;
+
+bool trajectory_zstd_supported() {
+#ifdef MORPH_HAVE_ZSTD
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool TrajectoryWriter::open(const string& path, uint32_t attribs,
+    bool compact, bool compress, uint32_t num_instances) {
+  assert(!is_open());
+  file = fopen(path.c_str(), "wb");
+  if (!file) {
+    printf("cannot open the trajectory file %s\n", path.c_str());
+    return false;
+  }
+  setvbuf(file, nullptr, _IOFBF, TRAJECTORY_FILE_BUFFER_SIZE);
+
+  header = TrajectoryHeader();
+  memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+  header.attribs = attribs;
+  header.compact = compact ? 1 : 0;
+  header.compression = compress && trajectory_zstd_supported() ?
+    TRAJECTORY_ZSTD : TRAJECTORY_UNCOMPRESSED;
+  header.num_instances = num_instances;
+  if (fwrite(&header, sizeof(header), 1, file) != 1) {
+    printf("cannot write the trajectory file %s\n", path.c_str());
+    fclose(file);
+    file = nullptr;
+    return false;
+  }
+
+  index.clear();
+  error.clear();
+  closing = false;
+  writer_thread = thread(&TrajectoryWriter::run_writer, this);
+  return true;
+}
+
+void TrajectoryWriter::write_frame(uint32_t iter_num, uint32_t node_count,
+    const void* data, size_t size) {
+  assert(is_open());
+  PendingFrame frame;
+  frame.header.iter_num = iter_num;
+  frame.header.node_count = node_count;
+  frame.header.raw_size = size;
+  frame.data = data;
+  {
+    lock_guard<mutex> lock(queue_mutex);
+    queue.push_back(frame);
+  }
+  queue_cond.notify_all();
+}
+
+void TrajectoryWriter::wait_for_pending(uint32_t max_pending) {
+  unique_lock<mutex> lock(queue_mutex);
+  queue_cond.wait(lock, [&] { return queue.size() <= max_pending; });
+}
+
+uint32_t TrajectoryWriter::frame_count() {
+  lock_guard<mutex> lock(queue_mutex);
+  return index.size();
+}
+
+string TrajectoryWriter::first_error() {
+  lock_guard<mutex> lock(queue_mutex);
+  return error;
+}
+
+void TrajectoryWriter::set_error(const string& message) {
+  lock_guard<mutex> lock(queue_mutex);
+  if (error.empty()) {
+    error = message;
+  }
+}
+
+bool TrajectoryWriter::close() {
+  if (!is_open()) {
+    return error.empty();
+  }
+  {
+    lock_guard<mutex> lock(queue_mutex);
+    closing = true;
+  }
+  queue_cond.notify_all();
+  writer_thread.join();
+
+  // without the index the reader reports the file as unfinished, which
+  // it is if a frame was dropped
+  if (error.empty()) {
+    TrajectoryFooter footer;
+    footer.index_offset = ftello(file);
+    footer.frame_count = index.size();
+    memcpy(footer.magic, TRAJECTORY_INDEX_MAGIC, sizeof(footer.magic));
+    if (fwrite(index.data(), sizeof(TrajectoryIndexEntry), index.size(),
+          file) != index.size() ||
+        fwrite(&footer, sizeof(footer), 1, file) != 1) {
+      set_error(string("cannot write the index: ") + strerror(errno));
+    }
+  }
+  if (fclose(file) != 0) {
+    set_error(string("cannot write the file: ") + strerror(errno));
+  }
+  file = nullptr;
+  return error.empty();
+}
+
+TrajectoryWriter::~TrajectoryWriter() {
+  close();
+}
+
+void TrajectoryWriter::run_writer() {
+  unique_lock<mutex> lock(queue_mutex);
+  while (true) {
+    queue_cond.wait(lock, [&] { return !queue.empty() || closing; });
+    if (queue.empty()) {
+      break;
+    }
+    PendingFrame frame = queue.front();
+    lock.unlock();
+    write_pending_frame(frame);
+    lock.lock();
+    queue.pop_front();
+    queue_cond.notify_all();
+  }
+}
+
+void TrajectoryWriter::write_pending_frame(PendingFrame& frame) {
+  // the frames after an error are dropped
+  if (!first_error().empty()) {
+    return;
+  }
+  TrajectoryIndexEntry entry;
+  entry.iter_num = frame.header.iter_num;
+  entry.node_count = frame.header.node_count;
+  entry.offset = ftello(file);
+
+  const void* payload = frame.data;
+  frame.header.stored_size = frame.header.raw_size;
+#ifdef MORPH_HAVE_ZSTD
+  if (header.compression == TRAJECTORY_ZSTD) {
+    compressed.resize(ZSTD_compressBound(frame.header.raw_size));
+    size_t compressed_size = ZSTD_compress(compressed.data(),
+        compressed.size(), frame.data, frame.header.raw_size,
+        TRAJECTORY_ZSTD_LEVEL);
+    if (ZSTD_isError(compressed_size)) {
+      set_error(string("cannot compress a frame: ") +
+          ZSTD_getErrorName(compressed_size));
+      return;
+    }
+    payload = compressed.data();
+    frame.header.stored_size = compressed_size;
+  }
+#endif
+  if (fwrite(&frame.header, sizeof(frame.header), 1, file) != 1 ||
+      fwrite(payload, 1, frame.header.stored_size, file) !=
+        frame.header.stored_size) {
+    set_error(string("cannot write a frame: ") + strerror(errno));
+    return;
+  }
+
+  lock_guard<mutex> lock(queue_mutex);
+  index.push_back(entry);
+}
+
+bool TrajectoryReader::open(const string& path) {
+  assert(!is_open());
+  fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    printf("cannot open the trajectory file %s\n", path.c_str());
+    return false;
+  }
+  struct stat file_stat;
+  fstat(fd, &file_stat);
+  map_size = file_stat.st_size;
+  if (map_size < sizeof(TrajectoryHeader) + sizeof(TrajectoryFooter)) {
+    printf("%s is not a trajectory file\n", path.c_str());
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+  void* mapping = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    printf("cannot map the trajectory file %s\n", path.c_str());
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+  map_data = (const char*) mapping;
+
+  memcpy(&header, map_data, sizeof(header));
+  TrajectoryFooter footer;
+  memcpy(&footer, map_data + map_size - sizeof(footer), sizeof(footer));
+  const char* error = nullptr;
+  if (memcmp(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TRAJECTORY_VERSION) {
+    error = "is not a trajectory file of this version";
+  } else if (memcmp(footer.magic, TRAJECTORY_INDEX_MAGIC,
+        sizeof(footer.magic)) != 0 ||
+      footer.index_offset + footer.frame_count *
+        sizeof(TrajectoryIndexEntry) + sizeof(footer) != map_size) {
+    error = "has no index, the recording did not finish";
+  } else if (header.compression == TRAJECTORY_ZSTD &&
+      !trajectory_zstd_supported()) {
+    error = "is zstd compressed, which this build cannot read";
+  } else if (header.compression > TRAJECTORY_ZSTD ||
+      header.num_instances == 0) {
+    error = "has an invalid header";
+  }
+  index = (const TrajectoryIndexEntry*) (map_data + footer.index_offset);
+  num_frames = footer.frame_count;
+  for (uint32_t i = 0; i < num_frames && !error; ++i) {
+    const TrajectoryIndexEntry& entry = index[i];
+    if (entry.offset + sizeof(TrajectoryFrameHeader) > footer.index_offset ||
+        entry.offset + sizeof(TrajectoryFrameHeader) +
+          frame_header(i).stored_size > footer.index_offset ||
+        frame_header(i).node_count != entry.node_count ||
+        (header.compression == TRAJECTORY_UNCOMPRESSED &&
+          frame_header(i).raw_size != frame_header(i).stored_size)) {
+      error = "has a corrupt frame";
+    }
+  }
+  if (error) {
+    printf("trajectory file %s %s\n", path.c_str(), error);
+    close();
+    return false;
+  }
+
+  stopping = false;
+  prefetch_requested = false;
+  decoded.clear();
+  prefetch_thread = thread(&TrajectoryReader::run_prefetcher, this);
+  return true;
+}
+
+void TrajectoryReader::close() {
+  if (prefetch_thread.joinable()) {
+    {
+      lock_guard<mutex> lock(prefetch_mutex);
+      stopping = true;
+    }
+    prefetch_cond.notify_all();
+    prefetch_thread.join();
+  }
+  decoded.clear();
+  if (map_data) {
+    munmap((void*) map_data, map_size);
+    map_data = nullptr;
+  }
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+  index = nullptr;
+  num_frames = 0;
+}
+
+TrajectoryReader::~TrajectoryReader() {
+  close();
+}
+
+const TrajectoryIndexEntry& TrajectoryReader::frame_entry(
+    uint32_t frame_index) const {
+  assert(frame_index < num_frames);
+  return index[frame_index];
+}
+
+uint32_t TrajectoryReader::find_frame(uint32_t iter_num) const {
+  // the frames are in iter order
+  uint32_t lo = 0;
+  uint32_t hi = num_frames;
+  while (hi - lo > 1) {
+    uint32_t mid = (lo + hi) / 2;
+    if (index[mid].iter_num <= iter_num) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+const TrajectoryFrameHeader& TrajectoryReader::frame_header(
+    uint32_t frame_index) const {
+  return *(const TrajectoryFrameHeader*) (map_data + index[frame_index].offset);
+}
+
+const char* TrajectoryReader::frame_payload(uint32_t frame_index) const {
+  return map_data + index[frame_index].offset + sizeof(TrajectoryFrameHeader);
+}
+
+uint32_t TrajectoryReader::frame_size(uint32_t frame_index) const {
+  return frame_header(frame_index).raw_size;
+}
+
+bool TrajectoryReader::decode_frame(uint32_t frame_index, void* dst) const {
+  const TrajectoryFrameHeader& frame = frame_header(frame_index);
+#ifdef MORPH_HAVE_ZSTD
+  if (header.compression == TRAJECTORY_ZSTD) {
+    size_t decoded_size = ZSTD_decompress(dst, frame.raw_size,
+        frame_payload(frame_index), frame.stored_size);
+    return !ZSTD_isError(decoded_size) && decoded_size == frame.raw_size;
+  }
+#endif
+  memcpy(dst, frame_payload(frame_index), frame.raw_size);
+  return true;
+}
+
+bool TrajectoryReader::copy_frame(uint32_t frame_index, void* dst) {
+  assert(frame_index < num_frames);
+  shared_ptr<vector<char>> cached;
+  {
+    lock_guard<mutex> lock(prefetch_mutex);
+    auto it = decoded.find(frame_index);
+    if (it != decoded.end()) {
+      cached = it->second;
+    }
+    prefetch_center = frame_index;
+    prefetch_requested = true;
+  }
+  prefetch_cond.notify_all();
+
+  if (cached) {
+    memcpy(dst, cached->data(), cached->size());
+    return true;
+  }
+  return decode_frame(frame_index, dst);
+}
+
+void TrajectoryReader::run_prefetcher() {
+  unique_lock<mutex> lock(prefetch_mutex);
+  while (true) {
+    prefetch_cond.wait(lock, [&] { return prefetch_requested || stopping; });
+    if (stopping) {
+      break;
+    }
+    prefetch_requested = false;
+    uint32_t center = prefetch_center;
+    uint32_t first = center > TRAJECTORY_PREFETCH_RADIUS ?
+      center - TRAJECTORY_PREFETCH_RADIUS : 0;
+    uint32_t last = std::min(num_frames - 1,
+        center + TRAJECTORY_PREFETCH_RADIUS);
+
+    // drop the frames that are out of range
+    for (auto it = decoded.begin(); it != decoded.end();) {
+      if (it->first < first || it->first > last) {
+        it = decoded.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    // the frames after the center first, playback mostly moves forward
+    for (uint32_t i = center; i <= last + (center - first); ++i) {
+      uint32_t frame_index = i <= last ? i : center - (i - last);
+      if (prefetch_requested || stopping) {
+        break;
+      }
+      if (header.compression == TRAJECTORY_UNCOMPRESSED) {
+        // ask the kernel to page the frame in ahead of the copy
+        const TrajectoryIndexEntry& entry = index[frame_index];
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t start = entry.offset / page_size * page_size;
+        size_t end = entry.offset + sizeof(TrajectoryFrameHeader) +
+          frame_header(frame_index).stored_size;
+        lock.unlock();
+        madvise((void*) (map_data + start), end - start, MADV_WILLNEED);
+        lock.lock();
+      } else if (decoded.find(frame_index) == decoded.end()) {
+        lock.unlock();
+        auto frame_data = make_shared<vector<char>>(frame_size(frame_index));
+        bool decoded_ok = decode_frame(frame_index, frame_data->data());
+        lock.lock();
+        // a corrupt frame is left for copy_frame to report
+        if (decoded_ok) {
+          decoded[frame_index] = frame_data;
+        }
+      }
+    }
+  }
+}
@@ -1,4 +1,7 @@
 #include "types.h"
+#include "glm/gtc/packing.hpp"
+
+#include <cstring>
 
 Camera::Camera()
 {
@@ -93,6 +96,93 @@ array<void*, ATTRIBUTES_COUNT> MorphNodes::data_ptrs() {
   };
 }
 
+array<vector<vec4>*, ATTRIBUTES_COUNT> MorphNodes::attrib_vecs() {
+  return {
+    &pos_vec, &vel_vec, &neighbors_vec, &data_vec, &top_data_vec
+  };
+}
+
+VkFormat node_attrib_format(bool compact, uint32_t attrib_index) {
+  if (!compact || attrib_index == ATTRIB_POS) {
+    return VK_FORMAT_R32G32B32A32_SFLOAT;
+  } else if (attrib_index == ATTRIB_NEIGHBORS ||
+      attrib_index == ATTRIB_TOP_DATA) {
+    return VK_FORMAT_R16G16B16A16_SINT;
+  } else {
+    return VK_FORMAT_R16G16B16A16_SFLOAT;
+  }
+}
+
+uint32_t node_attrib_stride(bool compact, uint32_t attrib_index) {
+  switch (node_attrib_format(compact, attrib_index)) {
+    case VK_FORMAT_R16G16B16A16_SINT:
+    case VK_FORMAT_R16G16B16A16_SFLOAT:
+      return 4 * sizeof(uint16_t);
+    default:
+      return sizeof(vec4);
+  }
+}
+
+VkFormat node_normal_format(bool compact) {
+  return compact ? VK_FORMAT_R16G16B16A16_SFLOAT :
+    VK_FORMAT_R32G32B32A32_SFLOAT;
+}
+
+uint32_t node_normal_stride(bool compact) {
+  return compact ? 4 * sizeof(uint16_t) : sizeof(vec4);
+}
+
+void MorphNodes::pack_attrib(uint32_t attrib_index, bool compact,
+    void* dst) {
+  vector<vec4>& vals = *attrib_vecs()[attrib_index];
+  switch (node_attrib_format(compact, attrib_index)) {
+    case VK_FORMAT_R16G16B16A16_SINT: {
+      int16_t* out = (int16_t*) dst;
+      for (size_t i = 0; i < vals.size(); ++i) {
+        for (int j = 0; j < 4; ++j) {
+          out[4 * i + j] = (int16_t) vals[i][j];
+        }
+      }
+      break;
+    }
+    case VK_FORMAT_R16G16B16A16_SFLOAT: {
+      uint64_t* out = (uint64_t*) dst;
+      for (size_t i = 0; i < vals.size(); ++i) {
+        out[i] = packHalf4x16(vals[i]);
+      }
+      break;
+    }
+    default:
+      memcpy(dst, vals.data(), sizeof(vec4) * vals.size());
+      break;
+  }
+}
+
+void MorphNodes::unpack_attrib(uint32_t attrib_index, bool compact,
+    const void* src) {
+  vector<vec4>& vals = *attrib_vecs()[attrib_index];
+  switch (node_attrib_format(compact, attrib_index)) {
+    case VK_FORMAT_R16G16B16A16_SINT: {
+      const int16_t* in = (const int16_t*) src;
+      for (size_t i = 0; i < vals.size(); ++i) {
+        vals[i] = vec4(in[4 * i], in[4 * i + 1],
+            in[4 * i + 2], in[4 * i + 3]);
+      }
+      break;
+    }
+    case VK_FORMAT_R16G16B16A16_SFLOAT: {
+      const uint64_t* in = (const uint64_t*) src;
+      for (size_t i = 0; i < vals.size(); ++i) {
+        vals[i] = unpackHalf4x16(in[i]);
+      }
+      break;
+    }
+    default:
+      memcpy(vals.data(), src, sizeof(vec4) * vals.size());
+      break;
+  }
+}
+
 string raw_node_str(MorphNode const& node) {
   array<char, 200> s;
   sprintf(s.data(),
@@ -130,25 +220,53 @@ ComputeStorage::ComputeStorage()
 {
 }
 
-RenderPushConstants::RenderPushConstants(mat4 model, mat4 view,
-    mat4 proj, const vector<UserUnif>& user_unifs) :
-  model(model), view(view), proj(proj)
+RenderPushConstants::RenderPushConstants(mat4 model,
+    const vector<UserUnif>& user_unifs) :
+  model(model)
 {
   set_user_unif_vals(user_unifs, user_unif_vals);  
 }
 
 ComputePushConstants::ComputePushConstants(
-    uint32_t node_count, uint32_t inactive_node_count,
-    uint32_t iter_num, uint32_t queue_len,
-    const vector<UserUnif>& user_unifs) :
-  node_count(node_count), inactive_node_count(inactive_node_count),
-  iter_num(iter_num), queue_len(queue_len)
+    uint32_t iter_num, uint32_t queue_len, uint32_t instance_count,
+    uint32_t node_count) :
+  iter_num(iter_num), queue_len(queue_len), instance_count(instance_count),
+  node_count(node_count)
 {
-  set_user_unif_vals(user_unifs, user_unif_vals);  
+}
+
+VkDeviceSize SimInstance::record_size(uint32_t num_user_unifs) {
+  // a uvec4 header followed by a vec4 per user unif
+  return sizeof(uvec4) + sizeof(vec4) * num_user_unifs;
+}
+
+void SimInstance::pack(uint32_t num_user_unifs, void* dst) const {
+  assert(user_unif_vals.size() == num_user_unifs);
+  uvec4 header(node_offset, node_count, inactive_node_count, seed);
+  char* bytes = (char*) dst;
+  memcpy(bytes, &header, sizeof(header));
+  memcpy(bytes + sizeof(header), user_unif_vals.data(),
+      sizeof(vec4) * num_user_unifs);
+}
+
+SimInstance SimInstance::unpack(uint32_t num_user_unifs, const void* src) {
+  const char* bytes = (const char*) src;
+  uvec4 header;
+  memcpy(&header, bytes, sizeof(header));
+  SimInstance instance;
+  instance.node_offset = header.x;
+  instance.node_count = header.y;
+  instance.inactive_node_count = header.z;
+  instance.seed = header.w;
+  instance.user_unif_vals.resize(num_user_unifs);
+  memcpy(instance.user_unif_vals.data(), bytes + sizeof(header),
+      sizeof(vec4) * num_user_unifs);
+  return instance;
 }
 
 BufferState::BufferState()
 {
+  compute_desc_sets.fill(VK_NULL_HANDLE);
 }
 
 AppState::AppState()
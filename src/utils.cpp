@@ -36,6 +36,77 @@ the mesh every frame but does not change the iteration num automatically.
 To run the simulation forwards or backwards, change the "delta iters per frame" to +/-1.
 While animating, the app runs "iter num" iterations every frame, so it may be slow.
 
+reorder interval:
+Every this many iterations the nodes are sorted along a space-filling curve
+so that neighbors are close in memory. 0 disables it.
+
+compact nodes:
+Stores vel and data as half floats and the neighbor indices as 16-bit ints,
+which cuts the node memory and bandwidth by 40%. Velocity and data lose
+precision, so results can drift from the full format over long runs.
+
+async simulation:
+Only shown if the device has a second queue for compute. The simulation is
+submitted there one reorder chunk at a time and the UI keeps running, the
+nodes update once it finishes.
+
+frame pacing:
+Target fps limits the frame rate, 0 for no limit. Mailbox and immediate
+present without waiting for vsync, if the display supports them. Sim first
+submits the next async simulation chunk as soon as the last one finishes
+while the frame loop waits, so long runs aren't slowed to the frame rate.
+Frames are only rendered when something changed: input, the camera, or new
+simulation results. Otherwise the app waits for input. While animating with
+a delta of 0, the simulation only reruns when the iter num or an input of
+the run changes.
+
+gpu cull:
+Each frame a compute pass drops the points and lines outside the view before
+they are drawn. Lod pixels thins out points that are closer than this many
+pixels to their neighbor on screen, 0 keeps them all. Triangles are always
+drawn in full.
+
+lines as tubes:
+Draws each line as a tube, generated on the GPU every frame from the node
+positions. The radius is either constant or shrinks with the heat or heat
+generation of the nodes, down to a fifth of the tube radius.
+
+node inspector:
+Shows the attributes, neighbors and instance queue of the node under the
+cursor, read from the rendered result. Click a neighbor to inspect it, pin
+to keep the node while moving the cursor away. The queue isn't read while
+an async simulation is running.
+
+parameter sweep:
+Simulates several instances together in one dispatch per iter, each with its
+own seed. With more than one instance, a component of one compute unif is
+spread over the sweep range across them. The instances are drawn side by side
+and share the node and queue limits.
+
+recording:
+Record next run writes the checked attributes to a trajectory file every
+record interval iters of the next simulation run. The frames are copied to a
+staging ring on the GPU and written out on a separate thread, compressed with
+zstd if the build has it. See trajectory.h for the file layout.
+
+playback:
+Opens a recorded trajectory and shows its frames instead of the simulation,
+so a run can be scrubbed without simulating it. The file must have recorded
+pos and neighbors. Changing the simulation does nothing until the trajectory
+is closed.
+
+export:
+Writes the active nodes of the last run with their edges to a binary PLY
+(with the heat and source strength per vertex) or an ASCII OBJ, on a
+separate thread. The instances of a sweep are placed as they are drawn.
+
+snapshot:
+Save snapshot writes the nodes and compute storage after the last run. Once a
+snapshot is loaded, runs resume from its iter instead of starting over, with
+its seeds and unif values; the unif controls have no effect until it is
+unloaded. Snapshots only load into builds with the same node and queue limits
+and a morph.comp with the same compute unifs.
+
 )--";
 
 void print_backtrace() {